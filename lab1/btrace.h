@@ -0,0 +1,92 @@
+#ifndef _BTRACE_H_
+#define _BTRACE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Binary instruction trace: a header followed by one 12 byte record per
+ * executed instruction. Everything else in trace.txt / inst_trace.txt is
+ * derived from the records by trace_render.
+ */
+#define BTRACE_MAGIC		"SPBT"
+#define BTRACE_VERSION		1
+
+// which simulator wrote the trace, selects the text format to render
+#define BTRACE_FLAVOR_ISS	0	// lab1 iss, trace.txt
+#define BTRACE_FLAVOR_SP	1	// lab5 pipeline, inst_trace.txt
+
+// record flags
+#define BTRACE_TAKEN		1	// jump taken (reg is 7, value the link)
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int flavor;
+	unsigned int lines;			// lines reported by "program ... loaded"
+	unsigned int nameLength;	// followed by the program name, not terminated
+} btrace_header_t;
+
+typedef struct {
+	unsigned short pc;
+	unsigned char reg;		// register written, 0 if none
+	unsigned char flags;
+	unsigned int inst;
+	int value;				// value written to reg, or word loaded / stored
+} btrace_rec_t;
+
+#define BTRACE_BUFFER_RECORDS	4096
+
+typedef struct {
+	FILE* fp;
+	int count;
+	btrace_rec_t buf[BTRACE_BUFFER_RECORDS];
+} btrace_t;
+
+static inline btrace_t* btrace_open(char* filename, int flavor, char* programName, int lines) {
+	btrace_header_t header;
+	btrace_t* bt;
+
+	bt = (btrace_t*) calloc(1, sizeof(btrace_t));
+	if (bt == NULL)
+		return NULL;
+	bt->fp = fopen(filename, "wb");
+	if (bt->fp == NULL) {
+		free(bt);
+		return NULL;
+	}
+	memcpy(header.magic, BTRACE_MAGIC, 4);
+	header.version = BTRACE_VERSION;
+	header.flavor = flavor;
+	header.lines = lines;
+	header.nameLength = strlen(programName);
+	fwrite(&header, sizeof(header), 1, bt->fp);
+	fwrite(programName, 1, header.nameLength, bt->fp);
+	return bt;
+}
+
+static inline void btrace_flush(btrace_t* bt) {
+	fwrite(bt->buf, sizeof(btrace_rec_t), bt->count, bt->fp);
+	bt->count = 0;
+}
+
+static inline void btrace_write(btrace_t* bt, unsigned short pc, unsigned int inst, int reg, int flags, int value) {
+	btrace_rec_t* rec = &bt->buf[bt->count];
+
+	rec->pc = pc;
+	rec->reg = reg;
+	rec->flags = flags;
+	rec->inst = inst;
+	rec->value = value;
+	if (++bt->count == BTRACE_BUFFER_RECORDS)
+		btrace_flush(bt);
+}
+
+static inline void btrace_close(btrace_t* bt) {
+	btrace_flush(bt);
+	fclose(bt->fp);
+	free(bt);
+}
+
+#endif
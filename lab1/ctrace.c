@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ctrace.h"
+
+// a column at worst: its encoding, the first value and a miss per clock
+#define COLUMN_MAX	(1 + 5 + 7 * CTRACE_BLOCK_CLOCKS)
+
+struct ctrace_writer_s {
+	FILE *fp;
+	ctrace_header_t header;
+	unsigned int *columns;		// a block's values, by signal
+	int count;					// clocks in the block
+	unsigned char *block;		// the block encoded
+	unsigned char *scratch;		// a column another way
+	ctrace_block_t *index;
+	int maxBlocks;
+	unsigned long long offset;
+};
+
+static unsigned char *putVarint(unsigned char *p, unsigned int value) {
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+static unsigned char *getVarint(unsigned char *p, unsigned int *value) {
+	int shift = 0;
+
+	*value = 0;
+	do {
+		*value |= (*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
+// A column being encoded or decoded
+typedef struct {
+	int encoding;
+	unsigned int value;
+	unsigned int recent[CTRACE_RECENT_SIZE];	// CTRACE_RECENT, the latest first
+} column_t;
+
+static void columnStart(column_t *column, int encoding, unsigned int value) {
+	int i;
+
+	column->encoding = encoding;
+	column->value = value;
+	for (i = 0; i < CTRACE_RECENT_SIZE; i++)
+		column->recent[i] = value;
+}
+
+// Moves recent[k] to the front, value going there when k is a miss
+static void recentFront(column_t *column, int k, unsigned int value) {
+	if (k == CTRACE_RECENT_MISS)
+		k = CTRACE_RECENT_SIZE - 1;
+	memmove(column->recent + 1, column->recent, k * sizeof(unsigned int));
+	column->recent[0] = value;
+}
+
+// The step to value, 0 when it holds
+static unsigned int columnStep(column_t *column, unsigned int value) {
+	int delta = value - column->value, k;
+
+	if (column->encoding == CTRACE_XOR) {
+		delta = column->value ^ value;
+		column->value = value;
+		return delta;
+	}
+	if (column->encoding == CTRACE_DELTA) {
+		column->value = value;
+		return (delta << 1) ^ (delta >> 31);
+	}
+	for (k = 0; k < CTRACE_RECENT_SIZE && column->recent[k] != value; k++)
+		;
+	if (k == CTRACE_RECENT_SIZE)
+		k = CTRACE_RECENT_MISS;
+	recentFront(column, k, value);
+	column->value = value;
+	return k;
+}
+
+// literal is the value of a CTRACE_RECENT_MISS
+static unsigned int columnUnstep(column_t *column, unsigned int step, unsigned int literal) {
+	if (column->encoding == CTRACE_XOR)
+		column->value ^= step;
+	else if (column->encoding == CTRACE_DELTA)
+		column->value += (step >> 1) ^ -(step & 1);
+	else if (step != 0) {
+		column->value = step == CTRACE_RECENT_MISS ? literal : column->recent[step];
+		recentFront(column, step, column->value);
+	}
+	return column->value;
+}
+
+static int encodeColumn(unsigned int *values, int n, int encoding, unsigned char *out) {
+	column_t column;
+	unsigned char *p = out;
+	unsigned int s, run = 0, runStep = 0;
+	int i;
+
+	*p++ = encoding;
+	p = putVarint(p, values[0]);
+	columnStart(&column, encoding, values[0]);
+	for (i = 1; i < n; i++) {
+		s = columnStep(&column, values[i]);
+		if (run > 0 && s != runStep) {
+			p = putVarint(p, run);
+			p = putVarint(p, runStep);
+			run = 0;
+		}
+		// a miss goes alone, with its value
+		if (encoding == CTRACE_RECENT && s == CTRACE_RECENT_MISS) {
+			p = putVarint(p, 1);
+			p = putVarint(p, s);
+			p = putVarint(p, values[i]);
+			continue;
+		}
+		runStep = s;
+		run++;
+	}
+	if (run > 0) {
+		p = putVarint(p, run);
+		p = putVarint(p, runStep);
+	}
+	return p - out;
+}
+
+ctrace_writer_t *ctrace_create(char *filename, int nsignals, char **names, int *bits, int firstClock) {
+	ctrace_writer_t *writer;
+	ctrace_signal_t signal;
+	int i;
+
+	writer = (ctrace_writer_t *) calloc(1, sizeof(ctrace_writer_t));
+	if (writer == NULL)
+		return NULL;
+	writer->columns = (unsigned int *) malloc((nsignals + 1) * CTRACE_BLOCK_CLOCKS * sizeof(unsigned int));
+	writer->block = (unsigned char *) malloc((nsignals + 2) * sizeof(unsigned int) + nsignals * COLUMN_MAX);
+	writer->scratch = (unsigned char *) malloc(COLUMN_MAX);
+	writer->fp = fopen(filename, "wb");
+	if (writer->columns == NULL || writer->block == NULL || writer->scratch == NULL || writer->fp == NULL) {
+		if (writer->fp)
+			fclose(writer->fp);
+		free(writer->columns);
+		free(writer->block);
+		free(writer->scratch);
+		free(writer);
+		return NULL;
+	}
+	memcpy(writer->header.magic, CTRACE_MAGIC, 4);
+	writer->header.version = CTRACE_VERSION;
+	writer->header.nsignals = nsignals;
+	writer->header.blockClocks = CTRACE_BLOCK_CLOCKS;
+	writer->header.firstClock = firstClock;
+	fwrite(&writer->header, sizeof(ctrace_header_t), 1, writer->fp);
+	for (i = 0; i < nsignals; i++) {
+		memset(&signal, 0, sizeof(signal));
+		strncpy(signal.name, names[i], CTRACE_NAME - 1);
+		signal.bits = bits[i];
+		fwrite(&signal, sizeof(signal), 1, writer->fp);
+	}
+	writer->offset = sizeof(ctrace_header_t) + nsignals * sizeof(ctrace_signal_t);
+	return writer;
+}
+
+static void flushBlock(ctrace_writer_t *writer) {
+	int nsignals = writer->header.nsignals;
+	unsigned int *offsets = (unsigned int *) writer->block + 1;
+	unsigned char *p = writer->block + (nsignals + 2) * sizeof(unsigned int);
+	ctrace_block_t *block;
+	int i, encoding, size, best;
+
+	if (writer->count == 0)
+		return;
+	*(unsigned int *) writer->block = writer->count;
+	for (i = 0; i < nsignals; i++) {
+		offsets[i] = p - writer->block;
+		best = encodeColumn(writer->columns + i * CTRACE_BLOCK_CLOCKS, writer->count, CTRACE_XOR, p);
+		for (encoding = CTRACE_DELTA; encoding <= CTRACE_RECENT; encoding++) {
+			size = encodeColumn(writer->columns + i * CTRACE_BLOCK_CLOCKS, writer->count, encoding, writer->scratch);
+			if (size < best) {
+				memcpy(p, writer->scratch, size);
+				best = size;
+			}
+		}
+		p += best;
+	}
+	offsets[nsignals] = p - writer->block;
+	fwrite(writer->block, 1, offsets[nsignals], writer->fp);
+
+	if (writer->header.nblocks == writer->maxBlocks) {
+		writer->maxBlocks = writer->maxBlocks ? writer->maxBlocks * 2 : 256;
+		writer->index = (ctrace_block_t *) realloc(writer->index, writer->maxBlocks * sizeof(ctrace_block_t));
+	}
+	block = &writer->index[writer->header.nblocks++];
+	block->firstClock = writer->header.firstClock + writer->header.clocks;
+	block->clocks = writer->count;
+	block->offset = writer->offset;
+	writer->offset += offsets[nsignals];
+	writer->header.clocks += writer->count;
+	writer->count = 0;
+}
+
+void ctrace_write(ctrace_writer_t *writer, unsigned int *values) {
+	unsigned int *column = writer->columns + writer->count;
+	int i;
+
+	for (i = 0; i < writer->header.nsignals; i++, column += CTRACE_BLOCK_CLOCKS)
+		*column = values[i];
+	if (++writer->count == CTRACE_BLOCK_CLOCKS)
+		flushBlock(writer);
+}
+
+int ctrace_close(ctrace_writer_t *writer) {
+	int ok;
+
+	flushBlock(writer);
+	writer->header.index = writer->offset;
+	ok = writer->header.nblocks == 0 || writer->index != NULL;
+	ok = ok && fwrite(writer->index, sizeof(ctrace_block_t), writer->header.nblocks, writer->fp) == writer->header.nblocks;
+	ok = ok && fseek(writer->fp, 0, SEEK_SET) == 0 && fwrite(&writer->header, sizeof(ctrace_header_t), 1, writer->fp) == 1;
+	ok = fclose(writer->fp) == 0 && ok;
+	free(writer->columns);
+	free(writer->block);
+	free(writer->scratch);
+	free(writer->index);
+	free(writer);
+	return ok ? 0 : -1;
+}
+
+// The index of a trace that has none
+static int findBlocks(ctrace_t *trace) {
+	unsigned long long offset = sizeof(ctrace_header_t) + trace->header->nsignals * sizeof(ctrace_signal_t);
+	unsigned long long table = (trace->header->nsignals + 2) * sizeof(unsigned int);
+	unsigned int *block, end;
+	int max = 0, clock = trace->header->firstClock;
+
+	trace->found = 1;
+	for (; offset + table <= trace->size; offset += end) {
+		block = (unsigned int *) (trace->data + offset);
+		end = block[trace->header->nsignals + 1];
+		if (block[0] == 0 || block[0] > trace->header->blockClocks || end < table || offset + end > trace->size)
+			break;
+		if (trace->nblocks == max) {
+			max = max ? max * 2 : 256;
+			trace->blocks = (ctrace_block_t *) realloc(trace->blocks, max * sizeof(ctrace_block_t));
+			if (trace->blocks == NULL)
+				return -1;
+		}
+		trace->blocks[trace->nblocks].firstClock = clock;
+		trace->blocks[trace->nblocks].clocks = block[0];
+		trace->blocks[trace->nblocks].offset = offset;
+		trace->nblocks++;
+		clock += block[0];
+	}
+	trace->clocks = clock - trace->header->firstClock;
+	return 0;
+}
+
+ctrace_t *ctrace_open(char *filename) {
+	ctrace_t *trace;
+	ctrace_header_t *header;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ctrace_header_t) || (trace = calloc(1, sizeof(ctrace_t))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	trace->size = st.st_size;
+	trace->data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (trace->data == MAP_FAILED) {
+		free(trace);
+		return NULL;
+	}
+	header = trace->header = (ctrace_header_t *) trace->data;
+	if (memcmp(header->magic, CTRACE_MAGIC, 4) != 0 || header->version != CTRACE_VERSION ||
+	    sizeof(ctrace_header_t) + header->nsignals * sizeof(ctrace_signal_t) > trace->size ||
+	    (header->index != 0 && (header->index + header->nblocks * sizeof(ctrace_block_t) > trace->size ||
+				    sizeof(ctrace_header_t) + header->nsignals * sizeof(ctrace_signal_t) > header->index))) {
+		ctrace_free(trace);
+		return NULL;
+	}
+	trace->signals = (ctrace_signal_t *) (header + 1);
+	if (header->index == 0) {
+		if (findBlocks(trace) != 0) {
+			ctrace_free(trace);
+			return NULL;
+		}
+		return trace;
+	}
+	trace->blocks = (ctrace_block_t *) (trace->data + header->index);
+	trace->nblocks = header->nblocks;
+	trace->clocks = header->clocks;
+	return trace;
+}
+
+int ctrace_find(ctrace_t *trace, char *name) {
+	int i;
+
+	for (i = 0; i < trace->header->nsignals; i++)
+		if (strncmp(trace->signals[i].name, name, CTRACE_NAME) == 0)
+			return i;
+	return -1;
+}
+
+int ctrace_read(ctrace_t *trace, int signal, int from, int to, unsigned int *values) {
+	ctrace_header_t *header = trace->header;
+	ctrace_block_t *block;
+	unsigned char *p;
+	column_t column;
+	unsigned int value, run, s, literal = 0;
+	int lo = 0, hi = trace->nblocks, mid, clock, encoding, n = 0;
+
+	if (from < header->firstClock)
+		from = header->firstClock;
+	if (to > header->firstClock + trace->clocks)
+		to = header->firstClock + trace->clocks;
+	// the first block ending after from
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (trace->blocks[mid].firstClock + trace->blocks[mid].clocks <= from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (block = trace->blocks + lo; block < trace->blocks + trace->nblocks && block->firstClock < to; block++) {
+		p = (unsigned char *) trace->data + block->offset;
+		p += ((unsigned int *) p)[signal + 1];
+		encoding = *p++;
+		p = getVarint(p, &value);
+		columnStart(&column, encoding, value);
+		clock = block->firstClock;
+		if (clock >= from)
+			values[n++] = value;
+		for (clock++; clock < block->firstClock + block->clocks && clock < to; ) {
+			p = getVarint(p, &run);
+			p = getVarint(p, &s);
+			if (encoding == CTRACE_RECENT && s == CTRACE_RECENT_MISS)
+				p = getVarint(p, &literal);
+			// a run of no change before the range is skipped at once
+			if (s == 0 && clock + run <= from) {
+				clock += run;
+				continue;
+			}
+			for (; run > 0 && clock < to; run--, clock++) {
+				value = columnUnstep(&column, s, literal);
+				if (clock >= from)
+					values[n++] = value;
+			}
+		}
+	}
+	return n;
+}
+
+void ctrace_free(ctrace_t *trace) {
+	if (trace->found)
+		free(trace->blocks);
+	munmap(trace->data, trace->size);
+	free(trace);
+}
@@ -0,0 +1,104 @@
+#ifndef _CTRACE_H_
+#define _CTRACE_H_
+
+/*
+ * Binary cycle trace: the value of every signal at every clock, stored by
+ * column. The clocks are cut in blocks of CTRACE_BLOCK_CLOCKS. In a block,
+ * each signal is a column that starts with its first value, then holds
+ * runs of equal steps from one clock to the next, a step being the XOR or
+ * the difference of the two values, or where the value is among the ones
+ * it last had, whichever encodes smaller. So a signal that holds costs a
+ * couple of bytes a block, as does a counter, and one going around a few
+ * values, like the instruction of a loop, a byte a change.
+ *
+ *	header			nsignals, clocks, where the index is
+ *	signal table
+ *	blocks			each its clocks and where its columns are, then the columns
+ *	index			by block, its first clock and where it is
+ *
+ * A reader goes from the index to the block and from the block's table
+ * to the column, so it only touches the blocks of the clocks it asks for,
+ * and only their column of the signal. The index is written last, a
+ * trace without it, from a run that was killed, is read by going from
+ * block to block.
+ */
+#define CTRACE_MAGIC		"SPCT"
+#define CTRACE_VERSION		1
+#define CTRACE_NAME			64
+#define CTRACE_BLOCK_CLOCKS	4096
+
+// column encodings
+#define CTRACE_XOR			0
+#define CTRACE_DELTA		1
+#define CTRACE_RECENT		2
+
+#define CTRACE_RECENT_SIZE	8
+#define CTRACE_RECENT_MISS	CTRACE_RECENT_SIZE
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int nsignals;		// followed by the signal table
+	unsigned int blockClocks;
+	int firstClock;
+	int clocks;
+	unsigned int nblocks;
+	unsigned int pad;
+	unsigned long long index;	// file offset of the index, 0 until the trace is closed
+} ctrace_header_t;
+
+typedef struct {
+	char name[CTRACE_NAME];		// unit.stage.name, or unit.name
+	unsigned int bits;
+} ctrace_signal_t;
+
+typedef struct {
+	int firstClock;
+	int clocks;
+	unsigned long long offset;
+} ctrace_block_t;
+
+/*
+ * A block starts with its number of clocks and nsignals + 1 offsets from
+ * its start, of each column and of its end. A column is its encoding
+ * byte, then varints (7 bits a byte, low first): the first value, then
+ * pairs of a run length and the step repeated over it, differences being
+ * zigzag encoded. With CTRACE_RECENT the step is where the value is among
+ * the CTRACE_RECENT_SIZE last ones, the latest first, 0 being no change,
+ * and the value goes first. CTRACE_RECENT_MISS is a value not among them,
+ * a run of one followed by the value. They all start as the first value.
+ */
+
+/*
+ * Writing. ctrace_create() returns NULL if the file can't be written, then
+ * each clock ctrace_write() takes the value of every signal, in the order
+ * of names. ctrace_close() writes the index, and returns 0 or -1.
+ */
+typedef struct ctrace_writer_s ctrace_writer_t;
+
+ctrace_writer_t *ctrace_create(char *filename, int nsignals, char **names, int *bits, int firstClock);
+void ctrace_write(ctrace_writer_t *writer, unsigned int *values);
+int ctrace_close(ctrace_writer_t *writer);
+
+/*
+ * Reading. ctrace_open() maps the file, it returns NULL if it is not a
+ * cycle trace. ctrace_read() gives a signal's values for the clocks
+ * from to to - 1 as far as the trace has them, and returns how many.
+ */
+typedef struct {
+	char *data;
+	unsigned long long size;
+	ctrace_header_t *header;
+	ctrace_signal_t *signals;
+	ctrace_block_t *blocks;		// the index, or found going through the blocks
+	int nblocks;
+	int clocks;
+	int found;
+} ctrace_t;
+
+ctrace_t *ctrace_open(char *filename);
+int ctrace_find(ctrace_t *trace, char *name);		// the signal, or -1
+int ctrace_read(ctrace_t *trace, int signal, int from, int to, unsigned int *values);
+void ctrace_free(ctrace_t *trace);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Prints a binary cycle trace, see ctrace.h, which llsim -t writes.
+ *
+ * usage: ctrace_dump trace [signal [from [to]]]
+ *   without a signal, lists the signals and the clocks the trace holds;
+ *   with one, prints its value at each clock from from to to - 1, one
+ *   "clock value" line each
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ctrace.h"
+
+#define CHUNK_CLOCKS	65536
+
+int main(int argc, char *argv[]) {
+	ctrace_t *trace;
+	unsigned int *values;
+	int signal, from, to, n, i;
+
+	if (argc < 2 || argc > 5) {
+		printf("usage: ctrace_dump trace [signal [from [to]]]\n");
+		return 1;
+	}
+	trace = ctrace_open(argv[1]);
+	if (trace == NULL) {
+		printf("couldn't open cycle trace %s\n", argv[1]);
+		return 1;
+	}
+	if (argc == 2) {
+		printf("clocks %d to %d, %d blocks%s\n", trace->header->firstClock,
+			trace->header->firstClock + trace->clocks - 1, trace->nblocks, trace->found ? ", without an index" : "");
+		for (i = 0; i < trace->header->nsignals; i++)
+			printf("%s %u\n", trace->signals[i].name, trace->signals[i].bits);
+		ctrace_free(trace);
+		return 0;
+	}
+	signal = ctrace_find(trace, argv[2]);
+	if (signal < 0) {
+		printf("no signal %s in %s\n", argv[2], argv[1]);
+		ctrace_free(trace);
+		return 1;
+	}
+	from = argc > 3 ? atoi(argv[3]) : trace->header->firstClock;
+	to = argc > 4 ? atoi(argv[4]) : trace->header->firstClock + trace->clocks;
+	values = (unsigned int *) malloc(CHUNK_CLOCKS * sizeof(unsigned int));
+	if (values == NULL) {
+		printf("out of memory\n");
+		return 1;
+	}
+	if (from < trace->header->firstClock)
+		from = trace->header->firstClock;
+	for (; from < to; from += CHUNK_CLOCKS) {
+		n = ctrace_read(trace, signal, from, to < from + CHUNK_CLOCKS ? to : from + CHUNK_CLOCKS, values);
+		for (i = 0; i < n; i++)
+			printf("%d %08x\n", from + i, values[i]);
+		if (n < CHUNK_CLOCKS)
+			break;
+	}
+	free(values);
+	ctrace_free(trace);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Converts a program in hex text (one %08x word per line) to a binary
+ * image, see image.h
+ *
+ * usage: hex2img hex_file image_file [entry]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "image.h"
+
+#define MEM_SIZE 65536
+
+unsigned int mem[MEM_SIZE];
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	int size = 0;
+
+	if (argc != 3 && argc != 4) {
+		printf("usage: hex2img hex_file image_file [entry]\n");
+		return 1;
+	}
+	fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", argv[1]);
+		return 1;
+	}
+	while (size < MEM_SIZE && fscanf(fp, "%08x\n", &mem[size]) == 1)
+		size++;
+	fclose(fp);
+
+	if (image_write(argv[2], mem, size, (argc == 4) ? atoi(argv[3]) : 0) != 0) {
+		printf("couldn't write file %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
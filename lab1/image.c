@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+#define MAX_SEGMENTS	(65536 / IMAGE_PAGE_WORDS)
+
+static int pageIsZero(unsigned int *mem, int page) {
+	int i;
+
+	for (i = 0; i < IMAGE_PAGE_WORDS; i++)
+		if (mem[page * IMAGE_PAGE_WORDS + i] != 0)
+			return 0;
+	return 1;
+}
+
+// mmap works at IMAGE_PAGE_BYTES granularity only where that is the host page
+static int canMap(unsigned int *mem) {
+	return ((uintptr_t) mem % IMAGE_PAGE_BYTES == 0) && sysconf(_SC_PAGESIZE) == IMAGE_PAGE_BYTES;
+}
+
+int image_write(char *filename, unsigned int *mem, int size, int entry) {
+	image_header_t header;
+	image_segment_t segments[MAX_SEGMENTS];
+	static const char zeros[IMAGE_PAGE_BYTES];
+	unsigned int offset;
+	int pages = (size + IMAGE_PAGE_WORDS - 1) / IMAGE_PAGE_WORDS;
+	int page, i;
+	FILE *fp;
+
+	// runs of non-zero pages, data starts on the page after the table
+	memcpy(header.magic, IMAGE_MAGIC, 4);
+	header.version = IMAGE_VERSION;
+	header.entry = entry;
+	header.size = size;
+	header.nsegments = 0;
+	offset = IMAGE_PAGE_BYTES;
+	for (page = 0; page < pages; page++) {
+		if (pageIsZero(mem, page))
+			continue;
+		if (header.nsegments > 0 &&
+			segments[header.nsegments - 1].addr + segments[header.nsegments - 1].words == page * IMAGE_PAGE_WORDS) {
+			segments[header.nsegments - 1].words += IMAGE_PAGE_WORDS;
+		} else {
+			segments[header.nsegments].addr = page * IMAGE_PAGE_WORDS;
+			segments[header.nsegments].words = IMAGE_PAGE_WORDS;
+			segments[header.nsegments].offset = offset;
+			header.nsegments++;
+		}
+		offset += IMAGE_PAGE_BYTES;
+	}
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+		return -1;
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(segments, sizeof(image_segment_t), header.nsegments, fp);
+	fwrite(zeros, 1, IMAGE_PAGE_BYTES - sizeof(header) - header.nsegments * sizeof(image_segment_t), fp);
+	for (i = 0; i < header.nsegments; i++)
+		fwrite(mem + segments[i].addr, 4, segments[i].words, fp);
+	if (fclose(fp) != 0)
+		return -1;
+	return 0;
+}
+
+int image_load(char *filename, unsigned int *mem, int words, int *size, int *entry) {
+	image_header_t *header;
+	image_segment_t *segments;
+	struct stat st;
+	char *file;
+	int inPlace;
+	int fd, i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < IMAGE_PAGE_BYTES) {
+		close(fd);
+		return IMAGE_NOT_IMAGE;
+	}
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	header = (image_header_t *) file;
+	segments = (image_segment_t *) (header + 1);
+	if (memcmp(header->magic, IMAGE_MAGIC, 4) != 0) {
+		munmap(file, st.st_size);
+		close(fd);
+		return IMAGE_NOT_IMAGE;
+	}
+	if (header->version != IMAGE_VERSION || header->size > words || header->nsegments > MAX_SEGMENTS)
+		goto bad;
+	for (i = 0; i < header->nsegments; i++)
+		if (segments[i].addr % IMAGE_PAGE_WORDS != 0 || segments[i].words % IMAGE_PAGE_WORDS != 0 ||
+			segments[i].offset % IMAGE_PAGE_BYTES != 0 || segments[i].addr + segments[i].words > words ||
+			segments[i].offset + segments[i].words * 4 > st.st_size)
+			goto bad;
+
+	inPlace = canMap(mem);
+	for (i = 0; i < header->nsegments; i++) {
+		if (!inPlace)
+			memcpy(mem + segments[i].addr, file + segments[i].offset, segments[i].words * 4);
+		else if (mmap(mem + segments[i].addr, segments[i].words * 4, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd, segments[i].offset) == MAP_FAILED)
+			goto bad;
+	}
+	*size = header->size;
+	*entry = header->entry;
+	munmap(file, st.st_size);
+	close(fd);
+	return 0;
+
+bad:
+	munmap(file, st.st_size);
+	close(fd);
+	return -2;
+}
+
+unsigned int *image_alloc(int words) {
+	void *p;
+
+	p = mmap(NULL, words * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+void image_free(unsigned int *mem, int words) {
+	munmap(mem, words * 4);
+}
+
+struct image_shared_s {
+	int fd;						// memfd holding the words
+	int words;
+};
+
+image_shared_t *image_share(unsigned int *mem, int words) {
+	image_shared_t *shared;
+	int page;
+
+	shared = malloc(sizeof(image_shared_t));
+	if (shared == NULL)
+		return NULL;
+	shared->words = words;
+	shared->fd = memfd_create("sp-image", MFD_CLOEXEC);
+	if (shared->fd < 0) {
+		free(shared);
+		return NULL;
+	}
+	// zero pages stay holes in the file
+	if (ftruncate(shared->fd, (off_t) words * 4) < 0)
+		goto bad;
+	for (page = 0; page < words / IMAGE_PAGE_WORDS; page++)
+		if (!pageIsZero(mem, page) &&
+			pwrite(shared->fd, mem + page * IMAGE_PAGE_WORDS, IMAGE_PAGE_BYTES, (off_t) page * IMAGE_PAGE_BYTES) != IMAGE_PAGE_BYTES)
+			goto bad;
+	if (image_map(shared, mem, 0, words) != 0)
+		goto bad;
+	return shared;
+
+bad:
+	image_unshare(shared);
+	return NULL;
+}
+
+int image_map(image_shared_t *shared, unsigned int *mem, int first, int words) {
+	if (first % IMAGE_PAGE_WORDS != 0 || words % IMAGE_PAGE_WORDS != 0 || first + words > shared->words)
+		return -1;
+	if (!canMap(mem))
+		return pread(shared->fd, mem + first, words * 4, (off_t) first * 4) == words * 4 ? 0 : -1;
+	if (mmap(mem + first, words * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, shared->fd, (off_t) first * 4) == MAP_FAILED)
+		return -1;
+	return 0;
+}
+
+void image_unshare(image_shared_t *shared) {
+	if (shared == NULL)
+		return;
+	close(shared->fd);
+	free(shared);
+}
@@ -0,0 +1,72 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+/*
+ * Binary program image: a header, a segment table and the segment data.
+ * Only pages holding non-zero words are stored. Segments start and end on
+ * page boundaries, both in memory and in the file, so a loader can mmap
+ * them straight into a page aligned simulator memory.
+ */
+#define IMAGE_MAGIC			"SPIM"
+#define IMAGE_VERSION		1
+#define IMAGE_PAGE_WORDS	1024
+#define IMAGE_PAGE_BYTES	(IMAGE_PAGE_WORDS * 4)
+
+#define IMAGE_NOT_IMAGE		1	// image_load(): file is not an image, e.g. legacy hex text
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int entry;			// pc of the first instruction
+	unsigned int size;			// words spanned by the program, reported as its "lines"
+	unsigned int nsegments;		// followed by the segment table
+} image_header_t;
+
+typedef struct {
+	unsigned int addr;			// first word, page aligned
+	unsigned int words;			// whole pages
+	unsigned int offset;		// file offset of the data, page aligned
+} image_segment_t;
+
+/*
+ * Writes the first size words of mem as an image. Returns 0 or -1.
+ */
+int image_write(char *filename, unsigned int *mem, int size, int entry);
+
+/*
+ * Loads an image into mem, which holds "words" zeroed words. When mem is page
+ * aligned the segments are mapped in place (private, so stores never reach
+ * the file), otherwise they are copied. Returns 0 and sets *size and *entry,
+ * IMAGE_NOT_IMAGE, -1 if the file can't be opened or -2 if the image is bad.
+ */
+int image_load(char *filename, unsigned int *mem, int words, int *size, int *entry);
+
+/*
+ * Zeroed, page aligned memory for image_load(), freed with image_free().
+ */
+unsigned int *image_alloc(int words);
+void image_free(unsigned int *mem, int words);
+
+/*
+ * Shared program memory: one copy of a program that any number of
+ * simulator memories map copy on write. They all read the same pages, and
+ * a memory only gets its own copy of a page the first time it stores to it.
+ */
+typedef struct image_shared_s image_shared_t;
+
+/*
+ * Takes a shared copy of mem, which image_alloc() returned, and maps it
+ * back over mem. Returns NULL on error, mem is left as it was then.
+ */
+image_shared_t *image_share(unsigned int *mem, int words);
+
+/*
+ * Maps words first .. first + words - 1 of shared over the same words of
+ * mem, dropping whatever mem stored there. Both ends are page aligned.
+ * Returns 0 or -1.
+ */
+int image_map(image_shared_t *shared, unsigned int *mem, int first, int words);
+
+void image_unshare(image_shared_t *shared);
+
+#endif
@@ -1,40 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
 
-#define REG_COUNT 8
+#include "iss.h"
+#include "jit.h"
+#include "profile.h"
+#include "image.h"
+#include "spasm.h"
+
+#define REG_SINK REG_COUNT	// scratch slot that absorbs writes to R0/R1
 #define CMD_SIZE 32
 #define MAX_CMD_COUNT 65536
-#define MAX_MEMORY_SIZE 65536
-
-typedef enum Opcode {
-	ADD = 0,
-	SUB,
-	LSF,
-	RSF,
-	AND,
-	OR,
-	XOR,
-	LHI,
-	LD,
-	ST,
-	JLT = 16,
-	JLE,
-	JEQ,
-	JNE,
-	JIN,
-	HLT = 24,
-} Opcode;
-
-typedef struct {
-	int unused			: 2;
-	Opcode opcode;
-	unsigned int dst	: 3;
-	unsigned int src0	: 3;
-	unsigned int src1	: 3;
-	int immediate		: 16;	
-	int val0;
-	int val1;
-} Instruction;
 
 char* toOpcodeName(Opcode opcode) {
    switch (opcode) {
@@ -71,162 +49,414 @@ Instruction fetch(unsigned int inst) {
 	return out;
 }
 
-void decode(Instruction* inst, int* regs) {
-	inst->val0 = (inst->src0 == 1 || inst->opcode == LHI) ? inst->immediate : regs[inst->src0];
-	inst->val1 = (inst->src1 == 1) ? inst->immediate : regs[inst->src1];
+/*
+ * Predecoded instruction cache: one record per memory word, filled in the
+ * first time the word is executed and dropped again when an ST hits it.
+ */
+#define HANDLER_DECODE	0
+
+typedef struct Predecoded {
+	unsigned char handler;		// dispatch index (opcode + 1), HANDLER_DECODE if not decoded yet
+	unsigned char dst;
+	unsigned char src0;
+	unsigned char src1;
+	unsigned char wdst;			// register actually written, REG_SINK for R0/R1
+	int immediate;
+} Predecoded;
+
+#define CODE_BYTES	(MAX_MEMORY_SIZE * sizeof(Predecoded))
+
+// Drops the whole cache, its pages read back as zeros until used again
+static void clearCode(iss_t* iss) {
+	madvise(iss->code, CODE_BYTES, MADV_DONTNEED);
+	jit_invalidate(iss->jit, 0, MAX_MEMORY_SIZE);
 }
 
-void execute(Instruction inst, unsigned short* pc, unsigned int* mem, int* regs, FILE* outFile) {
-	switch(inst.opcode) {	
-	case ADD:
-		regs[inst.dst] = inst.val0 + inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d ADD %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case SUB:
-		regs[inst.dst] = inst.val0 - inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d SUB %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case LSF:
-		regs[inst.dst] = inst.val0 << inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d LSF %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case RSF:
-		regs[inst.dst] = inst.val0 >> inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d RSF %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case AND:
-		regs[inst.dst] = inst.val0 & inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d AND %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case OR:
-		regs[inst.dst] = inst.val0 | inst.val1;
-		fprintf(outFile, ">>>> EXEC: R[%d] = %d OR %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case XOR:
-		regs[inst.dst] = inst.val0 ^ inst.val1;
-		fprintf(outFile,">>>> EXEC: R[%d] = %d XOR %d <<<<\n\n", inst.dst, inst.val0, inst.val1);
-		break;
-	case LHI:
-		regs[inst.dst] = (inst.val0 << 16) | (regs[inst.dst] & 0xffff);
-		fprintf(outFile,">>>> EXEC: R[%d][31:16] = %d <<<<\n\n", inst.dst, inst.val0);
-		break;
-	case LD:
-		regs[inst.dst] = mem[inst.val1 & 0xffff];
-		fprintf(outFile, ">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n", inst.dst, inst.val1, mem[inst.val1 & 0xffff]);
-		break;
-	case ST:
-		mem[inst.val1 & 0xffff] = inst.val0;
-		fprintf(outFile, ">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n", inst.val1, inst.src0, inst.val0);
-		break;
-	case JLT:
-		if (inst.val0 < inst.val1) {
-			regs[7] = *pc - 1;
-			*pc = inst.immediate;
-		}
-		fprintf(outFile, ">>>> EXEC: JLT %d, %d, %d <<<<\n\n", inst.val0, inst.val1, *pc);
-		break;
-	case JLE:
-		if (inst.val0 <= inst.val1) {
-			regs[7] = *pc - 1;
-			*pc = inst.immediate;
-		}
-		fprintf(outFile, ">>>> EXEC: JLE %d, %d, %d <<<<\n\n", inst.val0, inst.val1, *pc);
-		break;
-	case JEQ:
-		if (inst.val0 == inst.val1) {
-			regs[7] = *pc - 1;
-			*pc = inst.immediate;
-		}
-		fprintf(outFile, ">>>> EXEC: JEQ %d, %d, %d <<<<\n\n", inst.val0, inst.val1, *pc);
-		break;
-	case JNE:
-		if (inst.val0 != inst.val1) {
-			regs[7] = *pc - 1;
-			*pc = inst.immediate;
-		}
-		fprintf(outFile, ">>>> EXEC: JNE %d, %d, %d <<<<\n\n", inst.val0, inst.val1, *pc);
-		break;
-	case JIN:
-		regs[7] = *pc - 1;
-		*pc = inst.val0;
-		fprintf(outFile, ">>>> EXEC: JIN R[%d] = %08x <<<<\n\n", inst.src0, inst.val0);
-		break;
-	case HLT:
-		// Intentionally print one line break
-		fprintf(outFile, ">>>> EXEC: HALT at PC %04x<<<<\n", *pc - 1);
-		break;
-	default:
-		printf("Illegal opcode %d!\n", inst.opcode);
-		exit(1);
-		break;
-	}
-	// Suppress assignments to R0 and R1
-	regs[0] = 0;
-	regs[1] = 0;
+static void predecode(Predecoded* d, unsigned int word) {
+	Instruction inst = fetch(word);
+
+	d->dst = inst.dst;
+	d->src0 = inst.src0;
+	d->src1 = inst.src1;
+	d->wdst = (inst.dst > 1) ? inst.dst : REG_SINK;
+	d->immediate = inst.immediate;
+	d->handler = inst.opcode + 1;
 }
 
-void printFetch(Instruction inst, int instCount, unsigned short pc, unsigned int* mem, int* regs, FILE* outFile) {
-	fprintf(outFile, "--- instruction %d (%04x) @ PC %d (%04x) -----------------------------------------------------------\n", 
+static void printHeader(long long instCount, unsigned short pc, FILE* outFile) {
+	fprintf(outFile, "--- instruction %lld (%04llx) @ PC %d (%04x) -----------------------------------------------------------\n", 
 		instCount, instCount, pc, pc);
+}
+
+static void printFetch(Predecoded* d, long long instCount, unsigned short pc, unsigned int* mem, FILE* outFile) {
+	printHeader(instCount, pc, outFile);
 	
 	fprintf(outFile, "pc = %04x, inst = %08x, opcode = %d (%s), dst = %d, src0 = %d, src1 = %d, immediate = %08x\n",
-		pc, mem[pc], inst.opcode, toOpcodeName(inst.opcode), inst.dst, inst.src0, inst.src1, inst.immediate);
-	
-	fprintf(outFile, "r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n", inst.immediate, regs[2], regs[3]);
+		pc, mem[pc], d->handler - 1, toOpcodeName(d->handler - 1), d->dst, d->src0, d->src1, d->immediate);
+}
+
+static void printRegs(Predecoded* d, int* regs, FILE* outFile) {
+	fprintf(outFile, "r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n", d->immediate, regs[2], regs[3]);
 	
 	fprintf(outFile, "r[4] = %08x r[5] = %08x r[6] = %08x r[7] = %08x \n\n", regs[4], regs[5], regs[6], regs[7]);
 }
 
-int main(int argc, char** argv) {
-	int regs[REG_COUNT] = {0};
+/*
+ * One interpreter loop per trace level, see iss_run.h
+ */
+#define TRACE_LEVEL TRACE_NONE
+#define RUN_NAME run_none
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+
+#define TRACE_LEVEL TRACE_SUMMARY
+#define RUN_NAME run_summary
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+
+#define TRACE_LEVEL TRACE_INST
+#define RUN_NAME run_inst
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+
+#define TRACE_LEVEL TRACE_FULL
+#define RUN_NAME run_full
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+
+// Binary trace records, no text besides the final line
+#define TRACE_LEVEL TRACE_NONE
+#define TRACE_RECORDS 1
+#define RUN_NAME run_binary
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_RECORDS
+#undef TRACE_LEVEL
+
+// Profile counters, with no trace or the summary
+#define PROFILE 1
+#define TRACE_LEVEL TRACE_NONE
+#define RUN_NAME run_profile_none
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+
+#define TRACE_LEVEL TRACE_SUMMARY
+#define RUN_NAME run_profile_summary
+#include "iss_run.h"
+#undef RUN_NAME
+#undef TRACE_LEVEL
+#undef PROFILE
+
+typedef int (*RunFunction)(iss_t* iss, FILE* outFile, btrace_t* bt);
+
+static const RunFunction runners[] = {
+	[TRACE_NONE] = run_none,
+	[TRACE_SUMMARY] = run_summary,
+	[TRACE_INST] = run_inst,
+	[TRACE_FULL] = run_full,
+};
+
+static const RunFunction profilers[] = {
+	[TRACE_NONE] = run_profile_none,
+	[TRACE_SUMMARY] = run_profile_summary,
+};
+
+iss_t* iss_create(void) {
+	iss_t* iss;
+
+	iss = calloc(1, sizeof(iss_t));
+	if (iss == NULL)
+		return NULL;
+	iss->mem = image_alloc(MAX_MEMORY_SIZE);
+	// mapped rather than calloc()ed, so clearCode() can hand the pages back
+	iss->code = mmap(NULL, CODE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (iss->code == MAP_FAILED)
+		iss->code = NULL;
+	if (iss->mem == NULL || iss->code == NULL) {
+		iss_destroy(iss);
+		return NULL;
+	}
+	return iss;
+}
+
+void iss_destroy(iss_t* iss) {
+	if (iss->mem != NULL)
+		image_free(iss->mem, MAX_MEMORY_SIZE);
+	if (iss->code != NULL)
+		munmap(iss->code, CODE_BYTES);
+	jit_destroy(iss->jit);
+	free(iss->profile);		// see profile_create()
+	image_unshare(iss->shared);
+	free(iss->name);
+	free(iss);
+}
+
+static void reset(iss_t* iss, char* name, int lines, int entry) {
+	memset(iss->regs, 0, sizeof(iss->regs));
+	iss->pc = entry;
+	iss->entry = entry;
+	iss->instCount = 0;
+	iss->lines = lines;
+	iss->illegalOpcode = 0;
+	if (iss->name == NULL || strcmp(iss->name, name) != 0) {
+		free(iss->name);
+		iss->name = strdup(name);
+	}
+}
+
+// FNV-1a over the words of the program, before it runs
+static unsigned int hashProgram(unsigned int* mem, int words) {
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < words; i++) {
+		hash = (hash ^ (mem[i] & 0xff)) * 16777619;
+		hash = (hash ^ ((mem[i] >> 8) & 0xff)) * 16777619;
+		hash = (hash ^ ((mem[i] >> 16) & 0xff)) * 16777619;
+		hash = (hash ^ (mem[i] >> 24)) * 16777619;
+	}
+	return hash;
+}
+
+static int assemble(iss_t* iss, char* filename, int* size, int* entry) {
+	spasm_result_t result;
+	int err;
+
+	err = spasm_assemble_file(filename, iss->mem, MAX_MEMORY_SIZE, 0, &result);
+	if (err != 0)
+		printf("%s\n", result.error);
+	*size = result.size;
+	*entry = result.entry;
+	return err;
+}
+
+int iss_load(iss_t* iss, char* filename) {
 	char lineBuffer[CMD_SIZE];
-	char* inFilename = argv[1];
-	char* outFilename = "trace.txt";
-	unsigned int mem[MAX_MEMORY_SIZE] = {0};
-	int memIndex = 0;
 	FILE* inFile;
-	FILE* outFile;
-	unsigned short pc = 0;
-	int instCount = 0;
-	Instruction inst = {0};
-
-	inFile = fopen(inFilename, "r");
-	if (inFile == NULL) {
-		printf("Error opening file %s, exit\n", inFilename);
-		return 1;
-	}
+	int memIndex = 0;
+	int entry = 0;
 
-	outFile = fopen(outFilename, "w");
+	// Start from zeroed memory, image_load() maps over it
+	image_free(iss->mem, MAX_MEMORY_SIZE);
+	iss->mem = image_alloc(MAX_MEMORY_SIZE);
+	if (iss->mem == NULL)
+		return -1;
 
-	while (fgets(lineBuffer, CMD_SIZE, inFile) != NULL) {
-		if (sscanf(lineBuffer, "%08x", &mem[memIndex]) != 1) {
-			printf("Error reading from file %s, exit\n", inFilename);
+	// Sources are assembled in place, binary images are mapped in, anything
+	// else is read as one hex word per line
+	switch (spasm_is_source(filename) ? assemble(iss, filename, &memIndex, &entry) :
+		image_load(filename, iss->mem, MAX_MEMORY_SIZE, &memIndex, &entry)) {
+	case 0:
+		break;
+	case IMAGE_NOT_IMAGE:
+		inFile = fopen(filename, "r");
+		if (inFile == NULL)
+			return -1;
+		while (fgets(lineBuffer, CMD_SIZE, inFile) != NULL) {
+			if (memIndex == MAX_MEMORY_SIZE || sscanf(lineBuffer, "%08x", &iss->mem[memIndex]) != 1) {
+				fclose(inFile);
+				return -2;
+			}
+			memIndex++;
+		}
+		if (ferror(inFile)) {
 			fclose(inFile);
-			return 1;			
+			return -2;
 		}
-		memIndex++;
-	} 
-
-	if (ferror(inFile)) {
-		printf("Error reading from file %s, exit\n", inFilename);
 		fclose(inFile);
-		return 1;	
+		break;
+	case -1:
+		return -1;
+	default:
+		return -2;
 	}
+	// Copies map this one instead of copying it
+	image_unshare(iss->shared);
+	iss->shared = image_share(iss->mem, MAX_MEMORY_SIZE);
+	clearCode(iss);
+	memset(iss->dirty, 0, sizeof(iss->dirty));
+	iss->program = NULL;
+	iss->programHash = hashProgram(iss->mem, memIndex);
+	reset(iss, filename, memIndex, entry);
+	return 0;
+}
+
+void iss_copy_program(iss_t* iss, iss_t* from) {
+	int page, i;
 
-	fclose(inFile);
-	fprintf(outFile, "program %s loaded, %d lines\n\n", inFilename, memIndex);
+	if (iss->program != from) {
+		// Pages are only copied once iss stores to them
+		if (from->shared == NULL || image_map(from->shared, iss->mem, 0, MAX_MEMORY_SIZE) != 0)
+			memcpy(iss->mem, from->mem, MAX_MEMORY_SIZE * sizeof(unsigned int));
+		clearCode(iss);
+		memset(iss->dirty, 0, sizeof(iss->dirty));
+		iss->program = from;
+		iss->programHash = from->programHash;
+	} else {
+		for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++) {
+			if (!iss->dirty[page])
+				continue;
+			// Translated blocks only go when a word of theirs changes back, data often shares their page
+			for (i = page * PAGE_WORDS; iss->jit != NULL && i < (page + 1) * PAGE_WORDS; i++)
+				if (iss->mem[i] != from->mem[i])
+					jit_invalidate(iss->jit, i, 1);
+			memcpy(iss->mem + page * PAGE_WORDS, from->mem + page * PAGE_WORDS, PAGE_WORDS * sizeof(unsigned int));
+			memset(iss->code + page * PAGE_WORDS, 0, PAGE_WORDS * sizeof(Predecoded));
+			iss->dirty[page] = 0;
+		}
+	}
+	reset(iss, from->name, from->lines, from->pc);
+}
 
-	do {
-		inst = fetch(mem[pc]);
-		printFetch(inst, instCount, pc, mem, regs, outFile);
-		decode(&inst, regs);
-		pc++;
-		execute(inst, &pc, mem, regs, outFile);
-		instCount++;
-	} while (inst.opcode != HLT);
+void iss_write(iss_t* iss, unsigned short addr, unsigned int value) {
+	iss->mem[addr] = value;
+	iss->code[addr].handler = HANDLER_DECODE;
+	jit_invalidate(iss->jit, addr, 1);
+	iss->dirty[addr / PAGE_WORDS] = 1;
+}
 
-	fprintf(outFile, "sim finished at pc %d, %d instructions\n", pc - 1, instCount);
-	fclose(outFile);
+int iss_run(iss_t* iss, int traceLevel, FILE* outFile, btrace_t* bt, int useJit) {
+	unsigned char dirty[MAX_MEMORY_SIZE / PAGE_WORDS];
+	int status = -1;
+	int page;
 
+	if (iss->profile != NULL) {
+		if (traceLevel > TRACE_SUMMARY)
+			traceLevel = TRACE_SUMMARY;
+		bt = NULL;
+		useJit = 0;
+	}
+	if (bt != NULL)
+		traceLevel = TRACE_NONE;
+	if (iss->instCount == 0 && traceLevel >= TRACE_SUMMARY)
+		fprintf(outFile, "program %s loaded, %d lines\n\n", iss->name, iss->lines);
+
+	if (useJit && iss->stopAt == 0 && iss->jit == NULL)
+		iss->jit = jit_create();
+	if (useJit && iss->stopAt == 0 && iss->jit != NULL) {
+		memset(dirty, 0, sizeof(dirty));
+		status = jit_run(iss->jit, iss->mem, iss->regs, &iss->pc, &iss->instCount, dirty);
+		// The predecoded cache missed the stores
+		for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++) {
+			if (dirty[page]) {
+				memset(iss->code + page * PAGE_WORDS, 0, PAGE_WORDS * sizeof(Predecoded));
+				iss->dirty[page] = 1;
+			}
+		}
+	} else {
+		// The translator would miss the interpreter's stores
+		jit_invalidate(iss->jit, 0, MAX_MEMORY_SIZE);
+	}
+	if (status == 0) {
+		// The translator does not trace
+		if (traceLevel >= TRACE_SUMMARY)
+			fprintf(outFile, ">>>> EXEC: HALT at PC %04x<<<<\n", iss->pc - 1);
+		status = ISS_HALTED;
+	} else if (status == 1) {
+		iss->illegalOpcode = (iss->mem[iss->pc] >> 25) & 0x1F;
+		status = ISS_ILLEGAL;
+	} else if (iss->profile != NULL) {
+		status = profilers[traceLevel](iss, outFile, bt);
+	} else if (bt != NULL) {
+		status = run_binary(iss, outFile, bt);
+	} else {
+		status = runners[traceLevel](iss, outFile, bt);
+	}
+
+	if (status == ISS_HALTED)
+		fprintf(outFile, "sim finished at pc %d, %lld instructions\n", iss->pc - 1, iss->instCount);
+	return status;
+}
+
+int iss_checkpoint(iss_t* iss, char* filename) {
+	checkpoint_header_t header;
+	unsigned int pages[MAX_MEMORY_SIZE / PAGE_WORDS];
+	FILE* fp;
+	int page, i;
+
+	memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+	header.version = CHECKPOINT_VERSION;
+	header.lines = iss->lines;
+	header.entry = iss->entry;
+	header.programHash = iss->programHash;
+	header.pc = iss->pc;
+	header.instCount = iss->instCount;
+	memcpy(header.regs, iss->regs, sizeof(header.regs));
+	header.npages = 0;
+	for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++)
+		if (iss->dirty[page])
+			pages[header.npages++] = page;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+		return -1;
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(pages, sizeof(pages[0]), header.npages, fp);
+	for (i = 0; i < header.npages; i++)
+		fwrite(iss->mem + pages[i] * PAGE_WORDS, sizeof(unsigned int), PAGE_WORDS, fp);
+	if (fclose(fp) != 0)
+		return -1;
+	return 0;
+}
+
+int iss_restore(iss_t* iss, char* filename) {
+	checkpoint_header_t header;
+	unsigned int pages[MAX_MEMORY_SIZE / PAGE_WORDS];
+	unsigned int* data = NULL;
+	FILE* fp;
+	int i, ok;
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return -1;
+	// the whole file is read and checked before iss is touched
+	ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+		memcmp(header.magic, CHECKPOINT_MAGIC, 4) == 0 && header.version == CHECKPOINT_VERSION &&
+		header.lines == iss->lines && header.entry == iss->entry && header.programHash == iss->programHash &&
+		header.npages <= MAX_MEMORY_SIZE / PAGE_WORDS &&
+		fread(pages, sizeof(pages[0]), header.npages, fp) == header.npages;
+	for (i = 0; ok && i < header.npages; i++)
+		ok = pages[i] < MAX_MEMORY_SIZE / PAGE_WORDS;
+	if (ok && header.npages > 0) {
+		data = malloc(header.npages * PAGE_WORDS * sizeof(unsigned int));
+		ok = data != NULL && fread(data, PAGE_WORDS * sizeof(unsigned int), header.npages, fp) == header.npages;
+	}
+	ok = ok && fgetc(fp) == EOF;
+	fclose(fp);
+	if (!ok) {
+		free(data);
+		return -2;
+	}
+
+	for (i = 0; i < header.npages; i++) {
+		memcpy(iss->mem + pages[i] * PAGE_WORDS, data + i * PAGE_WORDS, PAGE_WORDS * sizeof(unsigned int));
+		memset(iss->code + pages[i] * PAGE_WORDS, 0, PAGE_WORDS * sizeof(Predecoded));
+		jit_invalidate(iss->jit, pages[i] * PAGE_WORDS, PAGE_WORDS);
+		iss->dirty[pages[i]] = 1;
+	}
+	free(data);
+	memcpy(iss->regs, header.regs, sizeof(header.regs));
+	iss->pc = header.pc;
+	iss->instCount = header.instCount;
+	return 0;
+}
+
+int iss_dump_memory(iss_t* iss, char* filename) {
+	FILE* fp;
+	int i;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		printf("Error opening file %s, exit\n", filename);
+		return 1;
+	}
+	for (i = 0; i < MAX_MEMORY_SIZE; i++)
+		fprintf(fp, "%08x\n", iss->mem[i]);
+	fclose(fp);
 	return 0;
 }
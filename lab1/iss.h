@@ -0,0 +1,161 @@
+#ifndef _ISS_H_
+#define _ISS_H_
+
+#include <stdio.h>
+
+#include "btrace.h"
+
+#define REG_COUNT 8
+#define MAX_MEMORY_SIZE 65536
+#define PAGE_WORDS 1024
+
+/*
+ * Trace levels, each with its own specialized interpreter loop
+ */
+#define TRACE_NONE		0	// final "sim finished" line only
+#define TRACE_SUMMARY	1	// program load and HALT lines as well
+#define TRACE_INST		2	// instruction header and EXEC line per instruction
+#define TRACE_FULL		3	// registers per instruction as well
+
+#ifndef ISS_TRACE_LEVEL
+#define ISS_TRACE_LEVEL	TRACE_FULL
+#endif
+
+typedef enum Opcode {
+	ADD = 0,
+	SUB,
+	LSF,
+	RSF,
+	AND,
+	OR,
+	XOR,
+	LHI,
+	LD,
+	ST,
+	JLT = 16,
+	JLE,
+	JEQ,
+	JNE,
+	JIN,
+	HLT = 24,
+} Opcode;
+
+typedef struct {
+	int unused			: 2;
+	Opcode opcode;
+	unsigned int dst	: 3;
+	unsigned int src0	: 3;
+	unsigned int src1	: 3;
+	int immediate		: 16;	
+	int val0;
+	int val1;
+} Instruction;
+
+char* toOpcodeName(Opcode opcode);
+Instruction fetch(unsigned int inst);
+
+/*
+ * Simulator context. Contexts share nothing, so any number of them can
+ * run at the same time on different threads.
+ */
+typedef struct {
+	unsigned int* mem;			// MAX_MEMORY_SIZE words, page aligned
+	int regs[REG_COUNT + 1];	// regs[REG_COUNT] absorbs writes to R0/R1
+	unsigned short pc;
+	long long instCount;
+	char* name;					// program name for the trace
+	int lines;					// program size for the trace
+	unsigned short entry;		// pc the program starts at
+	unsigned int programHash;	// of the words loaded, checkpoints carry it
+	int illegalOpcode;			// set when iss_run() returns ISS_ILLEGAL
+	struct Predecoded* code;	// predecoded instruction cache
+	struct jit_s* jit;			// translator, kept from the first run that uses it on
+	void* program;				// context last copied by iss_copy_program()
+	struct image_shared_s* shared;	// the loaded program, mapped copy on write by copies
+	unsigned char dirty[MAX_MEMORY_SIZE / PAGE_WORDS];	// pages stored to since then
+	long long stopAt;			// iss_run() stops once instCount gets here, 0 to run on
+	struct profile_s* profile;	// counters iss_run() adds to, NULL when not profiling, freed with iss
+} iss_t;
+
+/*
+ * iss_run() results
+ */
+#define ISS_HALTED		0
+#define ISS_ILLEGAL		1
+#define ISS_STOPPED		2	// reached stopAt, run again to go on
+
+/*
+ * Checkpoint file: the header, npages page numbers and the words of those
+ * pages. Only pages stored to since the program was loaded are kept, the
+ * rest come from the program itself when it is restored.
+ */
+#define CHECKPOINT_MAGIC	"SPCK"
+#define CHECKPOINT_VERSION	2
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int lines;			// size of the program it was taken from
+	unsigned int entry;			// and its entry
+	unsigned int programHash;	// and a hash of its words, see iss_t
+	unsigned int pc;
+	long long instCount;
+	int regs[REG_COUNT];
+	unsigned int npages;
+} checkpoint_header_t;
+
+iss_t* iss_create(void);
+void iss_destroy(iss_t* iss);
+
+/*
+ * Loads a program image, hex text file or assembler source (.s or .asm,
+ * see spasm.h) and resets the context to run it.
+ * Returns 0, -1 if the file can't be opened or -2 if it can't be parsed.
+ */
+int iss_load(iss_t* iss, char* filename);
+
+/*
+ * Resets iss to run the program already loaded into from, which must not
+ * run itself. The memory of from is mapped copy on write, so contexts
+ * running one program share the pages none of them stored to. Copying the
+ * same program again only restores the pages the last run stored to, and
+ * keeps the predecoded instructions of the rest.
+ */
+void iss_copy_program(iss_t* iss, iss_t* from);
+
+/*
+ * Stores a word, e.g. input data for the program, before or between runs.
+ */
+void iss_write(iss_t* iss, unsigned short addr, unsigned int value);
+
+/*
+ * Runs until HLT or an illegal opcode, tracing to outFile at traceLevel.
+ * A run that starts with no instructions executed begins the trace with
+ * the program load line. With bt the text trace is replaced by binary
+ * trace records, useJit runs hot code through the translator (trace
+ * levels up to TRACE_SUMMARY only, and not with stopAt set), which keeps
+ * its translations for the next runs of the program on iss. With
+ * iss->profile set the run is profiled and traced at traceLevel up to
+ * TRACE_SUMMARY, without the translator or binary records. Returns ISS_HALTED, ISS_ILLEGAL or
+ * ISS_STOPPED.
+ */
+int iss_run(iss_t* iss, int traceLevel, FILE* outFile, btrace_t* bt, int useJit);
+
+/*
+ * Saves the state of iss, e.g. after an ISS_STOPPED run. Returns 0 or -1.
+ */
+int iss_checkpoint(iss_t* iss, char* filename);
+
+/*
+ * Resumes a checkpoint on iss, which must have its program loaded and not
+ * yet run. Returns 0, -1 if the file can't be opened or -2 if it is not a
+ * checkpoint of this program, leaving iss as it was on both errors.
+ */
+int iss_restore(iss_t* iss, char* filename);
+
+/*
+ * Writes all of memory as hex text. Returns 0 or 1.
+ */
+int iss_dump_memory(iss_t* iss, char* filename);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * Runs many (program, input data) jobs in one process on a pool of
+ * threads, each with its own simulator context.
+ *
+ * Every line of the jobs file is a program followed by words to store
+ * before it runs, as addr=value or addr=first:last for every value in the
+ * range. A line with ranges stands for one job per combination:
+ *
+ *   minus_3_times_minus_5.bin 1000=-100:100 1001=-100:100
+ *
+ * Each job traces into its own sink: a file per job with -o, otherwise a
+ * buffer printed in job order once all jobs are done. With -simd a worker
+ * runs up to SIMD_LANES jobs of the same program at once in lockstep.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "iss.h"
+#include "simd.h"
+
+#define MAX_THREADS		256
+#define MAX_PROGRAMS	256
+#define MAX_FIELDS		64
+#define MAX_SHOW		64
+#define LINE_SIZE		4096
+
+typedef struct {
+	unsigned short addr;
+	int first, last;
+} field_t;
+
+typedef struct {
+	int program;
+	int firstWrite;			// writes[firstWrite .. firstWrite + writeCount)
+	int writeCount;
+	char* output;
+	size_t outputSize;
+} job_t;
+
+typedef struct {
+	unsigned short addr;
+	unsigned int value;
+} write_t;
+
+/*
+ * Jobs [next, end) belong to the worker. It takes them from the front,
+ * idle workers steal the back half.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	int next, end;
+	int id;
+	pthread_t thread;
+} worker_t;
+
+static iss_t* programs[MAX_PROGRAMS];
+static int programCount;
+static job_t* jobs;
+static int jobCount, jobCapacity;
+static write_t* writes;
+static int writeCount, writeCapacity;
+static worker_t workers[MAX_THREADS];
+static int workerCount = 1;
+
+static int traceLevel = TRACE_NONE;
+static int useJit;
+static int useSimd;
+static char* outDir;
+static unsigned short show[MAX_SHOW];
+static int showCount;
+
+static int findProgram(char* filename) {
+	int i;
+
+	for (i = 0; i < programCount; i++)
+		if (strcmp(programs[i]->name, filename) == 0)
+			return i;
+	if (programCount == MAX_PROGRAMS) {
+		printf("Too many programs, exit\n");
+		exit(1);
+	}
+	programs[programCount] = iss_create();
+	if (programs[programCount] == NULL) {
+		printf("Out of memory, exit\n");
+		exit(1);
+	}
+	switch (iss_load(programs[programCount], filename)) {
+	case 0:
+		break;
+	case -1:
+		printf("Error opening file %s, exit\n", filename);
+		exit(1);
+	default:
+		printf("Error reading from file %s, exit\n", filename);
+		exit(1);
+	}
+	return programCount++;
+}
+
+static void addWrite(unsigned short addr, int value) {
+	if (writeCount == writeCapacity) {
+		writeCapacity = writeCapacity ? writeCapacity * 2 : 1024;
+		writes = realloc(writes, writeCapacity * sizeof(write_t));
+	}
+	writes[writeCount].addr = addr;
+	writes[writeCount].value = value;
+	writeCount++;
+}
+
+static void addJob(int program, field_t* fields, int* values, int fieldCount) {
+	int i;
+
+	if (jobCount == jobCapacity) {
+		jobCapacity = jobCapacity ? jobCapacity * 2 : 1024;
+		jobs = realloc(jobs, jobCapacity * sizeof(job_t));
+	}
+	jobs[jobCount].program = program;
+	jobs[jobCount].firstWrite = writeCount;
+	jobs[jobCount].writeCount = fieldCount;
+	jobs[jobCount].output = NULL;
+	jobs[jobCount].outputSize = 0;
+	for (i = 0; i < fieldCount; i++)
+		addWrite(fields[i].addr, values[i]);
+	jobCount++;
+}
+
+static int readJobs(char* filename) {
+	char line[LINE_SIZE];
+	char* token;
+	char* save;
+	field_t fields[MAX_FIELDS];
+	int values[MAX_FIELDS];
+	int fieldCount;
+	int program;
+	int lineNumber = 0;
+	int i;
+	FILE* fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		printf("Error opening file %s, exit\n", filename);
+		return 1;
+	}
+	while (fgets(line, LINE_SIZE, fp) != NULL) {
+		lineNumber++;
+		token = strtok_r(line, " \t\r\n", &save);
+		if (token == NULL || token[0] == '#')
+			continue;
+		program = findProgram(token);
+		fieldCount = 0;
+		while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			char* value = strchr(token, '=');
+			char* last;
+
+			if (value == NULL || fieldCount == MAX_FIELDS) {
+				printf("%s:%d: bad input %s, exit\n", filename, lineNumber, token);
+				fclose(fp);
+				return 1;
+			}
+			fields[fieldCount].addr = strtol(token, NULL, 0);
+			fields[fieldCount].first = strtol(value + 1, &last, 0);
+			fields[fieldCount].last = (*last == ':') ? strtol(last + 1, NULL, 0) : fields[fieldCount].first;
+			if (fields[fieldCount].last < fields[fieldCount].first) {
+				printf("%s:%d: empty range %s, exit\n", filename, lineNumber, token);
+				fclose(fp);
+				return 1;
+			}
+			fieldCount++;
+		}
+
+		// every combination of the ranges, last field counting fastest
+		for (i = 0; i < fieldCount; i++)
+			values[i] = fields[i].first;
+		for (;;) {
+			addJob(program, fields, values, fieldCount);
+			for (i = fieldCount - 1; i >= 0 && values[i] == fields[i].last; i--)
+				values[i] = fields[i].first;
+			if (i < 0)
+				break;
+			values[i]++;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int takeJob(worker_t* self) {
+	worker_t* victim;
+	int job = -1;
+	int take, end;
+	int i;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->next < self->end)
+		job = self->next++;
+	pthread_mutex_unlock(&self->lock);
+	if (job >= 0)
+		return job;
+
+	for (i = 1; i < workerCount; i++) {
+		victim = &workers[(self->id + i) % workerCount];
+		pthread_mutex_lock(&victim->lock);
+		take = (victim->end - victim->next + 1) / 2;
+		end = victim->end;
+		victim->end -= take;
+		pthread_mutex_unlock(&victim->lock);
+		if (take > 0) {
+			job = end - take;
+			pthread_mutex_lock(&self->lock);
+			self->next = job + 1;
+			self->end = end;
+			pthread_mutex_unlock(&self->lock);
+			return job;
+		}
+	}
+	return -1;
+}
+
+static FILE* openOutput(int n) {
+	char filename[LINE_SIZE];
+	FILE* out;
+
+	if (outDir != NULL) {
+		snprintf(filename, sizeof(filename), "%s/job%06d.txt", outDir, n);
+		out = fopen(filename, "w");
+	} else {
+		out = open_memstream(&jobs[n].output, &jobs[n].outputSize);
+	}
+	if (out == NULL) {
+		printf("Error opening output of job %d, exit\n", n);
+		exit(1);
+	}
+	return out;
+}
+
+static void runJob(iss_t* iss, int n) {
+	job_t* job = &jobs[n];
+	FILE* out;
+	int i;
+
+	iss_copy_program(iss, programs[job->program]);
+	for (i = 0; i < job->writeCount; i++)
+		iss_write(iss, writes[job->firstWrite + i].addr, writes[job->firstWrite + i].value);
+
+	out = openOutput(n);
+	if (iss_run(iss, traceLevel, out, NULL, useJit) == ISS_ILLEGAL)
+		fprintf(out, "Illegal opcode %d at pc %d\n", iss->illegalOpcode, iss->pc);
+	for (i = 0; i < showCount; i++)
+		fprintf(out, "MEM[%d] = %08x\n", show[i], iss->mem[show[i]]);
+	fclose(out);
+}
+
+/*
+ * Same output as runJob() at TRACE_NONE, for jobs of one program
+ */
+static void runGroup(simd_t* simd, int* group, int lanes) {
+	job_t* job;
+	FILE* out;
+	int lane, i;
+
+	simd_copy_program(simd, programs[jobs[group[0]].program], lanes);
+	for (lane = 0; lane < lanes; lane++) {
+		job = &jobs[group[lane]];
+		for (i = 0; i < job->writeCount; i++)
+			simd_write(simd, lane, writes[job->firstWrite + i].addr, writes[job->firstWrite + i].value);
+	}
+
+	simd_run(simd);
+
+	for (lane = 0; lane < lanes; lane++) {
+		out = openOutput(group[lane]);
+		if (simd->status[lane] == ISS_ILLEGAL)
+			fprintf(out, "Illegal opcode %d at pc %d\n", simd->illegalOpcode[lane], simd->pc[lane]);
+		else
+			fprintf(out, "sim finished at pc %d, %lld instructions\n", simd->pc[lane] - 1, simd->instCount[lane]);
+		for (i = 0; i < showCount; i++)
+			fprintf(out, "MEM[%d] = %08x\n", show[i], simd_read(simd, lane, show[i]));
+		fclose(out);
+	}
+}
+
+static void runGroups(worker_t* self) {
+	int group[SIMD_LANES];
+	simd_t* simd;
+	int lanes = 0;
+	int job;
+
+	simd = simd_create();
+	if (simd == NULL) {
+		printf("Out of memory, exit\n");
+		exit(1);
+	}
+	while ((job = takeJob(self)) >= 0) {
+		if (lanes > 0 && jobs[job].program != jobs[group[0]].program) {
+			runGroup(simd, group, lanes);
+			lanes = 0;
+		}
+		group[lanes++] = job;
+		if (lanes == SIMD_LANES) {
+			runGroup(simd, group, lanes);
+			lanes = 0;
+		}
+	}
+	if (lanes > 0)
+		runGroup(simd, group, lanes);
+	simd_destroy(simd);
+}
+
+static void* workerMain(void* arg) {
+	worker_t* self = arg;
+	iss_t* iss;
+	int job;
+
+	if (useSimd) {
+		runGroups(self);
+		return NULL;
+	}
+	iss = iss_create();
+	if (iss == NULL) {
+		printf("Out of memory, exit\n");
+		exit(1);
+	}
+	while ((job = takeJob(self)) >= 0)
+		runJob(iss, job);
+	iss_destroy(iss);
+	return NULL;
+}
+
+static void usage(void) {
+	printf("usage: iss_batch [-j threads] [-t level] [-jit | -simd] [-o dir] [-m addr]... jobs_file\n");
+	printf("  -j threads     worker threads (default: one per cpu)\n");
+	printf("  -t level       trace level of every job (default %d)\n", TRACE_NONE);
+	printf("  -jit           run hot code through the x86-64 translator\n");
+	printf("  -simd          run %d jobs of a program at once in lockstep (trace level %d)\n", SIMD_LANES, TRACE_NONE);
+	printf("  -o dir         write the output of job N to dir/jobN.txt instead of stdout\n");
+	printf("  -m addr        report the final memory word at addr\n");
+}
+
+int main(int argc, char** argv) {
+	struct timeval start, stop;
+	double seconds;
+	int per;
+	int i, j;
+
+	workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			workerCount = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			traceLevel = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-jit") == 0) {
+			useJit = 1;
+		} else if (strcmp(argv[i], "-simd") == 0) {
+			useSimd = 1;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outDir = argv[++i];
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc && showCount < MAX_SHOW) {
+			show[showCount++] = strtol(argv[++i], NULL, 0);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (i != argc - 1 || traceLevel < TRACE_NONE || traceLevel > TRACE_FULL ||
+		(useJit && traceLevel > TRACE_SUMMARY) || (useSimd && (useJit || traceLevel != TRACE_NONE))) {
+		usage();
+		return 1;
+	}
+	if (workerCount < 1)
+		workerCount = 1;
+	if (workerCount > MAX_THREADS)
+		workerCount = MAX_THREADS;
+	if (readJobs(argv[i]) != 0)
+		return 1;
+
+	// contiguous shares to start with, stealing evens out the rest
+	gettimeofday(&start, NULL);
+	per = (jobCount + workerCount - 1) / workerCount;
+	for (i = 0; i < workerCount; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].id = i;
+		workers[i].next = (i * per < jobCount) ? i * per : jobCount;
+		workers[i].end = ((i + 1) * per < jobCount) ? (i + 1) * per : jobCount;
+	}
+	for (i = 0; i < workerCount; i++) {
+		if (pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) != 0) {
+			printf("Error starting worker %d, exit\n", i);
+			return 1;
+		}
+	}
+	for (i = 0; i < workerCount; i++)
+		pthread_join(workers[i].thread, NULL);
+	gettimeofday(&stop, NULL);
+
+	for (i = 0; i < jobCount; i++) {
+		if (jobs[i].output == NULL)
+			continue;
+		printf("--- job %d: %s", i, programs[jobs[i].program]->name);
+		for (j = 0; j < jobs[i].writeCount; j++)
+			printf(" %d=%d", writes[jobs[i].firstWrite + j].addr, (int) writes[jobs[i].firstWrite + j].value);
+		printf("\n");
+		fwrite(jobs[i].output, 1, jobs[i].outputSize, stdout);
+		free(jobs[i].output);
+	}
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+	fprintf(stderr, "%d jobs on %d threads in %.3f s\n", jobCount, workerCount, seconds);
+	return 0;
+}
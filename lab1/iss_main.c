@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iss.h"
+#include "profile.h"
+
+static void usage(void) {
+	printf("usage: iss [-jit] [-t level] [-b trace_file] [-d dump_file] [-c n] [-s n] [-r checkpoint] [-p prefix] program_name\n");
+	printf("  -jit           run hot code through the x86-64 translator (trace level %d or %d)\n", TRACE_NONE, TRACE_SUMMARY);
+	printf("  -t level       trace level: %d none, %d summary, %d per instruction, %d full (default %d)\n",
+		TRACE_NONE, TRACE_SUMMARY, TRACE_INST, TRACE_FULL, ISS_TRACE_LEVEL);
+	printf("  -b trace_file  write a binary trace to trace_file instead of a text trace,\n");
+	printf("                 trace_render turns it back into trace.txt\n");
+	printf("  -d dump_file   write the final memory contents to dump_file\n");
+	printf("  -c n           write checkpoint_<count>.ckpt every n instructions\n");
+	printf("  -s n           stop after instruction n and write its checkpoint\n");
+	printf("  -r checkpoint  resume a checkpoint of program_name\n");
+	printf("  -p prefix      profile the run into prefix.json and prefix.folded,\n");
+	printf("                 traced at level %d, or %d with -t %d\n", TRACE_SUMMARY, TRACE_NONE, TRACE_NONE);
+}
+
+static int writeCheckpoint(iss_t* iss) {
+	char filename[64];
+
+	sprintf(filename, "checkpoint_%lld.ckpt", iss->instCount);
+	if (iss_checkpoint(iss, filename) != 0) {
+		printf("Error writing file %s, exit\n", filename);
+		return 1;
+	}
+	return 0;
+}
+
+static int writeProfile(iss_t* iss, char* prefix) {
+	char filename[1024];
+
+	snprintf(filename, sizeof(filename), "%s.json", prefix);
+	if (profile_write_json(iss->profile, iss, filename) != 0) {
+		printf("Error writing file %s, exit\n", filename);
+		return 1;
+	}
+	snprintf(filename, sizeof(filename), "%s.folded", prefix);
+	if (profile_write_folded(iss->profile, iss, filename) != 0) {
+		printf("Error writing file %s, exit\n", filename);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	char* inFilename;
+	char* outFilename = "trace.txt";
+	char* dumpFilename = NULL;
+	char* binaryFilename = NULL;
+	char* restoreFilename = NULL;
+	char* profilePrefix = NULL;
+	btrace_t* bt = NULL;
+	FILE* outFile;
+	iss_t* iss;
+	int traceLevel = ISS_TRACE_LEVEL;
+	int traceSet = 0;
+	int useJit = 0;
+	long long every = 0;
+	long long stopAfter = 0;
+	int status;
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-jit") == 0) {
+			useJit = 1;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			traceLevel = atoi(argv[++i]);
+			traceSet = 1;
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			binaryFilename = argv[++i];
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			dumpFilename = argv[++i];
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			every = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			stopAfter = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			restoreFilename = argv[++i];
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			profilePrefix = argv[++i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (i != argc - 1 || traceLevel < TRACE_NONE || traceLevel > TRACE_FULL ||
+		(useJit && (traceLevel > TRACE_SUMMARY || binaryFilename != NULL || every > 0 || stopAfter > 0)) ||
+		(profilePrefix != NULL && (useJit || binaryFilename != NULL || (traceSet && traceLevel > TRACE_SUMMARY)))) {
+		usage();
+		return 1;
+	}
+	inFilename = argv[i];
+
+	iss = iss_create();
+	if (iss == NULL) {
+		printf("Out of memory, exit\n");
+		return 1;
+	}
+	switch (iss_load(iss, inFilename)) {
+	case 0:
+		break;
+	case -1:
+		printf("Error opening file %s, exit\n", inFilename);
+		return 1;
+	default:
+		printf("Error reading from file %s, exit\n", inFilename);
+		return 1;
+	}
+	if (restoreFilename != NULL) {
+		switch (iss_restore(iss, restoreFilename)) {
+		case 0:
+			break;
+		case -1:
+			printf("Error opening file %s, exit\n", restoreFilename);
+			return 1;
+		default:
+			printf("Error reading from file %s, not a checkpoint of %s, exit\n", restoreFilename, inFilename);
+			return 1;
+		}
+	}
+
+	if (profilePrefix != NULL) {
+		iss->profile = profile_create();
+		if (iss->profile == NULL) {
+			printf("Out of memory, exit\n");
+			return 1;
+		}
+	}
+
+	outFile = fopen(outFilename, "w");
+	if (outFile == NULL) {
+		printf("Error opening file %s, exit\n", outFilename);
+		return 1;
+	}
+	if (binaryFilename != NULL) {
+		bt = btrace_open(binaryFilename, BTRACE_FLAVOR_ISS, inFilename, iss->lines);
+		if (bt == NULL) {
+			printf("Error opening file %s, exit\n", binaryFilename);
+			return 1;
+		}
+	}
+
+	// Stop at every checkpoint, the trace just carries on
+	for (;;) {
+		iss->stopAt = every > 0 ? (iss->instCount / every + 1) * every : 0;
+		if (stopAfter > iss->instCount && (iss->stopAt == 0 || stopAfter < iss->stopAt))
+			iss->stopAt = stopAfter;
+		status = iss_run(iss, traceLevel, outFile, bt, useJit);
+		if (status != ISS_STOPPED)
+			break;
+		if (writeCheckpoint(iss) != 0)
+			return 1;
+		if (iss->instCount == stopAfter) {
+			fclose(outFile);
+			if (bt != NULL)
+				btrace_close(bt);
+			return profilePrefix != NULL ? writeProfile(iss, profilePrefix) : 0;
+		}
+	}
+	if (status == ISS_ILLEGAL) {
+		printf("Illegal opcode %d!\n", iss->illegalOpcode);
+		fclose(outFile);
+		if (bt != NULL)
+			btrace_close(bt);
+		if (profilePrefix != NULL)
+			writeProfile(iss, profilePrefix);
+		return 1;
+	}
+	fclose(outFile);
+	if (bt != NULL)
+		btrace_close(bt);
+
+	if (profilePrefix != NULL && writeProfile(iss, profilePrefix) != 0)
+		return 1;
+	if (dumpFilename != NULL)
+		return iss_dump_memory(iss, dumpFilename);
+	iss_destroy(iss);
+	return 0;
+}
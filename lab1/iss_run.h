@@ -0,0 +1,274 @@
+/*
+ * Interpreter loop template, included once per trace level by iss.c with
+ * RUN_NAME and TRACE_LEVEL defined. Trace statements a level does not use
+ * are compiled out, so the TRACE_NONE loop does no formatting at all.
+ * With TRACE_RECORDS defined to 1 every instruction also appends a binary
+ * trace record to bt, with PROFILE defined to 1 it is counted in
+ * iss->profile.
+ */
+#if TRACE_RECORDS
+// The record is written once the instruction is done, remember what it was
+#define TRACE_FETCH()											\
+	do {														\
+		recPc = pc;												\
+		recInst = mem[pc];										\
+	} while (0)
+#elif TRACE_LEVEL >= TRACE_FULL
+#define TRACE_FETCH()											\
+	do {														\
+		printFetch(d, instCount, pc, mem, outFile);				\
+		printRegs(d, regs, outFile);							\
+	} while (0)
+#elif TRACE_LEVEL >= TRACE_INST
+#define TRACE_FETCH()	printFetch(d, instCount, pc, mem, outFile)
+#else
+#define TRACE_FETCH()	do { } while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_INST
+#define TRACE_EXEC(...)	fprintf(outFile, __VA_ARGS__)
+#define TRACE_ILLEGAL()	printHeader(instCount, pc, outFile)
+#else
+#define TRACE_EXEC(...)	do { } while (0)
+#define TRACE_ILLEGAL()	do { } while (0)
+#endif
+
+#if TRACE_RECORDS
+#define TRACE_RECORD(reg, flags, value)	btrace_write(bt, recPc, recInst, reg, flags, value)
+#else
+#define TRACE_RECORD(reg, flags, value)	do { } while (0)
+#endif
+#define TRACE_WRITE(value)	TRACE_RECORD(d->dst > 1 ? d->dst : 0, 0, value)
+
+#if PROFILE
+#define PROFILE_FETCH()								\
+	do {											\
+		if (profile->count[pc]++ == 0)				\
+			profile->inst[pc] = mem[pc];			\
+		profile->opcodes[d->handler - 1]++;			\
+	} while (0)
+#define PROFILE_TAKEN()		profile->taken[(unsigned short) regs[7]]++
+#define PROFILE_LOAD(addr)	profile->loads[addr]++
+#define PROFILE_STORE(addr)	profile->stores[addr]++
+#else
+#define PROFILE_FETCH()		do { } while (0)
+#define PROFILE_TAKEN()		do { } while (0)
+#define PROFILE_LOAD(addr)	do { } while (0)
+#define PROFILE_STORE(addr)	do { } while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_SUMMARY
+#define TRACE_HALT(...)	fprintf(outFile, __VA_ARGS__)
+#else
+#define TRACE_HALT(...)	do { } while (0)
+#endif
+
+/*
+ * Threaded interpreter. Every handler ends by dispatching straight to the
+ * handler of the next instruction; words that were never executed (or were
+ * overwritten by ST) go through the decode handler first.
+ *
+ * regs[1] is loaded with the immediate before the operands are read, so
+ * "src == 1" needs no special case, and writes to R0/R1 land in regs[REG_SINK].
+ */
+static int RUN_NAME(iss_t* iss, FILE* outFile, btrace_t* bt) {
+	static void* dispatch[32 + 1] = {
+		[HANDLER_DECODE] = &&decode,
+		[ADD + 1] = &&op_add,
+		[SUB + 1] = &&op_sub,
+		[LSF + 1] = &&op_lsf,
+		[RSF + 1] = &&op_rsf,
+		[AND + 1] = &&op_and,
+		[OR + 1] = &&op_or,
+		[XOR + 1] = &&op_xor,
+		[LHI + 1] = &&op_lhi,
+		[LD + 1] = &&op_ld,
+		[ST + 1] = &&op_st,
+		[JLT + 1] = &&op_jlt,
+		[JLE + 1] = &&op_jle,
+		[JEQ + 1] = &&op_jeq,
+		[JNE + 1] = &&op_jne,
+		[JIN + 1] = &&op_jin,
+		[HLT + 1] = &&op_hlt,
+	};
+	unsigned int* mem = iss->mem;
+	int* regs = iss->regs;
+	Predecoded* code = iss->code;
+	unsigned short pc = iss->pc;
+	long long instCount = iss->instCount;
+	long long stopAt = iss->stopAt > 0 ? iss->stopAt : LLONG_MAX;
+#if PROFILE
+	struct profile_s* profile = iss->profile;
+#endif
+	int status = ISS_HALTED;
+	Predecoded* d;
+	int val0, val1;
+#if TRACE_RECORDS
+	unsigned short recPc = 0;
+	unsigned int recInst = 0;
+#endif
+
+#define DISPATCH()						\
+	do {								\
+		d = &code[pc];					\
+		goto *dispatch[d->handler];		\
+	} while (0)
+
+#define BEGIN()												\
+	do {													\
+		TRACE_FETCH();										\
+		PROFILE_FETCH();									\
+		regs[1] = d->immediate;								\
+		val0 = regs[d->src0];								\
+		val1 = regs[d->src1];								\
+		pc++;												\
+	} while (0)
+
+#define NEXT()						\
+	do {							\
+		if (++instCount >= stopAt)	\
+			goto stop;				\
+		DISPATCH();					\
+	} while (0)
+
+#define JUMP_IF(cond, name)																	\
+	do {																					\
+		BEGIN();																			\
+		if (cond) {																			\
+			regs[7] = pc - 1;																\
+			pc = d->immediate;																\
+			PROFILE_TAKEN();																\
+			TRACE_RECORD(7, BTRACE_TAKEN, regs[7]);											\
+		} else {																			\
+			TRACE_RECORD(0, 0, 0);															\
+		}																					\
+		TRACE_EXEC(">>>> EXEC: " name " %d, %d, %d <<<<\n\n", val0, val1, pc);			\
+		NEXT();																				\
+	} while (0)
+
+	DISPATCH();
+
+decode:
+	predecode(d, mem[pc]);
+	if (dispatch[d->handler] == NULL) {
+		// Only the first trace line, the rest would name the opcode
+		TRACE_ILLEGAL();
+		iss->illegalOpcode = d->handler - 1;
+		d->handler = HANDLER_DECODE;
+		status = ISS_ILLEGAL;
+		goto out;
+	}
+	goto *dispatch[d->handler];
+
+op_add:
+	BEGIN();
+	regs[d->wdst] = val0 + val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d ADD %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_sub:
+	BEGIN();
+	regs[d->wdst] = val0 - val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d SUB %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_lsf:
+	BEGIN();
+	regs[d->wdst] = val0 << val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d LSF %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_rsf:
+	BEGIN();
+	regs[d->wdst] = val0 >> val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d RSF %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_and:
+	BEGIN();
+	regs[d->wdst] = val0 & val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d AND %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_or:
+	BEGIN();
+	regs[d->wdst] = val0 | val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d OR %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_xor:
+	BEGIN();
+	regs[d->wdst] = val0 ^ val1;
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = %d XOR %d <<<<\n\n", d->dst, val0, val1);
+	NEXT();
+op_lhi:
+	BEGIN();
+	regs[d->wdst] = (d->immediate << 16) | (regs[d->dst] & 0xffff);
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d][31:16] = %d <<<<\n\n", d->dst, d->immediate);
+	NEXT();
+op_ld:
+	BEGIN();
+	PROFILE_LOAD(val1 & 0xffff);
+	regs[d->wdst] = mem[val1 & 0xffff];
+	TRACE_WRITE(regs[d->wdst]);
+	TRACE_EXEC(">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n", d->dst, val1, mem[val1 & 0xffff]);
+	NEXT();
+op_st:
+	BEGIN();
+	PROFILE_STORE(val1 & 0xffff);
+	mem[val1 & 0xffff] = val0;
+	// Drop any predecoded copy of the overwritten word
+	code[val1 & 0xffff].handler = HANDLER_DECODE;
+	iss->dirty[(val1 & 0xffff) / PAGE_WORDS] = 1;
+	TRACE_RECORD(0, 0, val0);
+	TRACE_EXEC(">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n", val1, d->src0, val0);
+	NEXT();
+op_jlt:
+	JUMP_IF(val0 < val1, "JLT");
+op_jle:
+	JUMP_IF(val0 <= val1, "JLE");
+op_jeq:
+	JUMP_IF(val0 == val1, "JEQ");
+op_jne:
+	JUMP_IF(val0 != val1, "JNE");
+op_jin:
+	BEGIN();
+	regs[7] = pc - 1;
+	pc = val0;
+	PROFILE_TAKEN();
+	TRACE_RECORD(7, BTRACE_TAKEN, regs[7]);
+	TRACE_EXEC(">>>> EXEC: JIN R[%d] = %08x <<<<\n\n", d->src0, val0);
+	NEXT();
+op_hlt:
+	BEGIN();
+	TRACE_RECORD(0, 0, 0);
+	// Intentionally print one line break
+	TRACE_HALT(">>>> EXEC: HALT at PC %04x<<<<\n", pc - 1);
+	instCount++;
+	goto out;
+
+stop:
+	status = ISS_STOPPED;
+out:
+
+#undef JUMP_IF
+#undef NEXT
+#undef BEGIN
+#undef DISPATCH
+#undef TRACE_FETCH
+#undef TRACE_EXEC
+#undef PROFILE_FETCH
+#undef PROFILE_TAKEN
+#undef PROFILE_LOAD
+#undef PROFILE_STORE
+#undef TRACE_HALT
+#undef TRACE_ILLEGAL
+#undef TRACE_RECORD
+#undef TRACE_WRITE
+
+	iss->pc = pc;
+	iss->instCount = instCount;
+	return status;
+}
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "iss.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE		(16 * 1024 * 1024)
+#define JIT_MAX_BLOCK		64		// SP instructions per translated block
+#define JIT_MAX_INST_BYTES	64		// upper bound on host code emitted per SP instruction
+#define JIT_HOT_THRESHOLD	16		// interpreted visits before a block gets translated
+#define JIT_MAX_PENDING		4096	// unchained block exits remembered for patching
+
+/*
+ * Why control came back from translated code
+ */
+enum {
+	EXIT_BRANCH,	// jump to a pc that has no translated block yet
+	EXIT_HALT,		// HLT executed
+	EXIT_SMC,		// ST hit a word that is part of a translated block
+	EXIT_ILLEGAL,	// illegal opcode, cpu.pc left at it
+};
+
+/*
+ * x86-64 register numbers
+ */
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/*
+ * While translated code runs, SP r2..r7 live in the callee-saved host
+ * registers below, rdi points at the jit_cpu_t, rsi at SP memory and r8
+ * holds the instruction count. R0 and R1 are never materialized: reads
+ * become constants and writes are dropped.
+ */
+static const int hostReg[REG_COUNT] = { -1, -1, RBX, RBP, R12, R13, R14, R15 };
+
+typedef struct {
+	int regs[REG_COUNT];
+	long long instCount;
+	unsigned int pc;
+	unsigned int exitReason;
+	unsigned char covered[MAX_MEMORY_SIZE];	// word belongs to a translated block
+	unsigned char* entry[MAX_MEMORY_SIZE];		// translated block starting at this pc
+	unsigned char dirty[MAX_MEMORY_SIZE / PAGE_WORDS];	// pages stored to this run
+} jit_cpu_t;
+
+typedef struct {
+	unsigned char* patch;	// exit stub to turn into a direct jump
+	unsigned short target;
+} jit_pending_t;
+
+struct jit_s {
+	jit_cpu_t cpu;
+	unsigned char* code;
+	unsigned char* blocks;		// first byte after the prologue/epilogue
+	unsigned char* emit;		// next free byte
+	unsigned char* epilogue;
+	unsigned char* exitBranch;
+	void (*enter)(jit_cpu_t* cpu, unsigned int* mem, unsigned char* block);
+	unsigned int hits[MAX_MEMORY_SIZE];
+	jit_pending_t pending[JIT_MAX_PENDING];
+	int pendingCount;
+};
+
+/*
+ * code emission
+ */
+static void emit8(jit_t* j, int b) {
+	*j->emit++ = b;
+}
+
+static void emit32(jit_t* j, int v) {
+	memcpy(j->emit, &v, 4);
+	j->emit += 4;
+}
+
+static void patchRel32(unsigned char* at, unsigned char* target) {
+	int rel = target - (at + 4);
+
+	memcpy(at, &rel, 4);
+}
+
+static void emitRex(jit_t* j, int w, int reg, int rm) {
+	int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+
+	if (rex != 0x40)
+		emit8(j, rex);
+}
+
+// <op> rm32, reg32 (mov, add, sub, and, or, xor, cmp)
+static void emitRR(jit_t* j, int op, int rm, int reg) {
+	emitRex(j, 0, reg, rm);
+	emit8(j, op);
+	emit8(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg32, imm32
+static void emitMovImm(jit_t* j, int reg, int imm) {
+	emitRex(j, 0, 0, reg);
+	emit8(j, 0xB8 | (reg & 7));
+	emit32(j, imm);
+}
+
+// mov reg, [rdi + disp] (op 0x8B) or mov [rdi + disp], reg (op 0x89)
+static void emitCpuAccess(jit_t* j, int op, int w, int reg, int disp) {
+	emitRex(j, w, reg, RDI);
+	emit8(j, op);
+	emit8(j, 0x80 | ((reg & 7) << 3) | (RDI & 7));
+	emit32(j, disp);
+}
+
+static void emitJmpTo(jit_t* j, unsigned char* target) {
+	emit8(j, 0xE9);
+	emit32(j, 0);
+	patchRel32(j->emit - 4, target);
+}
+
+// add r8, n
+static void emitCount(jit_t* j, int n) {
+	emitRex(j, 1, 0, R8);
+	emit8(j, 0x81);
+	emit8(j, 0xC0 | (R8 & 7));
+	emit32(j, n);
+}
+
+// eax/ecx <- SP source operand
+static void emitOperand(jit_t* j, int host, int src, int immediate) {
+	if (src == 0)
+		emitRR(j, 0x31, host, host);
+	else if (src == 1)
+		emitMovImm(j, host, immediate);
+	else
+		emitRR(j, 0x89, host, hostReg[src]);
+}
+
+/*
+ * Leaves the block for a statically known pc. If that pc is already
+ * translated the exit is a direct jump, otherwise it is a stub that returns
+ * to the dispatcher and gets patched into a jump once the target exists.
+ */
+static void emitExit(jit_t* j, unsigned short target) {
+	if (j->cpu.entry[target]) {
+		emitJmpTo(j, j->cpu.entry[target]);
+		return;
+	}
+	if (j->pendingCount < JIT_MAX_PENDING) {
+		j->pending[j->pendingCount].patch = j->emit;
+		j->pending[j->pendingCount].target = target;
+		j->pendingCount++;
+	}
+	// 5 bytes, overwritten by "jmp block" when chained
+	emitMovImm(j, RAX, target);
+	emitJmpTo(j, j->exitBranch);
+}
+
+static void emitPrologue(jit_t* j) {
+	static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+	int i;
+
+	j->enter = (void (*)(jit_cpu_t*, unsigned int*, unsigned char*)) j->emit;
+	for (i = 0; i < 6; i++) {
+		emitRex(j, 0, 0, saved[i]);
+		emit8(j, 0x50 | (saved[i] & 7));
+	}
+	for (i = 2; i < REG_COUNT; i++)
+		emitCpuAccess(j, 0x8B, 0, hostReg[i], offsetof(jit_cpu_t, regs) + i * 4);
+	emitCpuAccess(j, 0x8B, 1, R8, offsetof(jit_cpu_t, instCount));
+	// jmp rdx
+	emit8(j, 0xFF);
+	emit8(j, 0xE2);
+
+	// eax = next pc, edx = exit reason
+	j->epilogue = j->emit;
+	for (i = 2; i < REG_COUNT; i++)
+		emitCpuAccess(j, 0x89, 0, hostReg[i], offsetof(jit_cpu_t, regs) + i * 4);
+	emitCpuAccess(j, 0x89, 1, R8, offsetof(jit_cpu_t, instCount));
+	emitCpuAccess(j, 0x89, 0, RAX, offsetof(jit_cpu_t, pc));
+	emitCpuAccess(j, 0x89, 0, RDX, offsetof(jit_cpu_t, exitReason));
+	for (i = 5; i >= 0; i--) {
+		emitRex(j, 0, 0, saved[i]);
+		emit8(j, 0x58 | (saved[i] & 7));
+	}
+	emit8(j, 0xC3);
+
+	j->exitBranch = j->emit;
+	emitMovImm(j, RDX, EXIT_BRANCH);
+	emitJmpTo(j, j->epilogue);
+}
+
+/*
+ * Drops every translated block, e.g. after self-modifying code
+ */
+static void flush(jit_t* j) {
+	memset(j->cpu.covered, 0, sizeof(j->cpu.covered));
+	memset(j->cpu.entry, 0, sizeof(j->cpu.entry));
+	memset(j->hits, 0, sizeof(j->hits));
+	j->pendingCount = 0;
+	j->emit = j->blocks;
+}
+
+static void chain(jit_t* j, unsigned short pc) {
+	unsigned char* p;
+	int i = 0;
+
+	while (i < j->pendingCount) {
+		if (j->pending[i].target == pc) {
+			p = j->pending[i].patch;
+			p[0] = 0xE9;
+			patchRel32(p + 1, j->cpu.entry[pc]);
+			j->pending[i] = j->pending[--j->pendingCount];
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Translates the basic block starting at start. Returns 0 if the first
+ * instruction is illegal, leaving the error to the interpreter.
+ */
+static int translate(jit_t* j, unsigned int* mem, unsigned short start) {
+	static const int aluOp[] = { [ADD] = 0x01, [SUB] = 0x29, [AND] = 0x21, [OR] = 0x09, [XOR] = 0x31 };
+	unsigned char* block;
+	unsigned char* taken;
+	unsigned short pc = start;
+	unsigned short next;
+	Instruction inst;
+	int link;
+	int n = 0;
+
+	if (j->emit + JIT_MAX_BLOCK * JIT_MAX_INST_BYTES > j->code + JIT_CODE_SIZE)
+		flush(j);
+	block = j->emit;
+
+	while (n < JIT_MAX_BLOCK) {
+		inst = fetch(mem[pc]);
+		next = pc + 1;
+		// value the interpreter leaves in R7 when this instruction jumps
+		link = next - 1;
+
+		switch (inst.opcode) {
+		case ADD:
+		case SUB:
+		case AND:
+		case OR:
+		case XOR:
+		case LSF:
+		case RSF:
+			if (inst.dst > 1) {
+				emitOperand(j, RAX, inst.src0, inst.immediate);
+				emitOperand(j, RCX, inst.src1, inst.immediate);
+				if (inst.opcode == LSF || inst.opcode == RSF) {
+					// shl/sar eax, cl
+					emit8(j, 0xD3);
+					emit8(j, inst.opcode == LSF ? 0xE0 : 0xF8);
+				} else {
+					emitRR(j, aluOp[inst.opcode], RAX, RCX);
+				}
+				emitRR(j, 0x89, hostReg[inst.dst], RAX);
+			}
+			break;
+		case LHI:
+			if (inst.dst > 1) {
+				emitRR(j, 0x89, RCX, hostReg[inst.dst]);
+				// and ecx, 0xffff
+				emit8(j, 0x81);
+				emit8(j, 0xE1);
+				emit32(j, 0xffff);
+				// or ecx, immediate << 16
+				emit8(j, 0x81);
+				emit8(j, 0xC9);
+				emit32(j, (unsigned int) inst.immediate << 16);
+				emitRR(j, 0x89, hostReg[inst.dst], RCX);
+			}
+			break;
+		case LD:
+			if (inst.dst > 1) {
+				emitOperand(j, RCX, inst.src1, inst.immediate);
+				// movzx ecx, cx; mov eax, [rsi + rcx * 4]
+				emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC9);
+				emit8(j, 0x8B); emit8(j, 0x04); emit8(j, 0x8E);
+				emitRR(j, 0x89, hostReg[inst.dst], RAX);
+			}
+			break;
+		case ST:
+			emitOperand(j, RAX, inst.src0, inst.immediate);
+			emitOperand(j, RCX, inst.src1, inst.immediate);
+			// movzx ecx, cx; mov [rsi + rcx * 4], eax
+			emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC9);
+			emit8(j, 0x89); emit8(j, 0x04); emit8(j, 0x8E);
+			// mov edx, ecx; shr edx, log2(PAGE_WORDS); mov byte [rdi + rdx + dirty], 1
+			emitRR(j, 0x89, RDX, RCX);
+			emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, __builtin_ctz(PAGE_WORDS));
+			emit8(j, 0xC6); emit8(j, 0x84); emit8(j, 0x17);
+			emit32(j, offsetof(jit_cpu_t, dirty));
+			emit8(j, 0x01);
+			// cmp byte [rdi + rcx + covered], 0; je skip
+			emit8(j, 0x80); emit8(j, 0xBC); emit8(j, 0x0F);
+			emit32(j, offsetof(jit_cpu_t, covered));
+			emit8(j, 0x00);
+			emit8(j, 0x74);
+			emit8(j, 0);
+			taken = j->emit;
+			emitCount(j, n + 1);
+			emitMovImm(j, RAX, next);
+			emitMovImm(j, RDX, EXIT_SMC);
+			emitJmpTo(j, j->epilogue);
+			taken[-1] = j->emit - taken;
+			break;
+		case JLT:
+		case JLE:
+		case JEQ:
+		case JNE:
+			emitOperand(j, RAX, inst.src0, inst.immediate);
+			emitOperand(j, RCX, inst.src1, inst.immediate);
+			emitRR(j, 0x39, RAX, RCX);
+			// jl / jle / je / jne taken
+			emit8(j, 0x0F);
+			emit8(j, inst.opcode == JLT ? 0x8C : inst.opcode == JLE ? 0x8E : inst.opcode == JEQ ? 0x84 : 0x85);
+			emit32(j, 0);
+			taken = j->emit;
+			emitCount(j, n + 1);
+			emitExit(j, next);
+			patchRel32(taken - 4, j->emit);
+			emitMovImm(j, hostReg[7], link);
+			emitCount(j, n + 1);
+			emitExit(j, inst.immediate);
+			goto done;
+		case JIN:
+			emitOperand(j, RAX, inst.src0, inst.immediate);
+			emitMovImm(j, hostReg[7], link);
+			// movzx eax, ax
+			emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC0);
+			emitCount(j, n + 1);
+			// mov rdx, [rdi + rax * 8 + entry]; test rdx, rdx; jz exitBranch; jmp rdx
+			emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x94); emit8(j, 0xC7);
+			emit32(j, offsetof(jit_cpu_t, entry));
+			emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xD2);
+			emit8(j, 0x0F); emit8(j, 0x84);
+			emit32(j, 0);
+			patchRel32(j->emit - 4, j->exitBranch);
+			emit8(j, 0xFF); emit8(j, 0xE2);
+			goto done;
+		case HLT:
+			emitCount(j, n + 1);
+			emitMovImm(j, RAX, next);
+			emitMovImm(j, RDX, EXIT_HALT);
+			emitJmpTo(j, j->epilogue);
+			goto done;
+		default:
+			// illegal: end the block in front of it
+			if (n == 0) {
+				j->emit = block;
+				return 0;
+			}
+			goto fallthrough;
+		}
+		j->cpu.covered[pc] = 1;
+		n++;
+		pc = next;
+	}
+
+fallthrough:
+	emitCount(j, n);
+	emitExit(j, pc);
+	j->cpu.entry[start] = block;
+	chain(j, start);
+	return 1;
+
+done:
+	j->cpu.covered[pc] = 1;
+	j->cpu.entry[start] = block;
+	chain(j, start);
+	return 1;
+}
+
+/*
+ * Executes one basic block starting at cpu.pc without translating it.
+ * Used for code that is not hot yet, and again after an invalidation.
+ */
+static int interpret(jit_t* j, unsigned int* mem) {
+	int* regs = j->cpu.regs;
+	unsigned short pc = j->cpu.pc;
+	Instruction inst;
+	int val0, val1;
+	int reason = -1;
+
+	while (reason < 0) {
+		inst = fetch(mem[pc]);
+		val0 = (inst.src0 == 1 || inst.opcode == LHI) ? inst.immediate : regs[inst.src0];
+		val1 = (inst.src1 == 1) ? inst.immediate : regs[inst.src1];
+		pc++;
+
+		switch (inst.opcode) {
+		case ADD:	regs[inst.dst] = val0 + val1;	break;
+		case SUB:	regs[inst.dst] = val0 - val1;	break;
+		case LSF:	regs[inst.dst] = val0 << val1;	break;
+		case RSF:	regs[inst.dst] = val0 >> val1;	break;
+		case AND:	regs[inst.dst] = val0 & val1;	break;
+		case OR:	regs[inst.dst] = val0 | val1;	break;
+		case XOR:	regs[inst.dst] = val0 ^ val1;	break;
+		case LHI:	regs[inst.dst] = (val0 << 16) | (regs[inst.dst] & 0xffff);	break;
+		case LD:	regs[inst.dst] = mem[val1 & 0xffff];	break;
+		case ST:
+			mem[val1 & 0xffff] = val0;
+			j->cpu.dirty[(val1 & 0xffff) / PAGE_WORDS] = 1;
+			if (j->cpu.covered[val1 & 0xffff])
+				reason = EXIT_SMC;
+			break;
+		case JLT:
+		case JLE:
+		case JEQ:
+		case JNE:
+			if ((inst.opcode == JLT && val0 < val1) || (inst.opcode == JLE && val0 <= val1) ||
+				(inst.opcode == JEQ && val0 == val1) || (inst.opcode == JNE && val0 != val1)) {
+				regs[7] = pc - 1;
+				pc = inst.immediate;
+			}
+			reason = EXIT_BRANCH;
+			break;
+		case JIN:
+			regs[7] = pc - 1;
+			pc = val0;
+			reason = EXIT_BRANCH;
+			break;
+		case HLT:
+			reason = EXIT_HALT;
+			break;
+		default:
+			j->cpu.pc = pc - 1;
+			return EXIT_ILLEGAL;
+		}
+		regs[0] = 0;
+		regs[1] = 0;
+		j->cpu.instCount++;
+	}
+	j->cpu.pc = pc;
+	return reason;
+}
+
+jit_t* jit_create(void) {
+	jit_t* j;
+
+	j = calloc(1, sizeof(jit_t));
+	if (j == NULL)
+		return NULL;
+	j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->code == MAP_FAILED) {
+		free(j);
+		return NULL;
+	}
+	j->emit = j->code;
+	emitPrologue(j);
+	j->blocks = j->emit;
+	return j;
+}
+
+void jit_destroy(jit_t* j) {
+	if (j == NULL)
+		return;
+	munmap(j->code, JIT_CODE_SIZE);
+	free(j);
+}
+
+void jit_invalidate(jit_t* j, int addr, int words) {
+	int i;
+
+	if (j == NULL)
+		return;
+	for (i = addr; i < addr + words; i++) {
+		if (j->cpu.covered[i]) {
+			flush(j);
+			return;
+		}
+	}
+}
+
+int jit_run(jit_t* j, unsigned int* mem, int* regs, unsigned short* pc, long long* instCount, unsigned char* dirty) {
+	unsigned short at;
+	int reason;
+	int page;
+
+	memcpy(j->cpu.regs, regs, sizeof(j->cpu.regs));
+	j->cpu.pc = *pc;
+	j->cpu.instCount = *instCount;
+
+	do {
+		at = j->cpu.pc;
+		if (j->cpu.entry[at] == NULL && ++j->hits[at] >= JIT_HOT_THRESHOLD)
+			translate(j, mem, at);
+		if (j->cpu.entry[at]) {
+			j->enter(&j->cpu, mem, j->cpu.entry[at]);
+			reason = j->cpu.exitReason;
+		} else {
+			reason = interpret(j, mem);
+		}
+		if (reason == EXIT_SMC)
+			flush(j);
+	} while (reason != EXIT_HALT && reason != EXIT_ILLEGAL);
+
+	memcpy(regs, j->cpu.regs, sizeof(j->cpu.regs));
+	*pc = j->cpu.pc;
+	*instCount = j->cpu.instCount;
+	for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++) {
+		if (j->cpu.dirty[page]) {
+			dirty[page] = 1;
+			j->cpu.dirty[page] = 0;
+		}
+	}
+	return (reason == EXIT_ILLEGAL) ? 1 : 0;
+}
+
+#else
+
+jit_t* jit_create(void) {
+	return NULL;
+}
+
+void jit_destroy(jit_t* j) {
+}
+
+void jit_invalidate(jit_t* j, int addr, int words) {
+}
+
+int jit_run(jit_t* j, unsigned int* mem, int* regs, unsigned short* pc, long long* instCount, unsigned char* dirty) {
+	return -1;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+/*
+ * Basic-block translator from SP code to native x86-64 code.
+ *
+ * A translator keeps its blocks from one run to the next, so runs of the
+ * same program only translate it once. Words stored to outside of
+ * jit_run() must be handed to jit_invalidate() before the next run.
+ */
+typedef struct jit_s jit_t;
+
+// NULL if the translator is not available on this host
+jit_t* jit_create(void);
+void jit_destroy(jit_t* j);
+
+// Drops the blocks translated from words [addr, addr + words)
+void jit_invalidate(jit_t* j, int addr, int words);
+
+/*
+ * Runs the program in mem from *pc until HLT, updating regs, *pc and
+ * *instCount exactly like the interpreter does (no trace is written), and
+ * setting dirty[page] for the pages of PAGE_WORDS words it stored to.
+ * Returns 0 when the program halted or 1 on an illegal opcode (*pc is left
+ * at it).
+ */
+int jit_run(jit_t* j, unsigned int* mem, int* regs, unsigned short* pc, long long* instCount, unsigned char* dirty);
+
+#endif
@@ -0,0 +1,23 @@
+# Multiplication table, the program lab1/asm.c generates
+	N = 10
+	add r2, r0, N			# row
+	add r3, r0, N			# column
+	add r5, r0, table + N * N - 1	# ptr
+	add r6, r0, N			# saved column
+loop:	jeq r2, r0, done
+	add r4, r0, 0
+mult:	jeq r3, r0, store
+	add r4, r4, r2
+	sub r3, r3, 1
+	jmp mult
+store:	st r4, r5
+	sub r5, r5, 1
+	sub r6, r6, 1
+	jne r6, r0, restore
+	add r6, r0, N
+	sub r2, r2, 1
+restore: add r3, r6, r0, 0
+	jeq r0, r0, loop
+done:	hlt
+	.org 2000
+table:	.space N * N
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+typedef struct {
+	int head;					// jump target, first pc of the loop
+	int tail;					// the backward jump
+	long long iterations;		// times the jump was taken
+	long long notTaken;			// times it fell through
+	long long instructions;		// executed in head..tail
+} loop_t;
+
+profile_t* profile_create(void) {
+	return calloc(1, sizeof(profile_t));
+}
+
+void profile_destroy(profile_t* profile) {
+	free(profile);
+}
+
+static int isLegal(int opcode) {
+	return opcode <= ST || (opcode >= JLT && opcode <= JIN) || opcode == HLT;
+}
+
+static char* opcodeName(int opcode) {
+	return isLegal(opcode) ? toOpcodeName(opcode) : "?";
+}
+
+static long long total(profile_t* profile) {
+	long long sum = 0;
+	int op;
+
+	for (op = 0; op < 32; op++)
+		sum += profile->opcodes[op];
+	return sum;
+}
+
+static int byInstructions(const void* a, const void* b) {
+	const loop_t* x = a;
+	const loop_t* y = b;
+
+	if (x->instructions != y->instructions)
+		return x->instructions < y->instructions ? 1 : -1;
+	return x->head - y->head;
+}
+
+// Outer loops first: wider spans, then lower heads
+static int bySpan(const void* a, const void* b) {
+	const loop_t* x = a;
+	const loop_t* y = b;
+
+	if (x->tail - x->head != y->tail - y->head)
+		return (y->tail - y->head) - (x->tail - x->head);
+	return x->head - y->head;
+}
+
+/*
+ * Hot loops, hottest first. Returns the number found, *loops is malloc'ed.
+ */
+static int findLoops(profile_t* profile, loop_t** loops) {
+	Instruction inst;
+	loop_t* found;
+	int n = 0, pc, target, i;
+
+	found = malloc(MAX_MEMORY_SIZE * sizeof(loop_t));
+	if (found == NULL)
+		return -1;
+	for (pc = 0; pc < MAX_MEMORY_SIZE; pc++) {
+		if (profile->taken[pc] == 0)
+			continue;
+		inst = fetch(profile->inst[pc]);
+		target = inst.immediate & 0xffff;
+		if (inst.opcode < JLT || inst.opcode > JNE || target > pc)
+			continue;
+		found[n].head = target;
+		found[n].tail = pc;
+		found[n].iterations = profile->taken[pc];
+		found[n].notTaken = profile->count[pc] - profile->taken[pc];
+		found[n].instructions = 0;
+		for (i = target; i <= pc; i++)
+			found[n].instructions += profile->count[i];
+		n++;
+	}
+	qsort(found, n, sizeof(loop_t), byInstructions);
+	*loops = found;
+	return n;
+}
+
+static void writeString(FILE* outFile, char* s) {
+	fputc('"', outFile);
+	for (; s != NULL && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', outFile);
+		fputc(*s, outFile);
+	}
+	fputc('"', outFile);
+}
+
+static void writeHeat(FILE* outFile, char* name, long long* counts) {
+	int addr, first = 1;
+
+	fprintf(outFile, "  \"%s\": [", name);
+	for (addr = 0; addr < MAX_MEMORY_SIZE; addr++) {
+		if (counts[addr] == 0)
+			continue;
+		fprintf(outFile, "%s\n    {\"addr\": %d, \"count\": %lld}", first ? "" : ",", addr, counts[addr]);
+		first = 0;
+	}
+	fprintf(outFile, "\n  ],\n");
+}
+
+int profile_write_json(profile_t* profile, iss_t* iss, char* filename) {
+	FILE* outFile;
+	loop_t* loops;
+	Instruction inst;
+	long long instructions = total(profile);
+	int nloops, pc, op, i, first;
+
+	nloops = findLoops(profile, &loops);
+	if (nloops < 0)
+		return -1;
+	outFile = fopen(filename, "w");
+	if (outFile == NULL) {
+		free(loops);
+		return -1;
+	}
+
+	fprintf(outFile, "{\n  \"program\": ");
+	writeString(outFile, iss->name);
+	fprintf(outFile, ",\n  \"instructions\": %lld,\n", instructions);
+
+	fprintf(outFile, "  \"pcs\": [");
+	first = 1;
+	for (pc = 0; pc < MAX_MEMORY_SIZE; pc++) {
+		if (profile->count[pc] == 0)
+			continue;
+		inst = fetch(profile->inst[pc]);
+		fprintf(outFile, "%s\n    {\"pc\": %d, \"inst\": \"%08x\", \"opcode\": \"%s\", \"count\": %lld",
+			first ? "" : ",", pc, profile->inst[pc], opcodeName(inst.opcode), profile->count[pc]);
+		if (inst.opcode >= JLT && inst.opcode <= JIN)
+			fprintf(outFile, ", \"taken\": %lld, \"not_taken\": %lld",
+				profile->taken[pc], profile->count[pc] - profile->taken[pc]);
+		fprintf(outFile, "}");
+		first = 0;
+	}
+	fprintf(outFile, "\n  ],\n");
+
+	fprintf(outFile, "  \"opcodes\": {");
+	first = 1;
+	for (op = 0; op < 32; op++) {
+		if (profile->opcodes[op] == 0)
+			continue;
+		fprintf(outFile, "%s\n    \"%s\": %lld", first ? "" : ",", opcodeName(op), profile->opcodes[op]);
+		first = 0;
+	}
+	fprintf(outFile, "\n  },\n");
+
+	writeHeat(outFile, "loads", profile->loads);
+	writeHeat(outFile, "stores", profile->stores);
+
+	fprintf(outFile, "  \"loops\": [");
+	for (i = 0; i < nloops; i++) {
+		fprintf(outFile, "%s\n    {\"head\": %d, \"tail\": %d, \"iterations\": %lld, \"not_taken\": %lld, "
+			"\"instructions\": %lld, \"share\": %.4f}",
+			i == 0 ? "" : ",", loops[i].head, loops[i].tail, loops[i].iterations, loops[i].notTaken,
+			loops[i].instructions, instructions ? (double) loops[i].instructions / instructions : 0.0);
+	}
+	fprintf(outFile, "\n  ]\n}\n");
+
+	free(loops);
+	return fclose(outFile) == 0 ? 0 : -1;
+}
+
+int profile_write_folded(profile_t* profile, iss_t* iss, char* filename) {
+	FILE* outFile;
+	loop_t* loops;
+	char* name;
+	int nloops, pc, i;
+
+	nloops = findLoops(profile, &loops);
+	if (nloops < 0)
+		return -1;
+	outFile = fopen(filename, "w");
+	if (outFile == NULL) {
+		free(loops);
+		return -1;
+	}
+	qsort(loops, nloops, sizeof(loop_t), bySpan);
+	name = strrchr(iss->name, '/') ? strrchr(iss->name, '/') + 1 : iss->name;
+
+	for (pc = 0; pc < MAX_MEMORY_SIZE; pc++) {
+		if (profile->count[pc] == 0)
+			continue;
+		fprintf(outFile, "%s", name);
+		for (i = 0; i < nloops; i++)
+			if (loops[i].head <= pc && pc <= loops[i].tail)
+				fprintf(outFile, ";loop_%04x_%04x", loops[i].head, loops[i].tail);
+		fprintf(outFile, ";%04x_%s %lld\n", pc, opcodeName((profile->inst[pc] >> 25) & 0x1f), profile->count[pc]);
+	}
+
+	free(loops);
+	return fclose(outFile) == 0 ? 0 : -1;
+}
@@ -0,0 +1,42 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include "iss.h"
+
+/*
+ * Execution profile, filled in by iss_run() while iss->profile is set.
+ * Counts add up over runs, so a stopped and resumed run profiles as one.
+ */
+typedef struct profile_s {
+	long long count[MAX_MEMORY_SIZE];		// instructions executed per pc
+	unsigned int inst[MAX_MEMORY_SIZE];		// the word first executed at each pc
+	long long taken[MAX_MEMORY_SIZE];		// taken jumps per pc
+	long long loads[MAX_MEMORY_SIZE];		// LD per address
+	long long stores[MAX_MEMORY_SIZE];		// ST per address
+	long long opcodes[32];					// instructions executed per opcode
+} profile_t;
+
+profile_t* profile_create(void);
+void profile_destroy(profile_t* profile);
+
+/*
+ * The reports name each pc by the word it first executed, so code that
+ * stores over itself keeps what ran, and take only the program name from
+ * iss. Hot loops are the spans closed by a taken conditional jump back to
+ * a lower pc, JIN targets are not followed.
+ */
+
+/*
+ * Writes per pc counts, the opcode histogram, LD/ST address counts and the
+ * hot loops as JSON. Returns 0 or -1.
+ */
+int profile_write_json(profile_t* profile, iss_t* iss, char* filename);
+
+/*
+ * Writes one "program;loop;...;instruction count" line per executed pc,
+ * nesting each pc under the hot loops around it, for flame graph tools.
+ * Returns 0 or -1.
+ */
+int profile_write_folded(profile_t* profile, iss_t* iss, char* filename);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <immintrin.h>
+
+#include "simd.h"
+#include "image.h"
+
+// One lane per element, at the widths AVX-512, AVX2 and plain x86-64 have
+typedef int vint16 __attribute__((vector_size(16 * sizeof(int))));
+typedef int vint8 __attribute__((vector_size(8 * sizeof(int))));
+typedef int vint4 __attribute__((vector_size(4 * sizeof(int))));
+
+#if SIMD_LANES != 16
+#error "the kernels and copyPage() assume 16 lanes"
+#endif
+
+#define SIMD_WORDS	(MAX_MEMORY_SIZE * SIMD_LANES)
+
+simd_t* simd_create(void) {
+	simd_t* simd;
+
+	// the register vectors need 64 byte alignment, more than calloc() gives
+	simd = aligned_alloc(64, sizeof(simd_t));
+	if (simd == NULL)
+		return NULL;
+	memset(simd, 0, sizeof(simd_t));
+	simd->mem = image_alloc(SIMD_WORDS);
+	if (simd->mem == NULL) {
+		free(simd);
+		return NULL;
+	}
+	return simd;
+}
+
+void simd_destroy(simd_t* simd) {
+	image_free(simd->mem, SIMD_WORDS);
+	free(simd);
+}
+
+static void copyPage(simd_t* simd, iss_t* from, int page) {
+	vint16* to = (vint16*) simd->mem;
+	vint16 zero = { 0 };
+	int addr;
+
+	for (addr = page * PAGE_WORDS; addr < (page + 1) * PAGE_WORDS; addr++)
+		to[addr] = zero + (int) from->mem[addr];
+}
+
+void simd_copy_program(simd_t* simd, iss_t* from, int lanes) {
+	int page, lane, i;
+
+	if (simd->program != from) {
+		// Fresh zero pages, then only the pages the program uses
+		image_free(simd->mem, SIMD_WORDS);
+		simd->mem = image_alloc(SIMD_WORDS);
+		if (simd->mem == NULL) {
+			printf("Out of memory, exit\n");
+			exit(1);
+		}
+		for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++) {
+			for (i = 0; i < PAGE_WORDS && from->mem[page * PAGE_WORDS + i] == 0; i++)
+				;
+			if (i < PAGE_WORDS)
+				copyPage(simd, from, page);
+		}
+		memset(simd->dirty, 0, sizeof(simd->dirty));
+		memset(simd->mixed, 0, sizeof(simd->mixed));
+		simd->program = from;
+	} else {
+		for (page = 0; page < MAX_MEMORY_SIZE / PAGE_WORDS; page++) {
+			// Rows that differ between lanes only ever sit on dirty pages
+			if (simd->dirty[page]) {
+				copyPage(simd, from, page);
+				memset(simd->mixed + page * PAGE_WORDS, 0, PAGE_WORDS);
+				simd->dirty[page] = 0;
+			}
+		}
+	}
+
+	memset(simd->regs, 0, sizeof(simd->regs));
+	simd->lanes = lanes;
+	for (lane = 0; lane < SIMD_LANES; lane++) {
+		simd->pc[lane] = from->pc;
+		simd->instCount[lane] = 0;
+		simd->status[lane] = (lane < lanes) ? SIMD_RUNNING : ISS_HALTED;
+		simd->illegalOpcode[lane] = 0;
+	}
+}
+
+void simd_write(simd_t* simd, int lane, unsigned short addr, unsigned int value) {
+	simd->mem[addr * SIMD_LANES + lane] = value;
+	simd->mixed[addr] = 1;
+	simd->dirty[addr / PAGE_WORDS] = 1;
+}
+
+unsigned int simd_read(simd_t* simd, int lane, unsigned short addr) {
+	return simd->mem[addr * SIMD_LANES + lane];
+}
+
+#define BLEND(mask, a, b)	(((a) & (mask)) | ((b) & ~(mask)))
+
+/*
+ * One kernel per vector width, see simd_run.h
+ */
+#define VL 16
+#define VINT vint16
+#define RUN_TARGET "avx512f"
+#define RUN_NAME run16
+#include "simd_run.h"
+#undef RUN_NAME
+#undef RUN_TARGET
+#undef VINT
+#undef VL
+
+#define VL 8
+#define VINT vint8
+#define RUN_TARGET "avx2"
+#define RUN_NAME run8
+#include "simd_run.h"
+#undef RUN_NAME
+#undef RUN_TARGET
+#undef VINT
+#undef VL
+
+#define VL 4
+#define VINT vint4
+#define RUN_TARGET "sse2"
+#define RUN_NAME run4
+#include "simd_run.h"
+#undef RUN_NAME
+#undef RUN_TARGET
+#undef VINT
+#undef VL
+
+void simd_run(simd_t* simd) {
+	int base;
+
+	if (__builtin_cpu_supports("avx512f")) {
+		run16(simd, 0);
+	} else if (__builtin_cpu_supports("avx2")) {
+		for (base = 0; base < SIMD_LANES; base += 8)
+			run8(simd, base);
+	} else {
+		for (base = 0; base < SIMD_LANES; base += 4)
+			run4(simd, base);
+	}
+}
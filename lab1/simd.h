@@ -0,0 +1,47 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include "iss.h"
+
+/*
+ * Lockstep ISS: runs one program on SIMD_LANES data sets at once, with a
+ * register file, pc and memory per lane stored as struct of arrays. Every
+ * step executes one instruction for all lanes that are at the lowest pc
+ * (and hold the same word there); the other lanes are masked off until
+ * they meet again. Results match iss_run() at TRACE_NONE lane by lane.
+ */
+#define SIMD_LANES		16
+
+#define SIMD_RUNNING	-1	// lane status besides ISS_HALTED and ISS_ILLEGAL
+
+typedef struct {
+	int regs[REG_COUNT][SIMD_LANES] __attribute__((aligned(64)));
+	int pc[SIMD_LANES] __attribute__((aligned(64)));
+	long long instCount[SIMD_LANES];
+	int status[SIMD_LANES];
+	int illegalOpcode[SIMD_LANES];
+	unsigned int* mem;			// word addr of lane l at mem[addr * SIMD_LANES + l]
+	int lanes;					// lanes in use, the rest stay halted
+	iss_t* program;				// context last copied by simd_copy_program()
+	unsigned char dirty[MAX_MEMORY_SIZE / PAGE_WORDS];
+	unsigned char mixed[MAX_MEMORY_SIZE];	// words that may differ between lanes
+} simd_t;
+
+simd_t* simd_create(void);
+void simd_destroy(simd_t* simd);
+
+/*
+ * Resets lanes 0 .. lanes - 1 to run the program loaded into from, with
+ * the same page reuse as iss_copy_program().
+ */
+void simd_copy_program(simd_t* simd, iss_t* from, int lanes);
+
+void simd_write(simd_t* simd, int lane, unsigned short addr, unsigned int value);
+unsigned int simd_read(simd_t* simd, int lane, unsigned short addr);
+
+/*
+ * Runs until every lane halted or hit an illegal opcode.
+ */
+void simd_run(simd_t* simd);
+
+#endif
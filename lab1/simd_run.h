@@ -0,0 +1,238 @@
+/*
+ * Lockstep kernel template, included once per vector width by simd.c with
+ * RUN_NAME, RUN_TARGET, VINT and VL (lanes per vector) defined. A kernel
+ * runs lanes base .. base + VL - 1, so narrower cpus cover the SIMD_LANES
+ * lanes in a few passes; memory and registers keep the SIMD_LANES stride.
+ *
+ * Lanes are masked with all ones (active) or zero. Counts are kept 32 bit
+ * wide in the loop and folded into instCount every 2^30 steps.
+ *
+ * While all running lanes share one pc the kernel is converged: the pc is
+ * a scalar, the pc vector is left stale, and the checks that could split
+ * the lanes (a word that differs between lanes, a jump taken by some of
+ * them) only feed predicted branches. The word is only compared on rows
+ * simd_write() or an ST touched. Once split, every step picks the lowest
+ * pc again until the lanes meet.
+ */
+#if VL == 16
+#define IOTA	((VINT) { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 })
+#elif VL == 8
+#define IOTA	((VINT) { 0, 1, 2, 3, 4, 5, 6, 7 })
+#else
+#define IOTA	((VINT) { 0, 1, 2, 3 })
+#endif
+
+// One butterfly step: every lane meets the lane k away
+#define FOLD(r, k, op)											\
+	do {														\
+		VINT s_ = __builtin_shuffle(r, IOTA ^ (k));				\
+		r = BLEND(s_ op r, s_, r);								\
+	} while (0)
+
+// Folds all lanes with shuffles, no lane is touched one by one
+#define REDUCE(x, op) ({										\
+	VINT r_ = (x);												\
+	if (VL > 8)													\
+		FOLD(r_, 8, op);										\
+	if (VL > 4)													\
+		FOLD(r_, 4, op);										\
+	FOLD(r_, 2, op);											\
+	FOLD(r_, 1, op);											\
+	r_[0]; })
+
+// True if any lane of the mask is set
+#if VL == 16
+#define ANY(x)	(_mm512_test_epi32_mask((__m512i) (x), (__m512i) (x)) != 0)
+#elif VL == 8
+#define ANY(x)	(!_mm256_testz_si256((__m256i) (x), (__m256i) (x)))
+#else
+#define ANY(x)	(_mm_movemask_epi8((__m128i) (x)) != 0)
+#endif
+
+#define ROW(addr)	(*(VINT*) &mem[(addr) * SIMD_LANES + base])
+#define REG(r)		(*(VINT*) &simd->regs[r][base])
+
+// Leave the converged mode: running lanes get the scalar pc back
+#define SPLIT()													\
+	do {														\
+		converged = 0;											\
+		pc = BLEND(running, zero + upc, pc);					\
+		next = (pc + 1) & 0xffff;								\
+	} while (0)
+
+__attribute__((target(RUN_TARGET)))
+static void RUN_NAME(simd_t* simd, int base) {
+	unsigned int* mem = simd->mem;
+	unsigned char* mixed = simd->mixed;
+	VINT pc = *(VINT*) &simd->pc[base];
+	VINT running, illegal, count;
+	VINT zero = { 0 };
+	VINT m, words, imm, val0, val1, res, taken, next, link;
+	VINT lm, la, lv;	// copies for lane by lane access, the rest stay in registers
+	int opcode, dst, src0, src1, immediate;
+	unsigned int word;
+	int minPc, target;
+	int converged = 0, upc = 0, first = 0;
+	int steps = 0;
+	int addr, l;
+
+	for (l = 0; l < VL; l++)
+		lm[l] = (simd->status[base + l] == SIMD_RUNNING) ? -1 : 0;
+	running = lm;
+	illegal = zero;
+	count = zero;
+	res = zero;
+
+	for (;;) {
+		if (converged) {
+			m = running;
+			words = ROW(upc);
+			word = mem[upc * SIMD_LANES + base + first];
+			if (mixed[upc] && ANY(m & (words != (int) word))) {
+				SPLIT();
+				continue;
+			}
+		} else {
+			// Reconverge on the lowest pc any running lane is at
+			minPc = REDUCE(BLEND(running, pc, zero + MAX_MEMORY_SIZE), <);
+			if (minPc == MAX_MEMORY_SIZE)
+				break;
+			// Lanes there that hold another word (self modifying code) wait a step
+			m = running & (pc == minPc);
+			words = ROW(minPc);
+			word = REDUCE(BLEND(m, words, zero + INT_MIN), >);
+			m &= words == (int) word;
+			next = (pc + 1) & 0xffff;
+			if (!ANY(running & ~m)) {
+				converged = 1;
+				upc = minPc;
+				lm = m;
+				for (first = 0; !lm[first]; first++)
+					;
+			}
+		}
+
+		// The fields of fetch(), kept in registers rather than a bit field struct
+		opcode = (word >> 25) & 0x1f;
+		dst = (word >> 22) & 0x7;
+		src0 = (word >> 19) & 0x7;
+		src1 = (word >> 16) & 0x7;
+		immediate = (short) word;
+		imm = zero + immediate;
+		val0 = (src0 == 1 || opcode == LHI) ? imm : REG(src0);
+		val1 = (src1 == 1) ? imm : REG(src1);
+
+		switch (opcode) {
+		case ADD:	res = val0 + val1;	break;
+		case SUB:	res = val0 - val1;	break;
+		// x86 shifts use the low 5 bits of the count, like the scalar iss
+		case LSF:	res = val0 << (val1 & 31);	break;
+		case RSF:	res = val0 >> (val1 & 31);	break;
+		case AND:	res = val0 & val1;	break;
+		case OR:	res = val0 | val1;	break;
+		case XOR:	res = val0 ^ val1;	break;
+		case LHI:	res = (val0 << 16) | (REG(dst) & 0xffff);	break;
+		case LD:
+			lm = m;
+			la = val1;
+			lv = zero;
+			for (l = 0; l < VL; l++)
+				if (lm[l])
+					lv[l] = mem[(la[l] & 0xffff) * SIMD_LANES + base + l];
+			res = lv;
+			break;
+		case ST:
+			lm = m;
+			la = val1;
+			lv = val0;
+			for (l = 0; l < VL; l++) {
+				if (lm[l]) {
+					addr = la[l] & 0xffff;
+					mem[addr * SIMD_LANES + base + l] = lv[l];
+					mixed[addr] = 1;
+					simd->dirty[addr / PAGE_WORDS] = 1;
+				}
+			}
+			break;
+		case JLT:
+		case JLE:
+		case JEQ:
+		case JNE:
+		case JIN:
+			if (opcode == JLT)
+				taken = m & (val0 < val1);
+			else if (opcode == JLE)
+				taken = m & (val0 <= val1);
+			else if (opcode == JEQ)
+				taken = m & (val0 == val1);
+			else if (opcode == JNE)
+				taken = m & (val0 != val1);
+			else
+				taken = m;
+			if (converged) {
+				if (!ANY(taken))
+					break;
+				lv = val0;
+				target = (opcode == JIN ? lv[first] : immediate) & 0xffff;
+				if (!ANY(m & ~taken) && (opcode != JIN || !ANY(m & ((val0 & 0xffff) != target)))) {
+					REG(7) = BLEND(taken, zero + ((upc + 1) & 0xffff) - 1, REG(7));
+					upc = target - 1;
+					break;
+				}
+				SPLIT();
+			}
+			// R7 gets the pc after the 16 bit increment, minus one
+			link = next - 1;
+			REG(7) = BLEND(taken, link, REG(7));
+			next = BLEND(taken, (opcode == JIN ? val0 : imm) & 0xffff, next);
+			break;
+		case HLT:
+			if (converged)
+				SPLIT();
+			running &= ~m;
+			break;
+		default:
+			if (converged)
+				SPLIT();
+			illegal |= m;
+			running &= ~m;
+			lm = m;
+			for (l = 0; l < VL; l++)
+				if (lm[l])
+					simd->illegalOpcode[base + l] = opcode;
+			continue;
+		}
+
+		if (dst > 1 && opcode <= LD)
+			REG(dst) = BLEND(m, res, REG(dst));
+		if (converged)
+			upc = (upc + 1) & 0xffff;
+		else
+			pc = BLEND(m, next, pc);
+		count -= m;
+		if (++steps == 1 << 30) {
+			lv = count;
+			for (l = 0; l < VL; l++)
+				simd->instCount[base + l] += lv[l];
+			count = zero;
+			steps = 0;
+		}
+	}
+
+#undef IOTA
+#undef FOLD
+#undef REDUCE
+#undef ANY
+#undef ROW
+#undef REG
+#undef SPLIT
+
+	*(VINT*) &simd->pc[base] = pc;
+	lv = count;
+	lm = illegal;
+	for (l = 0; l < VL; l++) {
+		simd->instCount[base + l] += lv[l];
+		if (simd->status[base + l] == SIMD_RUNNING)
+			simd->status[base + l] = lm[l] ? ISS_ILLEGAL : ISS_HALTED;
+	}
+}
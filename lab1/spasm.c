@@ -0,0 +1,1071 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "spasm.h"
+
+#define SYMBOLS_INITIAL	1024
+#define SCHEDULE_WINDOW	32		// instructions reordered at a time
+
+#define ADD	0
+#define SUB	1
+#define LSF	2
+#define RSF	3
+#define AND	4
+#define OR	5
+#define XOR	6
+#define LHI	7
+#define LD	8
+#define ST	9
+#define DMA	10
+#define DMP	11
+#define JLT	16
+#define JLE	17
+#define JEQ	18
+#define JNE	19
+#define JIN	20
+#define HLT	24
+
+// Operand layouts, see spasm.h
+enum {
+	FORM_ALU,
+	FORM_LHI,
+	FORM_LD,
+	FORM_ST,
+	FORM_JUMP,
+	FORM_JIN,
+	FORM_DMA,
+	FORM_TARGET,
+	FORM_NONE,
+	FORM_MOV,
+};
+
+typedef struct {
+	char *name;
+	int opcode;
+	int form;
+	int operands;
+	char *usage;
+} mnemonic_t;
+
+static const mnemonic_t mnemonics[] = {
+	{ "add", ADD, FORM_ALU, 3, "add dst, src0, src1" },
+	{ "sub", SUB, FORM_ALU, 3, "sub dst, src0, src1" },
+	{ "lsf", LSF, FORM_ALU, 3, "lsf dst, src0, src1" },
+	{ "rsf", RSF, FORM_ALU, 3, "rsf dst, src0, src1" },
+	{ "and", AND, FORM_ALU, 3, "and dst, src0, src1" },
+	{ "or", OR, FORM_ALU, 3, "or dst, src0, src1" },
+	{ "xor", XOR, FORM_ALU, 3, "xor dst, src0, src1" },
+	{ "lhi", LHI, FORM_LHI, 2, "lhi dst, value" },
+	{ "ld", LD, FORM_LD, 2, "ld dst, address" },
+	{ "st", ST, FORM_ST, 2, "st src, address" },
+	{ "dma", DMA, FORM_DMA, 3, "dma dst, src, length" },
+	{ "dmp", DMP, FORM_TARGET, 1, "dmp target" },
+	{ "jlt", JLT, FORM_JUMP, 3, "jlt src0, src1, target" },
+	{ "jle", JLE, FORM_JUMP, 3, "jle src0, src1, target" },
+	{ "jeq", JEQ, FORM_JUMP, 3, "jeq src0, src1, target" },
+	{ "jne", JNE, FORM_JUMP, 3, "jne src0, src1, target" },
+	{ "jin", JIN, FORM_JIN, 1, "jin src" },
+	{ "hlt", HLT, FORM_NONE, 0, "hlt" },
+	// pseudo instructions, no four operand form
+	{ "nop", ADD, FORM_NONE, 0, "nop" },
+	{ "mov", ADD, FORM_MOV, 2, "mov dst, src" },
+	{ "jmp", JEQ, FORM_TARGET, 1, "jmp target" },
+};
+#define PSEUDO_FIRST 18
+
+typedef struct {
+	const char *p;
+	const char *end;
+} text_t;
+
+typedef struct {
+	text_t text;
+	int reg;			// register number, -1 for a value
+} operand_t;
+
+typedef struct {
+	const char *name;	// points into the source
+	int length;
+	long long value;
+} symbol_t;
+
+// What pass 1 found at an address, for SPASM_SCHEDULE
+typedef struct {
+	unsigned char opcode;
+	unsigned char dst;
+	unsigned char src0;
+	unsigned char src1;
+	unsigned char flags;
+} insn_t;
+
+#define INSN_CODE	1	// an instruction rather than data
+#define INSN_LABEL	2	// a label points here
+#define INSN_PINNED	4	// uses '.', stays where it is
+
+typedef struct {
+	char *name;
+	int line;
+	int pass;
+	int unknown;		// pass 1 expression used a symbol defined further down
+	long long here;		// '.', address of the statement
+	int pc;
+	int size;
+	int entry;
+	unsigned int *mem;
+	unsigned char *used;
+	int words;
+	symbol_t *symbols;	// open addressing, name NULL when free
+	int capacity;
+	int count;
+	insn_t *insns;		// per address, with SPASM_SCHEDULE
+	int *slot;			// per address, where pass 2 puts the word
+	text_t *retarget;	// per line, the target a conditional jump takes over from the jmp after it
+	unsigned char *skip;	// per line, a jmp folded into the jump before it
+	spasm_result_t *result;
+} assembler_t;
+
+static int fail(assembler_t *as, const char *format, ...) {
+	va_list args;
+	int n;
+
+	n = snprintf(as->result->error, SPASM_ERROR_SIZE, "%s:%d: ", as->name, as->line);
+	va_start(args, format);
+	vsnprintf(as->result->error + n, SPASM_ERROR_SIZE - n, format, args);
+	va_end(args);
+	as->result->line = as->line;
+	return -2;
+}
+
+static int isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static void skipSpace(text_t *t) {
+	while (t->p < t->end && isSpace(*t->p))
+		t->p++;
+}
+
+static int atEnd(text_t *t) {
+	skipSpace(t);
+	return t->p == t->end;
+}
+
+static int isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static int isIdentStart(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+}
+
+static int isIdent(char c) {
+	return isIdentStart(c) || isDigit(c);
+}
+
+static text_t readIdent(text_t *t) {
+	text_t ident = { t->p, t->p };
+
+	while (ident.end < t->end && isIdent(*ident.end))
+		ident.end++;
+	t->p = ident.end;
+	return ident;
+}
+
+static int matches(text_t *t, const char *word) {
+	int n = t->end - t->p;
+
+	return (int) strlen(word) == n && strncasecmp(t->p, word, n) == 0;
+}
+
+// r0..r7, optionally written $r0, or -1
+static int registerNumber(text_t t) {
+	if (t.p < t.end && *t.p == '$')
+		t.p++;
+	if (t.end - t.p != 2 || (t.p[0] != 'r' && t.p[0] != 'R') || t.p[1] < '0' || t.p[1] > '7')
+		return -1;
+	return t.p[1] - '0';
+}
+
+static unsigned int hash(const char *name, int length) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < length; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	return h;
+}
+
+static symbol_t *findSlot(symbol_t *symbols, int capacity, const char *name, int length) {
+	unsigned int i = hash(name, length) & (capacity - 1);
+
+	while (symbols[i].name != NULL &&
+		(symbols[i].length != length || memcmp(symbols[i].name, name, length) != 0))
+		i = (i + 1) & (capacity - 1);
+	return &symbols[i];
+}
+
+static symbol_t *lookup(assembler_t *as, text_t name) {
+	symbol_t *symbol = findSlot(as->symbols, as->capacity, name.p, name.end - name.p);
+
+	return symbol->name ? symbol : NULL;
+}
+
+static int define(assembler_t *as, text_t name, long long value) {
+	symbol_t *symbols, *symbol;
+	int i;
+
+	// values don't change between passes, so pass 2 only reads them
+	if (as->pass == 2)
+		return 0;
+	if (registerNumber(name) >= 0)
+		return fail(as, "%.*s is a register", (int) (name.end - name.p), name.p);
+	if (lookup(as, name) != NULL)
+		return fail(as, "%.*s is already defined", (int) (name.end - name.p), name.p);
+	if (2 * (as->count + 1) > as->capacity) {
+		symbols = calloc(2 * as->capacity, sizeof(symbol_t));
+		if (symbols == NULL)
+			return fail(as, "out of memory");
+		for (i = 0; i < as->capacity; i++)
+			if (as->symbols[i].name != NULL)
+				*findSlot(symbols, 2 * as->capacity, as->symbols[i].name, as->symbols[i].length) = as->symbols[i];
+		free(as->symbols);
+		as->symbols = symbols;
+		as->capacity *= 2;
+	}
+	symbol = findSlot(as->symbols, as->capacity, name.p, name.end - name.p);
+	symbol->name = name.p;
+	symbol->length = name.end - name.p;
+	symbol->value = value;
+	as->count++;
+	return 0;
+}
+
+static int evaluate(assembler_t *as, text_t *t, int minLevel, long long *value);
+
+static int number(assembler_t *as, text_t *t, long long *value) {
+	unsigned long long n = 0;
+	int base = 10, digit, digits = 0;
+
+	if (t->end - t->p > 2 && t->p[0] == '0' && (t->p[1] == 'x' || t->p[1] == 'X')) {
+		base = 16;
+		t->p += 2;
+	} else if (t->end - t->p > 2 && t->p[0] == '0' && (t->p[1] == 'b' || t->p[1] == 'B')) {
+		base = 2;
+		t->p += 2;
+	}
+	for (; t->p < t->end && (isIdent(*t->p) && *t->p != '.' && *t->p != '_'); t->p++, digits++) {
+		digit = isDigit(*t->p) ? *t->p - '0' : (*t->p | 0x20) - 'a' + 10;
+		if (digit >= base)
+			return fail(as, "bad digit '%c' in number", *t->p);
+		n = n * base + digit;
+		if (n > 0xffffffffull)
+			return fail(as, "number too large");
+	}
+	if (digits == 0)
+		return fail(as, "number has no digits");
+	*value = n;
+	return 0;
+}
+
+// Unary operators and operands
+static int primary(assembler_t *as, text_t *t, long long *value) {
+	symbol_t *symbol;
+	text_t ident;
+	char c;
+
+	skipSpace(t);
+	if (t->p == t->end)
+		return fail(as, "value expected");
+	c = *t->p;
+	if (c == '-' || c == '~' || c == '+') {
+		t->p++;
+		if (primary(as, t, value) != 0)
+			return -2;
+		*value = c == '-' ? -*value : c == '~' ? ~*value : *value;
+		return 0;
+	}
+	if (c == '(') {
+		t->p++;
+		if (evaluate(as, t, 0, value) != 0)
+			return -2;
+		skipSpace(t);
+		if (t->p == t->end || *t->p != ')')
+			return fail(as, "')' expected");
+		t->p++;
+		return 0;
+	}
+	if (isDigit(c))
+		return number(as, t, value);
+	if (c == '\'') {
+		if (t->end - t->p < 3 || t->p[2] != '\'')
+			return fail(as, "bad character literal");
+		*value = (unsigned char) t->p[1];
+		t->p += 3;
+		return 0;
+	}
+	if (c == '.' && (t->p + 1 == t->end || !isIdent(t->p[1]))) {
+		t->p++;
+		*value = as->here;
+		return 0;
+	}
+	if (!isIdentStart(c))
+		return fail(as, "unexpected '%c'", c);
+	ident = readIdent(t);
+	if (registerNumber(ident) >= 0)
+		return fail(as, "register %.*s where a value is expected", (int) (ident.end - ident.p), ident.p);
+	symbol = lookup(as, ident);
+	if (symbol != NULL) {
+		*value = symbol->value;
+	} else if (as->pass == 1) {
+		as->unknown = 1;
+		*value = 0;
+	} else {
+		return fail(as, "undefined symbol %.*s", (int) (ident.end - ident.p), ident.p);
+	}
+	return 0;
+}
+
+// Binary operator at t with its C precedence in *level, or 0
+static int binaryOperator(text_t *t, int *level, int *length) {
+	char c = t->p < t->end ? t->p[0] : 0;
+	char next = t->p + 1 < t->end ? t->p[1] : 0;
+
+	*length = 1;
+	switch (c) {
+	case '|':	*level = 1; return c;
+	case '^':	*level = 2; return c;
+	case '&':	*level = 3; return c;
+	case '<':
+	case '>':
+		*length = 2;
+		*level = 4;
+		return next == c ? c : 0;
+	case '+':
+	case '-':	*level = 5; return c;
+	case '*':
+	case '/':
+	case '%':	*level = 6; return c;
+	}
+	return 0;
+}
+
+// Precedence climbing over operators of minLevel and up
+static int evaluate(assembler_t *as, text_t *t, int minLevel, long long *value) {
+	long long rhs;
+	int op, level, length;
+
+	if (primary(as, t, value) != 0)
+		return -2;
+	for (;;) {
+		skipSpace(t);
+		op = binaryOperator(t, &level, &length);
+		if (op == 0 || level < minLevel)
+			return 0;
+		t->p += length;
+		if (evaluate(as, t, level + 1, &rhs) != 0)
+			return -2;
+		if ((op == '/' || op == '%') && rhs == 0) {
+			if (!as->unknown)
+				return fail(as, "division by zero");
+			rhs = 1;
+		}
+		if ((op == '<' || op == '>') && (rhs < 0 || rhs > 63)) {
+			if (!as->unknown)
+				return fail(as, "shift by %lld", rhs);
+			rhs = 0;
+		}
+		switch (op) {
+		case '|':	*value |= rhs; break;
+		case '^':	*value ^= rhs; break;
+		case '&':	*value &= rhs; break;
+		case '<':	*value = (long long) ((unsigned long long) *value << rhs); break;
+		case '>':	*value >>= rhs; break;
+		case '+':	*value += rhs; break;
+		case '-':	*value -= rhs; break;
+		case '*':	*value *= rhs; break;
+		case '/':	*value /= rhs; break;
+		case '%':	*value %= rhs; break;
+		}
+	}
+}
+
+/*
+ * The whole of t as one value. With known set the value must not depend on
+ * symbols defined further down, which pass 1 needs for layout.
+ */
+static int value(assembler_t *as, text_t t, int known, long long *value) {
+	as->unknown = 0;
+	if (evaluate(as, &t, 0, value) != 0)
+		return -2;
+	if (!atEnd(&t))
+		return fail(as, "unexpected '%c'", *t.p);
+	if (known && as->unknown)
+		return fail(as, "value uses a symbol defined further down");
+	return 0;
+}
+
+// Next comma separated operand of rest, 0 when there are none left
+static int nextOperand(text_t *rest, text_t *operand) {
+	int depth = 0;
+
+	skipSpace(rest);
+	if (rest->p == rest->end)
+		return 0;
+	operand->p = rest->p;
+	for (; rest->p < rest->end; rest->p++) {
+		if (*rest->p == '\'' && rest->end - rest->p >= 3 && rest->p[2] == '\'')
+			rest->p += 2;
+		else if (*rest->p == '(')
+			depth++;
+		else if (*rest->p == ')')
+			depth--;
+		else if (*rest->p == ',' && depth == 0)
+			break;
+	}
+	operand->end = rest->p;
+	while (operand->end > operand->p && isSpace(operand->end[-1]))
+		operand->end--;
+	if (rest->p < rest->end)
+		rest->p++;
+	// "a," leaves an empty operand behind
+	if (operand->p == operand->end)
+		operand->end = operand->p = rest->p - 1;
+	return 1;
+}
+
+static int emit(assembler_t *as, unsigned int word) {
+	if (as->pc >= as->words)
+		return fail(as, "program does not fit in %d words", as->words);
+	if (as->pass == 2) {
+		if (as->used[as->pc])
+			return fail(as, "address %d is assembled twice", as->pc);
+		as->used[as->pc] = 1;
+		as->mem[as->slot ? as->slot[as->pc] : as->pc] = word;
+	}
+	as->pc++;
+	if (as->pc > as->size)
+		as->size = as->pc;
+	return 0;
+}
+
+// Whether t refers to '.', rather than holding dots in names
+static int usesDot(text_t t) {
+	const char *p;
+
+	for (p = t.p; p < t.end; p++)
+		if (*p == '.' && (p == t.p || !isIdent(p[-1])) && (p + 1 == t.end || !isIdent(p[1])))
+			return 1;
+	return 0;
+}
+
+// The jump taken exactly when m isn't, its operands swapped for jlt and jle
+static const mnemonic_t *inverse(const mnemonic_t *m) {
+	int opcode = m->opcode == JLT ? JLE : m->opcode == JLE ? JLT : m->opcode == JEQ ? JNE : JEQ;
+	int i;
+
+	for (i = 0; mnemonics[i].opcode != opcode || mnemonics[i].form != FORM_JUMP; i++)
+		;
+	return &mnemonics[i];
+}
+
+// A register operand goes into its field, a value into r1 and the immediate
+static int place(assembler_t *as, operand_t *op, int *field, operand_t **imm) {
+	if (op->reg >= 0) {
+		*field = op->reg;
+		return 0;
+	}
+	if (*imm != NULL)
+		return fail(as, "only one operand can be a value, they all go through r1");
+	*field = 1;
+	*imm = op;
+	return 0;
+}
+
+static int reg(assembler_t *as, operand_t *op, int *field) {
+	if (op->reg < 0)
+		return fail(as, "register expected, not %.*s", (int) (op->text.end - op->text.p), op->text.p);
+	*field = op->reg;
+	return 0;
+}
+
+static int instruction(assembler_t *as, const mnemonic_t *m, text_t *rest) {
+	operand_t ops[5], swap, *imm = NULL;
+	long long immediate = 0;
+	int n = 0, dst = 0, src0 = 0, src1 = 0, err = 0;
+
+	while (n < 5 && nextOperand(rest, &ops[n].text)) {
+		ops[n].reg = registerNumber(ops[n].text);
+		n++;
+	}
+	// the jmp after this jump was folded into it, see invertJumps()
+	if (as->retarget != NULL && as->retarget[as->line].p != NULL) {
+		m = inverse(m);
+		if (m->opcode == JLT || m->opcode == JLE) {
+			swap = ops[0];
+			ops[0] = ops[1];
+			ops[1] = swap;
+		}
+		ops[2].text = as->retarget[as->line];
+	}
+	if (n == 4 && m - mnemonics < PSEUDO_FIRST) {
+		err = reg(as, &ops[0], &dst) || reg(as, &ops[1], &src0) || reg(as, &ops[2], &src1);
+		imm = &ops[3];
+	} else if (n != m->operands) {
+		return fail(as, "expected \"%s\"", m->usage);
+	} else {
+		switch (m->form) {
+		case FORM_ALU:
+		case FORM_DMA:
+			err = reg(as, &ops[0], &dst) || place(as, &ops[1], &src0, &imm) || place(as, &ops[2], &src1, &imm);
+			break;
+		case FORM_LHI:
+			err = reg(as, &ops[0], &dst);
+			imm = &ops[1];
+			break;
+		case FORM_LD:
+			err = reg(as, &ops[0], &dst) || place(as, &ops[1], &src1, &imm);
+			break;
+		case FORM_ST:
+			err = place(as, &ops[0], &src0, &imm) || place(as, &ops[1], &src1, &imm);
+			break;
+		case FORM_JUMP:
+			imm = &ops[2];
+			err = place(as, &ops[0], &src0, &imm) || place(as, &ops[1], &src1, &imm);
+			break;
+		case FORM_JIN:
+			err = place(as, &ops[0], &src0, &imm);
+			break;
+		case FORM_TARGET:
+			imm = &ops[0];
+			break;
+		case FORM_MOV:
+			err = reg(as, &ops[0], &dst) || place(as, &ops[1], &src0, &imm);
+			break;
+		}
+	}
+	if (err)
+		return -2;
+	if (imm != NULL && imm->reg >= 0)
+		return fail(as, "value expected, not register %.*s", (int) (imm->text.end - imm->text.p), imm->text.p);
+	if (as->insns != NULL && as->pass == 1 && as->pc < as->words) {
+		as->insns[as->pc].opcode = m->opcode;
+		as->insns[as->pc].dst = dst;
+		as->insns[as->pc].src0 = src0;
+		as->insns[as->pc].src1 = src1;
+		as->insns[as->pc].flags |= INSN_CODE | (imm != NULL && usesDot(imm->text) ? INSN_PINNED : 0);
+	}
+	// pass 1 only lays out, the values may refer to labels further down
+	if (imm != NULL && as->pass == 2) {
+		if (value(as, imm->text, 0, &immediate) != 0)
+			return -2;
+		if (immediate < -32768 || immediate > 65535)
+			return fail(as, "%lld does not fit in 16 bits", immediate);
+	}
+	return emit(as, ((m->opcode & 0x1f) << 25) | ((dst & 7) << 22) | ((src0 & 7) << 19) | ((src1 & 7) << 16) |
+		(immediate & 0xffff));
+}
+
+static int setPc(assembler_t *as, long long pc) {
+	if (pc < 0 || pc > as->words)
+		return fail(as, "address %lld is outside the %d words of memory", pc, as->words);
+	as->pc = pc;
+	return 0;
+}
+
+// name = value and .equ, the value must be known in pass 1
+static int constant(assembler_t *as, text_t name, text_t t) {
+	long long n;
+
+	if (as->pass == 2)
+		return 0;
+	if (value(as, t, 1, &n) != 0)
+		return -2;
+	return define(as, name, n);
+}
+
+static int directive(assembler_t *as, text_t name, text_t *rest) {
+	text_t operand, ident;
+	long long n, fill = 0;
+
+	if (matches(&name, ".word")) {
+		if (!nextOperand(rest, &operand))
+			return fail(as, "expected \".word value, ...\"");
+		do {
+			n = 0;
+			if (as->pass == 2 && value(as, operand, 0, &n) != 0)
+				return -2;
+			if (n < -2147483648ll || n > 0xffffffffll)
+				return fail(as, "%lld does not fit in 32 bits", n);
+			if (emit(as, (unsigned int) n) != 0)
+				return -2;
+		} while (nextOperand(rest, &operand));
+		return 0;
+	}
+	if (matches(&name, ".space")) {
+		if (!nextOperand(rest, &operand))
+			return fail(as, "expected \".space count[, value]\"");
+		if (value(as, operand, 1, &n) != 0)
+			return -2;
+		if (nextOperand(rest, &operand) && value(as, operand, 0, &fill) != 0)
+			return -2;
+		if (!atEnd(rest))
+			return fail(as, "expected \".space count[, value]\"");
+		if (n < 0 || n > as->words)
+			return fail(as, "bad .space count %lld", n);
+		while (n-- > 0)
+			if (emit(as, (unsigned int) fill) != 0)
+				return -2;
+		return 0;
+	}
+	if (matches(&name, ".org")) {
+		if (!nextOperand(rest, &operand) || !atEnd(rest))
+			return fail(as, "expected \".org address\"");
+		if (value(as, operand, 1, &n) != 0)
+			return -2;
+		return setPc(as, n);
+	}
+	if (matches(&name, ".align")) {
+		if (!nextOperand(rest, &operand) || !atEnd(rest))
+			return fail(as, "expected \".align words\"");
+		if (value(as, operand, 1, &n) != 0)
+			return -2;
+		if (n <= 0 || n > as->words)
+			return fail(as, "bad .align %lld", n);
+		return setPc(as, (as->pc + n - 1) / n * n);
+	}
+	if (matches(&name, ".equ") || matches(&name, ".set")) {
+		skipSpace(rest);
+		ident = readIdent(rest);
+		skipSpace(rest);
+		if (ident.p == ident.end || rest->p == rest->end || *rest->p != ',')
+			return fail(as, "expected \".equ name, value\"");
+		rest->p++;
+		return constant(as, ident, *rest);
+	}
+	if (matches(&name, ".entry")) {
+		if (!nextOperand(rest, &operand) || !atEnd(rest))
+			return fail(as, "expected \".entry address\"");
+		if (as->pass == 1)
+			return 0;
+		if (value(as, operand, 0, &n) != 0)
+			return -2;
+		if (n < 0 || n >= as->words)
+			return fail(as, "entry %lld is outside the %d words of memory", n, as->words);
+		as->entry = n;
+		return 0;
+	}
+	return fail(as, "unknown directive %.*s", (int) (name.end - name.p), name.p);
+}
+
+// Line without its comment, quotes may hold comment characters
+static const char *stripComment(const char *p, const char *end) {
+	for (; p < end; p++) {
+		if (*p == '\'' && end - p >= 3 && p[2] == '\'')
+			p += 2;
+		else if (*p == '#' || *p == ';' || (*p == '/' && p + 1 < end && p[1] == '/'))
+			return p;
+	}
+	return end;
+}
+
+static int statement(assembler_t *as, text_t t) {
+	text_t ident;
+	char lower[4];
+	int i;
+
+	if (as->skip != NULL && as->skip[as->line])
+		return 0;
+	as->here = as->pc;
+	for (;;) {
+		skipSpace(&t);
+		if (t.p == t.end)
+			return 0;
+		if (!isIdentStart(*t.p))
+			return fail(as, "unexpected '%c'", *t.p);
+		ident = readIdent(&t);
+		skipSpace(&t);
+		if (t.p < t.end && *t.p == ':') {
+			t.p++;
+			if (define(as, ident, as->pc) != 0)
+				return -2;
+			if (as->insns != NULL && as->pc < as->words)
+				as->insns[as->pc].flags |= INSN_LABEL;
+			continue;
+		}
+		break;
+	}
+	if (t.p < t.end && *t.p == '=') {
+		t.p++;
+		return constant(as, ident, t);
+	}
+	if (*ident.p == '.')
+		return directive(as, ident, &t);
+	// mnemonics are 2 or 3 letters, compared in lower case
+	if (ident.end - ident.p <= 3) {
+		for (i = 0; i < ident.end - ident.p; i++)
+			lower[i] = ident.p[i] | 0x20;
+		lower[i] = 0;
+		for (i = 0; i < (int) (sizeof(mnemonics) / sizeof(mnemonics[0])); i++)
+			if (mnemonics[i].name[0] == lower[0] && strcmp(lower, mnemonics[i].name) == 0)
+				return instruction(as, &mnemonics[i], &t);
+	}
+	return fail(as, "unknown instruction %.*s", (int) (ident.end - ident.p), ident.p);
+}
+
+#define SCAN_LABELS 8
+
+// Syntax of a line, for invertJumps()
+typedef struct {
+	text_t labels[SCAN_LABELS];
+	int nlabels;		// those past SCAN_LABELS are counted but not kept
+	int content;		// anything after the labels
+	text_t mnemonic;
+	text_t ops[4];
+	int n;				// operands, 4 standing for 4 or more
+} line_t;
+
+static void scanLine(text_t t, line_t *line) {
+	text_t ident;
+
+	line->nlabels = line->content = line->n = 0;
+	line->mnemonic.p = line->mnemonic.end = NULL;
+	for (;;) {
+		skipSpace(&t);
+		if (t.p == t.end)
+			return;
+		if (!isIdentStart(*t.p))
+			break;
+		ident = readIdent(&t);
+		skipSpace(&t);
+		if (t.p == t.end || *t.p != ':') {
+			line->mnemonic = ident;
+			break;
+		}
+		t.p++;
+		if (line->nlabels < SCAN_LABELS)
+			line->labels[line->nlabels] = ident;
+		line->nlabels++;
+	}
+	line->content = 1;
+	while (line->n < 4 && nextOperand(&t, &line->ops[line->n]))
+		line->n++;
+}
+
+static int sameText(text_t a, text_t b) {
+	return a.end - a.p == b.end - b.p && memcmp(a.p, b.p, a.end - a.p) == 0;
+}
+
+// "jlt/jle/jeq/jne a, b, label"
+static int isConditional(line_t *line) {
+	text_t target;
+
+	if (!line->content || line->n != 3 || !(matches(&line->mnemonic, "jlt") || matches(&line->mnemonic, "jle") ||
+		matches(&line->mnemonic, "jeq") || matches(&line->mnemonic, "jne")))
+		return 0;
+	target = line->ops[2];
+	return target.p < target.end && isIdentStart(*target.p) && readIdent(&target).end == line->ops[2].end &&
+		registerNumber(line->ops[2]) < 0 && !usesDot(line->ops[2]);
+}
+
+// "jmp target" or "jeq r0, r0, target", without labels
+static int isJmp(line_t *line) {
+	return line->content && line->nlabels == 0 && ((matches(&line->mnemonic, "jmp") && line->n == 1) ||
+		(matches(&line->mnemonic, "jeq") && line->n == 3 && registerNumber(line->ops[0]) == 0 &&
+		registerNumber(line->ops[1]) == 0));
+}
+
+/*
+ * Turns "jcc a, b, next / jmp far / next:" into "j!cc a, b, far / next:",
+ * so the path through the jmp falls through instead of taking it, one
+ * instruction shorter. Taken jumps set r7, which this changes, and code
+ * reached through '.' would move, so programs that mention r7 or '.' are
+ * left alone.
+ */
+static void invertJumps(assembler_t *as, const char *source, const char *end, int lines) {
+	line_t line;
+	text_t target = { NULL, NULL }, far = { NULL, NULL };
+	const char *p, *next;
+	int state = 0, number = 0, a = 0, b = 0, i, unsafe = 0;
+
+	for (p = source; p < end; p = next + 1) {
+		next = memchr(p, '\n', end - p);
+		if (next == NULL)
+			next = end;
+		number++;
+		scanLine((text_t) { p, stripComment(p, next) }, &line);
+		for (i = 0; i < line.n; i++)
+			unsafe |= registerNumber(line.ops[i]) == 7 || usesDot(line.ops[i]);
+
+		// 1: after a conditional jump, 2: after the jmp behind it
+		if (state == 2) {
+			for (i = 0; i < line.nlabels && i < SCAN_LABELS; i++)
+				if (sameText(line.labels[i], target))
+					break;
+			if (i < line.nlabels && i < SCAN_LABELS) {
+				as->retarget[a] = far;
+				as->skip[b] = 1;
+				as->result->inverted++;
+				state = 0;
+			} else if (line.content) {
+				state = 0;
+			}
+		} else if (state == 1 && (line.nlabels || line.content)) {
+			if (isJmp(&line)) {
+				b = number;
+				far = line.ops[line.n - 1];
+				state = 2;
+				continue;
+			}
+			state = 0;
+		}
+		if (isConditional(&line)) {
+			state = 1;
+			a = number;
+			target = line.ops[2];
+		}
+	}
+	if (unsafe) {
+		memset(as->retarget, 0, (lines + 1) * sizeof(text_t));
+		memset(as->skip, 0, lines + 1);
+		as->result->inverted = 0;
+	}
+}
+
+// ALU, LHI, LD and ST, which nothing but their operands ties down
+static int isSchedulable(insn_t *i) {
+	return (i->flags & (INSN_CODE | INSN_PINNED)) == INSN_CODE && i->opcode <= ST;
+}
+
+// Whether the next address runs after i, jeq/jle r, r always jump
+static int fallsThrough(insn_t *i) {
+	return (i->flags & INSN_CODE) && i->opcode != JIN && i->opcode != HLT &&
+		!((i->opcode == JEQ || i->opcode == JLE) && i->src0 == i->src1);
+}
+
+// Registers i reads and writes as masks, r0 and r1 left out
+static int reads(insn_t *i) {
+	int mask = i->opcode == LHI ? 1 << i->dst : i->opcode == LD ? 1 << i->src1 : (1 << i->src0) | (1 << i->src1);
+
+	return mask & ~3;
+}
+
+static int writes(insn_t *i) {
+	return i->opcode <= LD ? (1 << i->dst) & ~3 : 0;
+}
+
+// Whether c must stay after e, ST being ordered with every LD and ST
+static int depends(insn_t *e, insn_t *c) {
+	return (writes(e) & (reads(c) | writes(c))) || (reads(e) & writes(c)) ||
+		(e->opcode == ST && c->opcode <= ST && c->opcode >= LD) || (e->opcode == LD && c->opcode == ST);
+}
+
+/*
+ * Whether the lab5 pipeline stalls j behind i, see is_pipe_stalled in
+ * sp_ctl(): a LD in exec1 whose dst j reads in exec0, or a ST in exec1 with
+ * a LD in exec0, both after the sram. Each costs one cycle.
+ */
+static int loadUse(insn_t *i, insn_t *j) {
+	int alu1 = j->opcode == LHI ? j->dst : j->src1;
+
+	return i->opcode == LD && (i->dst == j->src0 || i->dst == alu1);
+}
+
+static int storeLoad(insn_t *i, insn_t *j) {
+	return i->opcode == ST && j->opcode == LD;
+}
+
+// Stalls along the code, placed[a] being the instruction at address a
+static void countStalls(assembler_t *as, int *placed, spasm_stalls_t *stalls) {
+	insn_t *i, *j;
+	int a;
+
+	stalls->loadUse = stalls->storeLoad = 0;
+	for (a = 0; a + 1 < as->size; a++) {
+		i = &as->insns[placed[a]];
+		j = &as->insns[placed[a + 1]];
+		if (!fallsThrough(i) || !(j->flags & INSN_CODE))
+			continue;
+		stalls->loadUse += loadUse(i, j);
+		stalls->storeLoad += storeLoad(i, j);
+	}
+}
+
+static int stalls(insn_t *i, insn_t *j) {
+	return i != NULL && j != NULL && (loadUse(i, j) || storeLoad(i, j));
+}
+
+// Stalls of the n instructions from start in the given order, between prev and next
+static int windowStalls(assembler_t *as, int start, int n, int *order, insn_t *prev, insn_t *next) {
+	int k, count = 0;
+
+	for (k = 0; k < n; k++) {
+		count += stalls(prev, &as->insns[start + order[k]]);
+		prev = &as->insns[start + order[k]];
+	}
+	return count + stalls(prev, next);
+}
+
+/*
+ * List schedules each run of ALU/LD/ST instructions between labels and
+ * other instructions, SCHEDULE_WINDOW at a time: instructions go in
+ * program order unless the next one would stall, in which case the first
+ * ready one that doesn't goes first. A window only changes if that saves
+ * stalls. Fills as->slot.
+ */
+static int schedule(assembler_t *as) {
+	unsigned int preds[SCHEDULE_WINDOW], done;
+	int order[SCHEDULE_WINDOW], identity[SCHEDULE_WINDOW];
+	int *placed, start, n, k, c, e, best, cost, bestCost;
+	insn_t *prev, *next, *last;
+
+	placed = malloc(as->words * sizeof(int));
+	if (placed == NULL)
+		return fail(as, "out of memory");
+	for (start = 0; start < as->words; start++)
+		placed[start] = as->slot[start] = start;
+	for (k = 0; k < SCHEDULE_WINDOW; k++)
+		identity[k] = k;
+	countStalls(as, placed, &as->result->before);
+
+	for (start = 0; start < as->size; start += n) {
+		n = 1;
+		if (!isSchedulable(&as->insns[start]))
+			continue;
+		while (n < SCHEDULE_WINDOW && start + n < as->size && isSchedulable(&as->insns[start + n]) &&
+			!(as->insns[start + n].flags & INSN_LABEL))
+			n++;
+		for (c = 0; c < n; c++) {
+			preds[c] = 0;
+			for (e = 0; e < c; e++)
+				if (depends(&as->insns[start + e], &as->insns[start + c]))
+					preds[c] |= 1u << e;
+		}
+		prev = start > 0 && fallsThrough(&as->insns[placed[start - 1]]) ? &as->insns[placed[start - 1]] : NULL;
+		next = start + n < as->size && (as->insns[start + n].flags & INSN_CODE) ? &as->insns[start + n] : NULL;
+
+		done = 0;
+		last = prev;
+		for (k = 0; k < n; k++) {
+			best = -1;
+			bestCost = 0;
+			for (c = 0; c < n; c++) {
+				if ((done & (1u << c)) || (preds[c] & ~done))
+					continue;
+				cost = stalls(last, &as->insns[start + c]) + (k == n - 1 && stalls(&as->insns[start + c], next));
+				if (best < 0 || cost < bestCost) {
+					best = c;
+					bestCost = cost;
+				}
+			}
+			order[k] = best;
+			done |= 1u << best;
+			last = &as->insns[start + best];
+		}
+		if (windowStalls(as, start, n, order, prev, next) >= windowStalls(as, start, n, identity, prev, next))
+			continue;
+		for (k = 0; k < n; k++) {
+			placed[start + k] = start + order[k];
+			as->slot[start + order[k]] = start + k;
+		}
+	}
+
+	countStalls(as, placed, &as->result->after);
+	free(placed);
+	return 0;
+}
+
+int spasm_assemble(const char *source, int length, char *name, unsigned int *mem, int words, int options,
+	spasm_result_t *result) {
+	assembler_t as;
+	const char *p, *line, *end = source + length;
+	int err = 0, lines = 0;
+
+	memset(result, 0, sizeof(*result));
+	memset(&as, 0, sizeof(as));
+	as.name = name;
+	as.mem = mem;
+	as.words = words;
+	as.result = result;
+	as.capacity = SYMBOLS_INITIAL;
+	as.symbols = calloc(as.capacity, sizeof(symbol_t));
+	as.used = calloc(words, 1);
+	if (as.symbols == NULL || as.used == NULL)
+		err = fail(&as, "out of memory");
+
+	if (options & SPASM_SCHEDULE && err == 0) {
+		for (p = source; p < end && (p = memchr(p, '\n', end - p)) != NULL; p++)
+			lines++;
+		as.insns = calloc(words, sizeof(insn_t));
+		as.slot = malloc(words * sizeof(int));
+		as.retarget = calloc(lines + 2, sizeof(text_t));
+		as.skip = calloc(lines + 2, 1);
+		if (as.insns == NULL || as.slot == NULL || as.retarget == NULL || as.skip == NULL)
+			err = fail(&as, "out of memory");
+		else
+			invertJumps(&as, source, end, lines + 1);
+	}
+
+	for (as.pass = 1; as.pass <= 2 && err == 0; as.pass++) {
+		as.pc = 0;
+		as.line = 0;
+		for (line = source; line < end && err == 0; line = p + 1) {
+			p = memchr(line, '\n', end - line);
+			if (p == NULL)
+				p = end;
+			as.line++;
+			err = statement(&as, (text_t) { line, stripComment(line, p) });
+		}
+		// pass 2 writes each instruction where the scheduler put it
+		if (as.pass == 1 && as.insns != NULL && err == 0)
+			err = schedule(&as);
+	}
+
+	result->size = as.size;
+	result->entry = as.entry;
+	free(as.symbols);
+	free(as.used);
+	free(as.insns);
+	free(as.slot);
+	free(as.retarget);
+	free(as.skip);
+	return err ? -2 : 0;
+}
+
+int spasm_assemble_file(char *filename, unsigned int *mem, int words, int options, spasm_result_t *result) {
+	struct stat st;
+	char *source;
+	ssize_t n, got = 0;
+	int fd, err;
+
+	memset(result, 0, sizeof(*result));
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || (source = malloc(st.st_size + 1)) == NULL) {
+		snprintf(result->error, SPASM_ERROR_SIZE, "couldn't open file %s", filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	while (got < st.st_size && (n = read(fd, source + got, st.st_size - got)) > 0)
+		got += n;
+	close(fd);
+	if (got != st.st_size) {
+		snprintf(result->error, SPASM_ERROR_SIZE, "couldn't read file %s", filename);
+		free(source);
+		return -1;
+	}
+	err = spasm_assemble(source, got, filename, mem, words, options, result);
+	free(source);
+	return err;
+}
+
+int spasm_is_source(char *filename) {
+	char *dot = strrchr(filename, '.');
+
+	return dot != NULL && strchr(dot, '/') == NULL && (strcmp(dot, ".s") == 0 || strcmp(dot, ".asm") == 0);
+}
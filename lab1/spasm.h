@@ -0,0 +1,88 @@
+#ifndef _SPASM_H_
+#define _SPASM_H_
+
+/*
+ * Two pass assembler for the SP ISA, assembling straight into simulator
+ * memory. One statement per line, comments start with '#', ';' or "//":
+ *
+ *	loop:	ld r5, r2			# labels end with ':'
+ *			add r2, r2, 1		# a value in place of a register goes through r1
+ *			sub r6, r6, r1, 1	# the full form: dst, src0, src1, immediate
+ *			jlt r0, r6, loop
+ *	n = 10						# or .equ n, 10
+ *	data:	.word 1, 2, n * 3
+ *
+ * Instructions, with r for a register and v for a register or a value:
+ *	add sub lsf rsf and or xor	dst, v, v
+ *	lhi							dst, value
+ *	ld							dst, v			dst = MEM[v]
+ *	st							v, v			MEM[second] = first
+ *	jlt jle jeq jne				r, r, target
+ *	jin							v
+ *	dma							dst, v, v		copies second words from first to R[dst]
+ *	dmp							target			jumps when no DMA is running
+ *	hlt
+ *	nop, mov dst, v and jmp target	stand for add r0, r0, r0, add dst, v, r0
+ *									and jeq r0, r0, target
+ *
+ * Only one operand of an instruction can be a value, jump targets being
+ * one. Every instruction also takes the full four operand form.
+ *
+ * Directives: .word v, ... (32 bit words), .space count[, value], .org
+ * address, .align words, .equ name, value and .entry address (the first pc,
+ * 0 if not given). Values are C expressions over numbers (decimal, 0x, 0b,
+ * 'c'), symbols and '.', the address of the statement, with + - * / % << >>
+ * & | ^ ~. Anything .org, .space, .align and .equ use must be defined above.
+ */
+
+#define SPASM_ERROR_SIZE	160
+
+/*
+ * Options. SPASM_SCHEDULE reorders instructions for the lab5 pipeline:
+ * - within runs of ALU, LHI, LD and ST instructions that no label splits,
+ *   so that a LD isn't followed by an instruction reading its dst, nor a
+ *   ST by a LD, each of which stalls the pipeline for a cycle;
+ * - "jcc a, b, next / jmp far / next:" becomes "j!cc a, b, far / next:",
+ *   so the path through the jmp falls through, one instruction shorter.
+ *   Programs that mention r7 or '.' keep their jumps, taken jumps set r7.
+ * Registers and the order of stores are kept. The program must only
+ * reach its code through labels and must not store into its own code.
+ */
+#define SPASM_SCHEDULE		1
+
+typedef struct {
+	int loadUse;		// LD followed by an instruction reading its dst
+	int storeLoad;		// ST followed by LD
+} spasm_stalls_t;
+
+typedef struct {
+	int size;						// words spanned, reported as the program's "lines"
+	int entry;						// pc of the first instruction
+	int line;						// source line of the error, 0 if none
+	char error[SPASM_ERROR_SIZE];	// "name:line: message"
+	// SPASM_SCHEDULE, stalls are counted once per instruction pair along the code
+	spasm_stalls_t before;
+	spasm_stalls_t after;
+	int inverted;					// jumps that took over the jmp after them
+} spasm_result_t;
+
+/*
+ * Assembles length bytes of source into mem, which holds "words" zeroed
+ * words, name being used in error messages. Returns 0, or -2 with the
+ * error in result.
+ */
+int spasm_assemble(const char *source, int length, char *name, unsigned int *mem, int words, int options,
+	spasm_result_t *result);
+
+/*
+ * Same for a source file. Returns 0, -1 if it can't be read or -2.
+ */
+int spasm_assemble_file(char *filename, unsigned int *mem, int words, int options, spasm_result_t *result);
+
+/*
+ * Whether filename is assembler source (.s or .asm) rather than an image
+ * or hex text.
+ */
+int spasm_is_source(char *filename);
+
+#endif
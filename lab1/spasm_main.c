@@ -0,0 +1,79 @@
+/*
+ * SP assembler for source files, see spasm.h for the syntax. The simulators
+ * also load .s and .asm files directly, this writes them out for tools that
+ * only take hex text or images.
+ *
+ * usage: spasm [-i] [-O] source output
+ *   -i writes a binary image, see image.h
+ *   -O schedules for the lab5 pipeline (SPASM_SCHEDULE) and reports the
+ *      stalls along the code before and after
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "spasm.h"
+
+#define MEM_SIZE 65536
+
+int main(int argc, char *argv[])
+{
+	spasm_result_t result;
+	unsigned int *mem;
+	FILE *fp;
+	int binary = 0, options = 0;
+	int addr, i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-i") == 0)
+			binary = 1;
+		else if (strcmp(argv[i], "-O") == 0)
+			options |= SPASM_SCHEDULE;
+		else
+			break;
+	}
+	if (i != argc - 2) {
+		printf("usage: spasm [-i] [-O] source output\n");
+		return 1;
+	}
+	mem = image_alloc(MEM_SIZE);
+	if (mem == NULL) {
+		printf("out of memory\n");
+		return 1;
+	}
+	if (spasm_assemble_file(argv[argc - 2], mem, MEM_SIZE, options, &result) != 0) {
+		printf("%s\n", result.error);
+		return 1;
+	}
+	if (options & SPASM_SCHEDULE) {
+		printf("load-use stalls %d -> %d, ST/LD stalls %d -> %d, %d jumps inverted\n",
+			result.before.loadUse, result.after.loadUse, result.before.storeLoad, result.after.storeLoad,
+			result.inverted);
+		printf("saves %d stall cycles and %d instructions per pass through the code\n",
+			result.before.loadUse + result.before.storeLoad - result.after.loadUse - result.after.storeLoad,
+			result.inverted);
+	}
+
+	if (binary) {
+		if (image_write(argv[argc - 1], mem, result.size, result.entry) != 0) {
+			printf("couldn't write file %s\n", argv[argc - 1]);
+			return 1;
+		}
+		return 0;
+	}
+
+	// hex text has no entry, the program starts at 0
+	if (result.entry != 0)
+		printf("warning: hex text ignores .entry %d\n", result.entry);
+	fp = fopen(argv[argc - 1], "w");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", argv[argc - 1]);
+		return 1;
+	}
+	for (addr = 0; addr < result.size; addr++)
+		fprintf(fp, "%08x\n", mem[addr]);
+	fclose(fp);
+	image_free(mem, MEM_SIZE);
+	return 0;
+}
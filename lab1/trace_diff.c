@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Compares two simulator outputs and reports where they first differ.
+ * Understands the iss trace.txt and llsim inst_trace.txt ("--- instruction
+ * N" blocks with their ">>>> EXEC" lines), the llsim cycle_trace.txt
+ * ("cycle N" blocks) and sram dumps (one word per line, the line being the
+ * address). Both files are mapped and compared 64 bytes at a time while
+ * the line breaks are counted, so nothing is parsed before the first
+ * difference and only the block around it afterwards.
+ *
+ * Exits with 0 if the files are the same, 1 if they differ and 2 on errors,
+ * like cmp.
+ */
+
+#define CHUNK 64
+
+typedef struct {
+	char* name;
+	char* data;
+	size_t size;
+} file_t;
+
+static int mapFile(file_t* file, char* name) {
+	struct stat st;
+	int fd;
+
+	file->name = name;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	file->size = st.st_size;
+	file->data = "";
+	if (file->size > 0) {
+		file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(file->data, file->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Offset of the first byte that differs in the first n bytes of a and b, or
+ * n. *lines gets the line breaks before it.
+ */
+static size_t firstDiff(const char* a, const char* b, size_t n, long long* lines) {
+	size_t i = 0;
+	long long count = 0;
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i a0, a1, a2, a3, same;
+	int k;
+
+	for (; i + CHUNK <= n; i += CHUNK) {
+		a0 = _mm_loadu_si128((const __m128i*) (a + i));
+		a1 = _mm_loadu_si128((const __m128i*) (a + i + 16));
+		a2 = _mm_loadu_si128((const __m128i*) (a + i + 32));
+		a3 = _mm_loadu_si128((const __m128i*) (a + i + 48));
+		same = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(a0, _mm_loadu_si128((const __m128i*) (b + i))),
+				_mm_cmpeq_epi8(a1, _mm_loadu_si128((const __m128i*) (b + i + 16)))),
+			_mm_and_si128(_mm_cmpeq_epi8(a2, _mm_loadu_si128((const __m128i*) (b + i + 32))),
+				_mm_cmpeq_epi8(a3, _mm_loadu_si128((const __m128i*) (b + i + 48)))));
+		if (_mm_movemask_epi8(same) != 0xffff)
+			break;
+		k = _mm_movemask_epi8(_mm_cmpeq_epi8(a0, nl)) | (_mm_movemask_epi8(_mm_cmpeq_epi8(a1, nl)) << 16);
+		count += __builtin_popcount(k);
+		k = _mm_movemask_epi8(_mm_cmpeq_epi8(a2, nl)) | (_mm_movemask_epi8(_mm_cmpeq_epi8(a3, nl)) << 16);
+		count += __builtin_popcount(k);
+	}
+#else
+	const char* p;
+
+	for (; i + CHUNK <= n && memcmp(a + i, b + i, CHUNK) == 0; i += CHUNK)
+		for (p = a + i; (p = memchr(p, '\n', a + i + CHUNK - p)) != NULL; p++)
+			count++;
+#endif
+	// the chunk that differs, or the tail
+	for (; i < n && a[i] == b[i]; i++)
+		if (a[i] == '\n')
+			count++;
+	*lines = count;
+	return i;
+}
+
+static size_t lineStart(file_t* file, size_t off) {
+	while (off > 0 && file->data[off - 1] != '\n')
+		off--;
+	return off;
+}
+
+static size_t nextLine(file_t* file, size_t off) {
+	char* p = memchr(file->data + off, '\n', file->size - off);
+
+	return p ? p - file->data + 1 : file->size;
+}
+
+static int startsWith(file_t* file, size_t off, char* prefix) {
+	size_t n = strlen(prefix);
+
+	return off + n <= file->size && memcmp(file->data + off, prefix, n) == 0;
+}
+
+// Blocks of the trace grammars, lab5 cycle blocks open with the instruction count
+static int isBlock(file_t* file, size_t off) {
+	return startsWith(file, off, "--- instruction ") || startsWith(file, off, "cycle ") ||
+		startsWith(file, off, "nr_simulated_instructions ");
+}
+
+// Start of the block holding off, or -1 before the first one
+static long long findBlock(file_t* file, size_t off) {
+	off = lineStart(file, off);
+	for (;;) {
+		if (isBlock(file, off))
+			return off;
+		if (off == 0)
+			return -1;
+		off = lineStart(file, off - 1);
+	}
+}
+
+// Without the line break, numbered unless line is 0
+static void printLine(file_t* file, size_t off, char* mark, long long line) {
+	size_t end = nextLine(file, off);
+	int len = end - off - (end > off && file->data[end - 1] == '\n');
+
+	if (line > 0)
+		printf("%s%10lld  %.*s\n", mark, line, len, file->data + off);
+	else
+		printf("%s%.*s\n", mark, len, file->data + off);
+}
+
+static int isSramWord(file_t* file, size_t off) {
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		if (off + i >= file->size || strchr("0123456789abcdefABCDEF", file->data[off + i]) == NULL)
+			return 0;
+	return off + 8 == file->size || file->data[off + 8] == '\n';
+}
+
+static void describe(file_t* file, size_t off, long long line) {
+	long long block = findBlock(file, off);
+
+	if (block >= 0) {
+		printf("in block:\n");
+		printLine(file, block, "  ", 0);
+		if (startsWith(file, block, "nr_simulated_instructions ") && nextLine(file, block) < file->size)
+			printLine(file, nextLine(file, block), "  ", 0);
+	} else if (isSramWord(file, lineStart(file, off))) {
+		printf("at address %lld (%04llx)\n", line - 1, line - 1);
+	} else {
+		printf("before the first instruction or cycle block\n");
+	}
+}
+
+// Up to context lines after off, off being at line number line
+static void printAfter(file_t* file, size_t off, long long line, int context, char* mark) {
+	int i;
+
+	for (i = 0; i <= context && off < file->size; i++, line++) {
+		printLine(file, off, mark, line);
+		off = nextLine(file, off);
+	}
+}
+
+static void usage(void) {
+	printf("usage: trace_diff [-c lines] expected actual\n");
+	printf("  -c lines  lines of context around the first difference (default 3)\n");
+}
+
+int main(int argc, char** argv) {
+	file_t expected, actual;
+	size_t n, off, start, prev[64];
+	long long lines, first;
+	int context = 3;
+	int i, k;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) < 64) {
+			context = atoi(argv[++i]);
+		} else {
+			usage();
+			return 2;
+		}
+	}
+	if (i != argc - 2) {
+		usage();
+		return 2;
+	}
+	for (k = 0; k < 2; k++) {
+		if (mapFile(k == 0 ? &expected : &actual, argv[i + k]) != 0) {
+			printf("Error opening file %s, exit\n", argv[i + k]);
+			return 2;
+		}
+	}
+
+	n = expected.size < actual.size ? expected.size : actual.size;
+	off = firstDiff(expected.data, actual.data, n, &lines);
+	if (off == n && expected.size == actual.size)
+		return 0;
+
+	// lines are numbered from 1, like editors and diff do
+	start = lineStart(&expected, off);
+	if (off == n && start == off) {
+		printf("%s ends at line %lld, %s goes on\n",
+			expected.size < actual.size ? expected.name : actual.name, lines + 1,
+			expected.size < actual.size ? actual.name : expected.name);
+	} else {
+		printf("%s and %s differ at line %lld\n", expected.name, actual.name, lines + 1);
+	}
+	describe(expected.size > start ? &expected : &actual, start, lines + 1);
+
+	// the identical lines before it, then each side
+	first = lines + 1;
+	for (k = 0; k < context && start > 0; k++) {
+		start = lineStart(&expected, start - 1);
+		prev[k] = start;
+	}
+	while (k-- > 0)
+		printLine(&expected, prev[k], "  ", first - k - 1);
+	start = lineStart(&expected, off);
+	printAfter(&expected, start, first, context, "- ");
+	printAfter(&actual, start, first, context, "+ ");
+	return 1;
+}
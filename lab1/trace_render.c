@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrace.h"
+
+/*
+ * Renders a binary trace written by "iss -b" or "llsim -b" back into the
+ * text trace the simulator would have written (trace.txt for the iss,
+ * inst_trace.txt for the lab5 pipeline), byte for byte.
+ *
+ * Records only hold the written value, so the register file is rebuilt
+ * here while rendering. The two flavors differ in a few details: how a
+ * jump target and the halt pc are printed, LHI printing the old register,
+ * LD to R0/R1 and DMA/DMP printing nothing in the pipeline.
+ */
+
+#define ADD 0
+#define SUB 1
+#define LSF 2
+#define RSF 3
+#define AND 4
+#define OR  5
+#define XOR 6
+#define LHI 7
+#define LD 8
+#define ST 9
+#define DMA 10
+#define DMP 11
+#define JLT 16
+#define JLE 17
+#define JEQ 18
+#define JNE 19
+#define JIN 20
+#define HLT 24
+
+static char opcode_name[32][4] = {"ADD", "SUB", "LSF", "RSF", "AND", "OR", "XOR", "LHI",
+				 "LD", "ST", "DMA", "DMP", "U", "U", "U", "U",
+				 "JLT", "JLE", "JEQ", "JNE", "JIN", "U", "U", "U",
+				 "HLT", "U", "U", "U", "U", "U", "U", "U"};
+
+static void renderExec(FILE* out, int flavor, btrace_rec_t* rec, int* regs) {
+	int opcode = (rec->inst >> 25) & 0x1f;
+	int dst = (rec->inst >> 22) & 0x7;
+	int src0 = (rec->inst >> 19) & 0x7;
+	int src1 = (rec->inst >> 16) & 0x7;
+	int immediate = (short) (rec->inst & 0xffff);
+	int val0 = (src0 == 1 || opcode == LHI) ? immediate : regs[src0];
+	int val1 = (src1 == 1) ? immediate : regs[src1];
+	int target;
+
+	switch (opcode) {
+	case ADD:
+	case SUB:
+	case LSF:
+	case RSF:
+	case AND:
+	case OR:
+	case XOR:
+		fprintf(out, ">>>> EXEC: R[%d] = %d %s %d <<<<\n\n", dst, val0, opcode_name[opcode], val1);
+		break;
+	case LHI:
+		// the pipeline prints its second alu operand, the old register
+		fprintf(out, ">>>> EXEC: R[%d][31:16] = %d <<<<\n\n", dst,
+			flavor == BTRACE_FLAVOR_SP ? regs[dst] : immediate);
+		break;
+	case LD:
+		if (flavor == BTRACE_FLAVOR_ISS || dst > 1)
+			fprintf(out, ">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n", dst, val1, rec->value);
+		break;
+	case ST:
+		fprintf(out, ">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n", val1, src0, rec->value);
+		break;
+	case JLT:
+	case JLE:
+	case JEQ:
+	case JNE:
+		if (flavor == BTRACE_FLAVOR_SP)
+			target = (rec->flags & BTRACE_TAKEN) ? immediate : rec->pc + 1;
+		else
+			target = (unsigned short) ((rec->flags & BTRACE_TAKEN) ? immediate : rec->pc + 1);
+		fprintf(out, ">>>> EXEC: %s %d, %d, %d <<<<\n\n", opcode_name[opcode], val0, val1, target);
+		break;
+	case JIN:
+		fprintf(out, ">>>> EXEC: JIN R[%d] = %08x <<<<\n\n", src0, val0);
+		break;
+	}
+}
+
+int main(int argc, char** argv) {
+	btrace_header_t header;
+	btrace_rec_t rec;
+	int regs[8] = {0};
+	char* name;
+	FILE* in;
+	FILE* out = stdout;
+	long long count = 0;
+	int haltPc = 0;
+	int opcode;
+
+	if (argc != 2 && argc != 3) {
+		printf("usage: trace_render binary_trace [text_trace]\n");
+		return 1;
+	}
+	in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		printf("Error opening file %s, exit\n", argv[1]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, BTRACE_MAGIC, 4) != 0 ||
+		header.version != BTRACE_VERSION || header.flavor > BTRACE_FLAVOR_SP) {
+		printf("%s is not a binary trace, exit\n", argv[1]);
+		return 1;
+	}
+	name = calloc(header.nameLength + 1, 1);
+	if (name == NULL || fread(name, 1, header.nameLength, in) != header.nameLength) {
+		printf("Error reading from file %s, exit\n", argv[1]);
+		return 1;
+	}
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			printf("Error opening file %s, exit\n", argv[2]);
+			return 1;
+		}
+	}
+
+	fprintf(out, "program %s loaded, %d lines\n\n", name, header.lines);
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		opcode = (rec.inst >> 25) & 0x1f;
+		fprintf(out, "--- instruction %lld (%04llx) @ PC %d (%04x) -----------------------------------------------------------\n",
+			count, count, rec.pc, rec.pc);
+		fprintf(out, "pc = %04x, inst = %08x, opcode = %d (%s), dst = %d, src0 = %d, src1 = %d, immediate = %08x\n",
+			rec.pc, rec.inst, opcode, opcode_name[opcode], (rec.inst >> 22) & 0x7, (rec.inst >> 19) & 0x7,
+			(rec.inst >> 16) & 0x7, (short) (rec.inst & 0xffff));
+		fprintf(out, "r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n", (short) (rec.inst & 0xffff), regs[2], regs[3]);
+		fprintf(out, "r[4] = %08x r[5] = %08x r[6] = %08x r[7] = %08x \n\n", regs[4], regs[5], regs[6], regs[7]);
+		renderExec(out, header.flavor, &rec, regs);
+		if (rec.reg > 1)
+			regs[rec.reg] = rec.value;
+		count++;
+		if (opcode == HLT) {
+			// the iss prints pc - 1 after a 16 bit increment
+			haltPc = header.flavor == BTRACE_FLAVOR_SP ? rec.pc : (unsigned short) (rec.pc + 1) - 1;
+			fprintf(out, ">>>> EXEC: HALT at PC %04x<<<<\n", haltPc);
+			fprintf(out, "sim finished at pc %d, %lld instructions\n", haltPc, count);
+			break;
+		}
+	}
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+	free(name);
+	return 0;
+}
@@ -1,10 +1,13 @@
 /*
  * SP ASM: Simple Processor assembler
  *
- * usage: asm
+ * usage: asm [-i] program_name (-i writes a binary image, see image.h)
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
 
 #define ADD 0
 #define SUB 1
@@ -40,7 +43,7 @@ static void asm_cmd(int opcode, int dst, int src0, int src1, int immediate)
 	mem[pc++] = inst;
 }
 
-static void assemble_program(char *program_name)
+static void assemble_program(char *program_name, int binary)
 {
 	FILE *fp;
 	int addr, i, last_addr;
@@ -78,6 +81,14 @@ static void assemble_program(char *program_name)
 
 	last_addr = 350;
 
+	if (binary) {
+		if (image_write(program_name, mem, last_addr, 0) != 0) {
+			printf("couldn't write file %s\n", program_name);
+			exit(1);
+		}
+		return;
+	}
+
 	fp = fopen(program_name, "w");
 	if (fp == NULL) {
 		printf("couldn't open file %s\n", program_name);
@@ -93,9 +104,11 @@ static void assemble_program(char *program_name)
 
 int main(int argc, char *argv[])
 {
+	int binary = (argc == 3 && strcmp(argv[1], "-i") == 0);
+
 	printf("SP assembler\n");
-	if (argc != 2)
-		printf("usage: asm program_name\n");
-	assemble_program(argv[1]);
+	if (argc != 2 && !binary)
+		printf("usage: asm [-i] program_name\n");
+	assemble_program(argv[argc - 1], binary);
 	return 0;
 }
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "llsim.h"
+
+/*
+ * llsim bench: a design of many small units, to check -j against. Each
+ * unit steps an LFSR, and on alternate clocks reads its memory where the
+ * LFSR points or writes back the sum of what it read and its right hand
+ * neighbour's LFSR. Units only see each other through old registers, so
+ * a run gives the same bench_out.txt on any number of threads.
+ *
+ * The program name is the number of units, as in "llsim_bench -l off -j 4
+ * 48". With an x after it, "48x", every unit also writes its neighbour's
+ * memory, which llsim stops as a conflict between the two units. At -l
+ * debug each unit logs its acc as it writes it, for -j to keep in order.
+ */
+#define BENCH_UNITS	256
+#define BENCH_CLOCKS	100000
+#define BENCH_HEIGHT	1024
+
+typedef struct bench_registers_s {
+	int lfsr;
+	int acc;
+	int count;
+} bench_registers_t;
+
+typedef struct bench_s {
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *regs;
+	llsim_memory_t *mem;
+	int index;
+} bench_t;
+
+static bench_t benches[BENCH_UNITS];
+static int nbenches;
+static int conflict;
+static int done;
+
+static void bench_run(llsim_unit_t *unit)
+{
+	bench_t *b = (bench_t *) unit->private;
+	bench_t *next = &benches[(b->index + 1) % nbenches];
+	bench_registers_t *old = b->regs->old, *new = b->regs->new;
+	bench_registers_t *next_old = next->regs->old;
+	int addr = old->lfsr & (BENCH_HEIGHT - 1);
+
+	if (llsim->reset) {
+		llsim_set(b->regs, new->lfsr, b->index + 1);
+		llsim_set(b->regs, new->acc, 0);
+		llsim_set(b->regs, new->count, 0);
+		return;
+	}
+
+	// 32 bit galois lfsr
+	llsim_set(b->regs, new->lfsr, ((unsigned int) old->lfsr >> 1) ^ (-(old->lfsr & 1) & 0xd0000001));
+	llsim_set(b->regs, new->count, old->count + 1);
+
+	// a memory takes one access a clock, so reads and writes alternate
+	if (old->count & 1) {
+		llsim_set(b->regs, new->acc, old->acc + llsim_mem_extract_dataout(b->mem, 31, 0) + next_old->lfsr);
+		llsim_unit_log(unit, LLSIM_LOG_DEBUG, "%s: clock %d: acc %08x\n", unit->name, llsim->clock, old->acc);
+		llsim_mem_set_datain(b->mem, old->acc, 31, 0);
+		llsim_mem_write(b->mem, addr);
+		if (conflict) {
+			llsim_mem_set_datain(next->mem, old->acc, 31, 0);
+			llsim_mem_write(next->mem, addr);
+		}
+	} else {
+		llsim_mem_read(b->mem, addr);
+	}
+
+	if (b->index == 0 && old->count == BENCH_CLOCKS) {
+		done = 1;
+		llsim_stop();
+	}
+}
+
+// Each unit's registers and a sum of its memory, once the last clock is committed
+static void bench_dump(void)
+{
+	bench_registers_t *regs;
+	unsigned int sum;
+	FILE *fp;
+	int i, addr;
+
+	if (!done)
+		return;
+	fp = fopen("bench_out.txt", "w");
+	if (fp == NULL) {
+		printf("couldn't open file bench_out.txt\n");
+		return;
+	}
+	for (i = 0; i < nbenches; i++) {
+		regs = benches[i].regs->old;
+		sum = 0;
+		for (addr = 0; addr < BENCH_HEIGHT; addr++)
+			sum = sum * 31 + benches[i].mem->data[addr];
+		fprintf(fp, "%s lfsr %08x acc %08x count %d mem %08x\n", benches[i].unit->name, regs->lfsr, regs->acc,
+			regs->count, sum);
+	}
+	fclose(fp);
+}
+
+// no options of its own
+int sp_option(char *option, char *arg)
+{
+	return 0;
+}
+
+void sp_usage(void)
+{
+}
+
+void sp_init(char *program_name)
+{
+	char name[32], *end;
+	bench_t *b;
+	int i;
+
+	nbenches = strtol(program_name, &end, 10);
+	conflict = strcmp(end, "x") == 0;
+	if (nbenches < 1 || nbenches > BENCH_UNITS || (*end && !conflict)) {
+		printf("llsim_bench: the program is the number of units, 1 to %d, and x to conflict\n", BENCH_UNITS);
+		exit(1);
+	}
+	printf("initializing %d bench units\n", nbenches);
+
+	for (i = 0; i < nbenches; i++) {
+		b = &benches[i];
+		b->index = i;
+		sprintf(name, "bench%d", i);
+		b->unit = llsim_register_unit(name, bench_run);
+		b->unit->private = b;
+		b->regs = llsim_allocate_tracked_registers(b->unit, "bench_registers", sizeof(bench_registers_t));
+		llsim_register_field(b->unit, b->regs, NULL, "lfsr", 32, 0, &((bench_registers_t *) b->regs->new)->lfsr, sizeof(int));
+		llsim_register_field(b->unit, b->regs, NULL, "acc", 32, 0, &((bench_registers_t *) b->regs->new)->acc, sizeof(int));
+		llsim_register_field(b->unit, b->regs, NULL, "count", 32, 0, &((bench_registers_t *) b->regs->new)->count, sizeof(int));
+		b->mem = llsim_allocate_memory(b->unit, name, 32, BENCH_HEIGHT, 0);
+	}
+	atexit(bench_dump);
+}
@@ -0,0 +1,742 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "llsim.h"
+
+/*
+ * llsim checkpoints: everything a run needs to go on, in one file. A
+ * header, a section table and the sections, which follow the design unit
+ * by unit, in the order the units run:
+ *	unit		sleep state, see llsim_unit_sleep()
+ *	registers	old then new of each register block
+ *	memory		the data, page aligned in the file so a restore maps it
+ *			copy on write rather than reading it
+ *	ports		the memory's pending requests, its data out and whether
+ *			it had a request the clock before
+ *	private		each llsim_checkpoint_private() area
+ * A checkpoint is restored into the same design, built from the same
+ * program, and says so when it doesn't match.
+ */
+#define CHECKPOINT_MAGIC	"LLCP"
+#define CHECKPOINT_VERSION	2
+#define CHECKPOINT_PAGE		4096
+#define CHECKPOINT_NAME		32
+
+#define SECTION_UNIT		1
+#define SECTION_REGISTERS	2
+#define SECTION_MEMORY		3
+#define SECTION_PORTS		4
+#define SECTION_PRIVATE		5
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	int clock;
+	int reset;
+	unsigned int nsections;		// followed by the section table
+} checkpoint_header_t;
+
+typedef struct {
+	unsigned int kind;
+	unsigned int size;
+	unsigned long long offset;
+	char unit[CHECKPOINT_NAME];
+	char name[CHECKPOINT_NAME];
+} checkpoint_section_t;
+
+typedef struct {
+	int asleep;
+	int values[LLSIM_WAKE_MAX];
+	i64 gated;
+} checkpoint_unit_t;
+
+typedef struct {
+	int read;
+	int read_addr;
+	int write;
+	int write_addr;
+	int datain;
+	int dataout;
+	int accessed;
+} checkpoint_ports_t;
+
+/*
+ * The design, section by section: each call hands the next one to fn,
+ * with where its data lives. When restoring, fn fills in what walk()
+ * copied out, unit and port state, which then goes back.
+ */
+typedef int (*section_fn_t)(checkpoint_section_t *section, void *p, void *arg);
+
+static int walk(section_fn_t fn, void *arg, int restoring)
+{
+	checkpoint_section_t section;
+	checkpoint_unit_t state;
+	checkpoint_ports_t ports;
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *ur;
+	llsim_memory_t *mem;
+	llsim_private_t *private;
+	int i;
+
+	for (unit = llsim->units; unit; unit = unit->next) {
+		memset(&section, 0, sizeof(section));
+		strncpy(section.unit, unit->name, CHECKPOINT_NAME - 1);
+
+		section.kind = SECTION_UNIT;
+		section.size = sizeof(state);
+		memset(&state, 0, sizeof(state));
+		state.asleep = unit->asleep;
+		for (i = 0; i < unit->nwake; i++)
+			state.values[i] = unit->wake[i].value;
+		state.gated = unit->gated;
+		if (fn(&section, &state, arg) != 0)
+			return -1;
+
+		for (ur = unit->regs; ur; ur = ur->next) {
+			section.kind = SECTION_REGISTERS;
+			section.size = ur->size * 2;
+			strncpy(section.name, ur->name, CHECKPOINT_NAME - 1);
+			if (fn(&section, ur, arg) != 0)
+				return -1;
+		}
+
+		for (mem = unit->mems; mem; mem = mem->next) {
+			section.kind = SECTION_MEMORY;
+			section.size = mem->height * mem->entry_size * sizeof(int);
+			strncpy(section.name, mem->name, CHECKPOINT_NAME - 1);
+			if (fn(&section, mem->data, arg) != 0)
+				return -1;
+
+			section.kind = SECTION_PORTS;
+			section.size = sizeof(ports);
+			ports.read = mem->read;
+			ports.read_addr = mem->read_addr;
+			ports.write = mem->write;
+			ports.write_addr = mem->write_addr;
+			ports.datain = *mem->datain;
+			ports.dataout = *mem->dataout;
+			ports.accessed = mem->accessed;
+			if (fn(&section, &ports, arg) != 0)
+				return -1;
+			if (restoring) {
+				mem->read = ports.read;
+				mem->read_addr = ports.read_addr;
+				mem->write = ports.write;
+				mem->write_addr = ports.write_addr;
+				*mem->datain = ports.datain;
+				*mem->dataout = ports.dataout;
+				mem->accessed = ports.accessed;
+				mem->reader = NULL;
+				mem->writer = NULL;
+			}
+		}
+
+		for (private = unit->privates; private; private = private->next) {
+			section.kind = SECTION_PRIVATE;
+			section.size = private->size;
+			strncpy(section.name, private->name, CHECKPOINT_NAME - 1);
+			if (fn(&section, private->p, arg) != 0)
+				return -1;
+		}
+
+		if (restoring) {
+			unit->asleep = state.asleep;
+			for (i = 0; i < unit->nwake; i++)
+				unit->wake[i].value = state.values[i];
+			unit->gated = state.gated;
+		}
+		memset(section.name, 0, CHECKPOINT_NAME);
+	}
+	return 0;
+}
+
+/*
+ * saving
+ */
+typedef struct {
+	int fd;
+	int nsections;
+	checkpoint_section_t *table;	// NULL while counting
+	unsigned long long end;
+} save_t;
+
+static int count_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	save_t *save = arg;
+	int align = section->kind == SECTION_MEMORY ? CHECKPOINT_PAGE : 16;
+
+	save->end = (save->end + align - 1) & ~(unsigned long long) (align - 1);
+	if (save->table) {
+		save->table[save->nsections] = *section;
+		save->table[save->nsections].offset = save->end;
+	}
+	save->nsections++;
+	save->end += section->size;
+	return 0;
+}
+
+static int save_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	save_t *save = arg;
+	checkpoint_section_t *entry = &save->table[save->nsections++];
+	llsim_unit_registers_t *ur = p;
+
+	if (section->kind == SECTION_REGISTERS)
+		return pwrite(save->fd, ur->old, ur->size, entry->offset) == ur->size &&
+			pwrite(save->fd, ur->new, ur->size, entry->offset + ur->size) == ur->size ? 0 : -1;
+	return pwrite(save->fd, p, section->size, entry->offset) == section->size ? 0 : -1;
+}
+
+// Between clocks, when every unit's old and new agree and no memory has a request
+int llsim_checkpoint(char *filename)
+{
+	checkpoint_header_t header;
+	save_t save;
+	int size, ok;
+
+	memset(&save, 0, sizeof(save));
+	walk(count_section, &save, 0);
+	size = sizeof(header) + save.nsections * sizeof(checkpoint_section_t);
+	save.table = (checkpoint_section_t *) llsim_malloc(save.nsections * sizeof(checkpoint_section_t) + 1);
+	save.nsections = 0;
+	save.end = size;
+	walk(count_section, &save, 0);
+
+	save.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (save.fd < 0) {
+		printf("llsim: couldn't open file %s\n", filename);
+		free(save.table);
+		return -1;
+	}
+	memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+	header.version = CHECKPOINT_VERSION;
+	header.clock = llsim->clock;
+	header.reset = llsim->reset;
+	header.nsections = save.nsections;
+	ok = pwrite(save.fd, &header, sizeof(header), 0) == sizeof(header) &&
+		pwrite(save.fd, save.table, size - sizeof(header), sizeof(header)) == size - sizeof(header);
+	save.nsections = 0;
+	ok = ok && walk(save_section, &save, 0) == 0 && ftruncate(save.fd, save.end) == 0;
+	close(save.fd);
+	free(save.table);
+	if (!ok) {
+		printf("llsim: couldn't write file %s\n", filename);
+		return -1;
+	}
+	llsim_log(LLSIM_LOG_INFO, "llsim: clock %d: checkpoint %s\n", llsim->clock, filename);
+	return 0;
+}
+
+/*
+ * restoring
+ */
+typedef struct {
+	int fd;
+	char *name;
+	char *data;
+	unsigned long long size;
+	checkpoint_section_t *table;
+	int nsections;
+	int next;
+} restore_t;
+
+static int restore_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	restore_t *restore = arg;
+	checkpoint_section_t *entry = &restore->table[restore->next];
+	llsim_unit_registers_t *ur = p;
+	char *data;
+
+	if (restore->next >= restore->nsections || entry->kind != section->kind || entry->size != section->size ||
+	    strncmp(entry->unit, section->unit, CHECKPOINT_NAME) != 0 ||
+	    strncmp(entry->name, section->name, CHECKPOINT_NAME) != 0 ||
+	    entry->offset + entry->size > restore->size) {
+		printf("llsim: checkpoint %s doesn't match the design at %s %s\n", restore->name, section->unit, section->name);
+		return -1;
+	}
+	restore->next++;
+	data = restore->data + entry->offset;
+	switch (section->kind) {
+	case SECTION_REGISTERS:
+		memcpy(ur->old, data, ur->size);
+		memcpy(ur->new, data + ur->size, ur->size);
+		// the next commit copies all of it
+		ur->all_dirty = ur->tracked;
+		break;
+	case SECTION_MEMORY:
+		if (mmap(p, section->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, restore->fd, entry->offset) == MAP_FAILED)
+			memcpy(p, data, section->size);
+		break;
+	default:
+		memcpy(p, data, section->size);
+		break;
+	}
+	return 0;
+}
+
+int llsim_restore(char *filename)
+{
+	checkpoint_header_t *header;
+	restore_t restore;
+	struct stat st;
+	int ok;
+
+	memset(&restore, 0, sizeof(restore));
+	restore.name = filename;
+	restore.fd = open(filename, O_RDONLY);
+	if (restore.fd < 0 || fstat(restore.fd, &st) < 0 || st.st_size < sizeof(checkpoint_header_t)) {
+		printf("llsim: couldn't open file %s\n", filename);
+		if (restore.fd >= 0)
+			close(restore.fd);
+		return -1;
+	}
+	restore.size = st.st_size;
+	restore.data = mmap(NULL, restore.size, PROT_READ, MAP_PRIVATE, restore.fd, 0);
+	if (restore.data == MAP_FAILED) {
+		printf("llsim: couldn't map file %s\n", filename);
+		close(restore.fd);
+		return -1;
+	}
+	header = (checkpoint_header_t *) restore.data;
+	restore.table = (checkpoint_section_t *) (header + 1);
+	restore.nsections = header->nsections;
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, 4) != 0 || header->version != CHECKPOINT_VERSION ||
+	    sizeof(*header) + restore.nsections * sizeof(checkpoint_section_t) > restore.size) {
+		printf("llsim: %s is not a checkpoint\n", filename);
+		ok = 0;
+	} else {
+		ok = walk(restore_section, &restore, 1) == 0;
+		if (ok && restore.next != restore.nsections) {
+			printf("llsim: checkpoint %s doesn't match the design, it has more\n", filename);
+			ok = 0;
+		}
+	}
+	if (ok) {
+		llsim->clock = header->clock;
+		llsim->reset = header->reset;
+	}
+	// the memories keep their own mappings
+	munmap(restore.data, restore.size);
+	close(restore.fd);
+	if (!ok)
+		return -1;
+	llsim_log(LLSIM_LOG_INFO, "llsim: clock %d: restored %s\n", llsim->clock, filename);
+	return 0;
+}
+
+void llsim_checkpoint_private(llsim_unit_t *unit, char *name, void *p, int size)
+{
+	llsim_private_t *private, **pp;
+
+	llsim_assert(llsim->schedule == NULL, "ERROR: private state %s added after the design was frozen", name);
+	private = (llsim_private_t *) llsim_malloc(sizeof(llsim_private_t));
+	private->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(private->name, name);
+	private->p = p;
+	private->size = size;
+	for (pp = &unit->privates; *pp; pp = &(*pp)->next)
+		;
+	*pp = private;
+}
+
+/*
+ * time travel: snapshots taken as the clock begins, kept in memory. Each
+ * holds the sections of a checkpoint one after the other, but for each
+ * memory only the pages written since the snapshot before, as a count, the
+ * page numbers and the pages. The first snapshot holds every page.
+ *
+ * The first snapshot and the ones a failure's window may go back to are
+ * kept, and TRAVEL_SPARSE of those in between. Past that, the one with its
+ * neighbours closest for their age is merged into the one after it, which
+ * then holds the pages either wrote, so that older snapshots thin out as
+ * the run goes on rather than piling up.
+ */
+#define TRAVEL_FILES		8
+#define TRAVEL_SPARSE		16
+
+typedef struct {
+	int clock;
+	int reset;
+	char *data;
+	int size;
+	int *mems;			// by memory, where its pages are in data
+	long files[TRAVEL_FILES];	// where the travel files ended
+} snapshot_t;
+
+static snapshot_t *snapshots;
+static int nsnapshots, max_snapshots;
+static FILE *travel_files[TRAVEL_FILES];
+static int ntravel_files;
+
+typedef struct {
+	snapshot_t *snapshot;
+	int max;
+	int mem;		// memories walked so far
+	int pos;		// restoring or merging, in data
+	snapshot_t *from;	// merging, into the snapshot after it
+} travel_t;
+
+static int memory_pages(checkpoint_section_t *section)
+{
+	return (section->size / sizeof(int) + (1 << LLSIM_PAGE_SHIFT) - 1) >> LLSIM_PAGE_SHIFT;
+}
+
+// The bytes of page page, the last one may be short
+static int page_size(checkpoint_section_t *section, int page)
+{
+	int size = section->size - (page << LLSIM_PAGE_SHIFT) * sizeof(int);
+
+	return size < (sizeof(int) << LLSIM_PAGE_SHIFT) ? size : sizeof(int) << LLSIM_PAGE_SHIFT;
+}
+
+/*
+ * The largest data freed since the last snapshot, which the next one
+ * starts in, so that snapshots of a steady size reuse their memory rather
+ * than fault in new pages
+ */
+static char *spare;
+static int spare_size;
+
+static void snapshot_begin(travel_t *travel, snapshot_t *snapshot)
+{
+	memset(travel, 0, sizeof(*travel));
+	travel->snapshot = snapshot;
+	snapshot->data = spare;
+	travel->max = spare_size;
+	spare = NULL;
+	spare_size = 0;
+}
+
+static void snapshot_free(snapshot_t *snapshot)
+{
+	if (snapshot->size > spare_size) {
+		free(spare);
+		spare = snapshot->data;
+		spare_size = snapshot->size;
+	} else {
+		free(snapshot->data);
+	}
+	free(snapshot->mems);
+}
+
+static char *snapshot_grow(travel_t *travel, int size)
+{
+	snapshot_t *snapshot = travel->snapshot;
+
+	if (snapshot->size + size > travel->max) {
+		while (snapshot->size + size > travel->max)
+			travel->max = travel->max ? travel->max * 2 : 4096;
+		snapshot->data = realloc(snapshot->data, travel->max);
+		llsim_assert(snapshot->data != NULL, "out of memory");
+	}
+	snapshot->size += size;
+	return snapshot->data + snapshot->size - size;
+}
+
+static int snapshot_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	travel_t *travel = arg;
+	snapshot_t *snapshot = travel->snapshot;
+	llsim_unit_registers_t *ur = p;
+	llsim_memory_t *mem;
+	int i, n, npages, at;
+
+	switch (section->kind) {
+	case SECTION_REGISTERS:
+		memcpy(snapshot_grow(travel, ur->size), ur->old, ur->size);
+		memcpy(snapshot_grow(travel, ur->size), ur->new, ur->size);
+		break;
+	case SECTION_MEMORY:
+		mem = llsim->schedule->mems[travel->mem];
+		npages = memory_pages(section);
+		for (i = n = 0; i < npages; i++)
+			n += mem->dirty[i];
+		at = snapshot->size;
+		snapshot->mems[travel->mem++] = at;
+		snapshot_grow(travel, (n + 1) * sizeof(int));
+		((int *) (snapshot->data + at))[0] = n;
+		for (i = n = 0; i < npages; i++)
+			if (mem->dirty[i]) {
+				// data moves as it grows
+				((int *) (snapshot->data + at))[++n] = i;
+				memcpy(snapshot_grow(travel, page_size(section, i)), (int *) p + (i << LLSIM_PAGE_SHIFT),
+				       page_size(section, i));
+				mem->dirty[i] = 0;
+			}
+		break;
+	default:
+		memcpy(snapshot_grow(travel, section->size), p, section->size);
+		break;
+	}
+	return 0;
+}
+
+// Where the pages of memory m end in snapshot
+static int snapshot_memory_end(snapshot_t *snapshot, int m, checkpoint_section_t *section)
+{
+	int *pages = (int *) (snapshot->data + snapshot->mems[m]);
+	int i, end = snapshot->mems[m] + (pages[0] + 1) * sizeof(int);
+
+	for (i = 1; i <= pages[0]; i++)
+		end += page_size(section, pages[i]);
+	return end;
+}
+
+static int restore_snapshot_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	travel_t *travel = arg;
+	snapshot_t *snapshot = travel->snapshot;
+	llsim_unit_registers_t *ur = p;
+	llsim_memory_t *mem;
+	char *data;
+	int *pages;
+	int i, j, m, left, size;
+
+	switch (section->kind) {
+	case SECTION_REGISTERS:
+		memcpy(ur->old, snapshot->data + travel->pos, ur->size);
+		memcpy(ur->new, snapshot->data + travel->pos + ur->size, ur->size);
+		// the next commit copies all of it
+		ur->all_dirty = ur->tracked;
+		travel->pos += ur->size * 2;
+		break;
+	case SECTION_MEMORY:
+		m = travel->mem++;
+		mem = llsim->schedule->mems[m];
+		// the pages written since the snapshot, as the newest one up to it has them
+		for (j = snapshot - snapshots + 1; j < nsnapshots; j++) {
+			pages = (int *) (snapshots[j].data + snapshots[j].mems[m]);
+			for (i = 1; i <= pages[0]; i++)
+				mem->dirty[pages[i]] = 1;
+		}
+		for (i = left = 0; i < memory_pages(section); i++)
+			left += mem->dirty[i];
+		for (j = snapshot - snapshots; j >= 0 && left > 0; j--) {
+			pages = (int *) (snapshots[j].data + snapshots[j].mems[m]);
+			data = (char *) (pages + pages[0] + 1);
+			for (i = 1; i <= pages[0]; i++) {
+				size = page_size(section, pages[i]);
+				if (mem->dirty[pages[i]]) {
+					memcpy((int *) p + (pages[i] << LLSIM_PAGE_SHIFT), data, size);
+					mem->dirty[pages[i]] = 0;
+					left--;
+				}
+				data += size;
+			}
+		}
+		travel->pos = snapshot_memory_end(snapshot, m, section);
+		break;
+	default:
+		memcpy(p, snapshot->data + travel->pos, section->size);
+		travel->pos += section->size;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Into a new snapshot, the sections of the one after from and for each
+ * memory the pages of both, in order, as that one has them when both do
+ */
+static int merge_section(checkpoint_section_t *section, void *p, void *arg)
+{
+	travel_t *travel = arg;
+	snapshot_t *snapshot = travel->snapshot, *from = travel->from, *to = travel->from + 1;
+	int *from_pages, *to_pages;
+	char *from_data, *to_data, *data;
+	int i, k, n, m, at, page;
+
+	if (section->kind != SECTION_MEMORY) {
+		memcpy(snapshot_grow(travel, section->size), to->data + travel->pos, section->size);
+		travel->pos += section->size;
+		return 0;
+	}
+	m = travel->mem++;
+	from_pages = (int *) (from->data + from->mems[m]);
+	to_pages = (int *) (to->data + to->mems[m]);
+	for (i = k = 1, n = 0; i <= from_pages[0] || k <= to_pages[0]; n++) {
+		if (k > to_pages[0] || (i <= from_pages[0] && from_pages[i] < to_pages[k])) {
+			i++;
+		} else {
+			if (i <= from_pages[0] && from_pages[i] == to_pages[k])
+				i++;
+			k++;
+		}
+	}
+	at = snapshot->size;
+	snapshot->mems[m] = at;
+	snapshot_grow(travel, (n + 1) * sizeof(int));
+	((int *) (snapshot->data + at))[0] = n;
+	from_data = (char *) (from_pages + from_pages[0] + 1);
+	to_data = (char *) (to_pages + to_pages[0] + 1);
+	for (i = k = 1, n = 0; i <= from_pages[0] || k <= to_pages[0]; ) {
+		if (i <= from_pages[0] && (k > to_pages[0] || from_pages[i] < to_pages[k])) {
+			page = from_pages[i++];
+			data = from_data;
+			from_data += page_size(section, page);
+		} else {
+			// the newer one of a page both have
+			if (i <= from_pages[0] && from_pages[i] == to_pages[k])
+				from_data += page_size(section, from_pages[i++]);
+			page = to_pages[k++];
+			data = to_data;
+			to_data += page_size(section, page);
+		}
+		// data moves as it grows
+		((int *) (snapshot->data + at))[++n] = page;
+		memcpy(snapshot_grow(travel, page_size(section, page)), data, page_size(section, page));
+	}
+	travel->pos = snapshot_memory_end(to, m, section);
+	return 0;
+}
+
+// Whether the snapshot after from has every page from has, as for memories written all over
+static int snapshot_covers(snapshot_t *from)
+{
+	snapshot_t *to = from + 1;
+	int *from_pages, *to_pages;
+	int i, k, m;
+
+	for (m = 0; m < llsim->schedule->nmems; m++) {
+		from_pages = (int *) (from->data + from->mems[m]);
+		to_pages = (int *) (to->data + to->mems[m]);
+		for (i = k = 1; i <= from_pages[0]; i++) {
+			while (k <= to_pages[0] && to_pages[k] < from_pages[i])
+				k++;
+			if (k > to_pages[0] || to_pages[k] != from_pages[i])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// Merges snapshot i into the one after it
+static void snapshot_merge(int i)
+{
+	snapshot_t merged, *to = &snapshots[i + 1];
+	travel_t travel;
+
+	if (!snapshot_covers(&snapshots[i])) {
+		memset(&merged, 0, sizeof(merged));
+		merged.mems = (int *) llsim_malloc(llsim->schedule->nmems * sizeof(int) + 1);
+		snapshot_begin(&travel, &merged);
+		travel.from = &snapshots[i];
+		walk(merge_section, &travel, 0);
+		snapshot_free(to);
+		to->data = merged.data;
+		to->size = merged.size;
+		to->mems = merged.mems;
+	}
+	snapshot_free(&snapshots[i]);
+	memmove(&snapshots[i], &snapshots[i + 1], (nsnapshots - i - 1) * sizeof(snapshot_t));
+	nsnapshots--;
+}
+
+/*
+ * Thins the snapshots older than the newest one at or before the window,
+ * the first one left alone. The gap merging snapshot i leaves, over how
+ * long ago it starts, is smallest for the one to go.
+ */
+static void snapshot_thin(void)
+{
+	int i, keep, best;
+	i64 gap, age, best_gap = 0, best_age = 1;
+
+	for (keep = nsnapshots - 1; keep > 0 && snapshots[keep].clock > llsim->clock - llsim->travel_window; keep--)
+		;
+	while (keep - 1 > TRAVEL_SPARSE) {
+		for (i = best = 1; i < keep; i++) {
+			gap = snapshots[i + 1].clock - snapshots[i - 1].clock;
+			age = llsim->clock - snapshots[i - 1].clock;
+			if (i == 1 || gap * best_age <= best_gap * age) {
+				best = i;
+				best_gap = gap;
+				best_age = age;
+			}
+		}
+		snapshot_merge(best);
+		keep--;
+	}
+}
+
+// As the clock begins
+void llsim_snapshot(void)
+{
+	llsim_schedule_t *schedule = llsim->schedule;
+	llsim_memory_t *mem;
+	snapshot_t *snapshot;
+	travel_t travel;
+	int i, npages;
+
+	if (nsnapshots == max_snapshots) {
+		max_snapshots = max_snapshots ? max_snapshots * 2 : 64;
+		snapshots = (snapshot_t *) realloc(snapshots, max_snapshots * sizeof(snapshot_t));
+		llsim_assert(snapshots != NULL, "out of memory");
+	}
+	// the first one has every page, and memory writes are followed from then on
+	if (nsnapshots == 0) {
+		for (i = 0; i < schedule->nmems; i++) {
+			mem = schedule->mems[i];
+			npages = (mem->height * mem->entry_size + (1 << LLSIM_PAGE_SHIFT) - 1) >> LLSIM_PAGE_SHIFT;
+			mem->dirty = (unsigned char *) llsim_malloc(npages);
+			memset(mem->dirty, 1, npages);
+		}
+	}
+	snapshot = &snapshots[nsnapshots];
+	memset(snapshot, 0, sizeof(snapshot_t));
+	snapshot->clock = llsim->clock;
+	snapshot->reset = llsim->reset;
+	snapshot->mems = (int *) llsim_malloc(schedule->nmems * sizeof(int) + 1);
+	for (i = 0; i < ntravel_files; i++) {
+		fflush(travel_files[i]);
+		snapshot->files[i] = ftell(travel_files[i]);
+	}
+	snapshot_begin(&travel, snapshot);
+	walk(snapshot_section, &travel, 0);
+	if (snapshot->size < travel.max)
+		snapshot->data = realloc(snapshot->data, snapshot->size);
+	nsnapshots++;
+	snapshot_thin();
+}
+
+/*
+ * Back to the newest snapshot at or before clock, returns its clock or -1
+ * if there is none. The snapshots after it go, running on takes them again.
+ */
+int llsim_snapshot_restore(int clock)
+{
+	snapshot_t *snapshot;
+	travel_t travel;
+	int i;
+
+	for (i = nsnapshots - 1; i >= 0 && snapshots[i].clock > clock; i--)
+		;
+	if (i < 0)
+		return -1;
+	snapshot = &snapshots[i];
+	memset(&travel, 0, sizeof(travel));
+	travel.snapshot = snapshot;
+	walk(restore_snapshot_section, &travel, 1);
+	for (i = 0; i < ntravel_files; i++) {
+		fflush(travel_files[i]);
+		if (ftruncate(fileno(travel_files[i]), snapshot->files[i]) == 0)
+			fseek(travel_files[i], snapshot->files[i], SEEK_SET);
+	}
+	for (i = snapshot - snapshots + 1; i < nsnapshots; i++)
+		snapshot_free(&snapshots[i]);
+	nsnapshots = snapshot - snapshots + 1;
+	llsim->clock = snapshot->clock;
+	llsim->reset = snapshot->reset;
+	return llsim->clock;
+}
+
+void llsim_travel_file(FILE *fp)
+{
+	llsim_assert(ntravel_files < TRAVEL_FILES, "ERROR: more than %d travel files", TRAVEL_FILES);
+	llsim_assert(nsnapshots == 0, "ERROR: travel file added after the first snapshot");
+	travel_files[ntravel_files++] = fp;
+}
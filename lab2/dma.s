@@ -0,0 +1,29 @@
+# dma.bin: the DMA copies the 100 words at 101 to 201 while the loop
+# copies the first 10 of them to 301, then it waits for the DMA
+	add r2, r1, r0, 101
+	add r3, r1, r0, 201
+	add r4, r1, r0, 301
+	add r6, r1, r0, 10
+	dma r3, r2, 100
+copy:	ld r5, r2
+	st r5, r4
+	add r2, r2, 1
+	add r4, r4, 1
+	sub r6, r6, 1
+	jlt r0, r6, copy
+wait:	dmp done
+	jin r0, r0, r0, wait
+done:	hlt
+	.org 101
+	.word 1, 2, 3, 4, 5, 6, 7, 8, 9, 10
+	.word 11, 12, 13, 14, 15, 16, 17, 18, 19, 20
+	.word 21, 22, 23, 24, 25, 26, 27, 28, 29, 30
+	.word 31, 32, 33, 34, 35, 36, 37, 38, 39, 40
+	.word 41, 42, 43, 44, 45, 46, 47, 48, 49, 50
+	.word 51, 52, 53, 54, 55, 56, 57, 58, 59, 60
+	.word 61, 62, 63, 64, 65, 66, 67, 68, 69, 70
+	.word 71, 72, 73, 74, 75, 76, 77, 78, 79, 80
+	.word 81, 82, 83, 84, 85, 86, 87, 88, 89, 90
+	.word 91, 92, 93, 94, 95, 96, 97, 98, 99, 100
+	.org 349
+	.word 0
@@ -1,6 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "llsim.h"
 
 /*
@@ -9,6 +16,47 @@
 llsim_t *llsim = NULL;
 static int stop_sim = 0;
 
+// -T, see llsim_travel()
+static int travel_first, travel_next = -1, travel_armed, travel_failed;
+static jmp_buf travel_jmp;
+
+// register blocks, see llsim_schedule_t
+#define LLSIM_REGS_SPACE	(16 << 20)
+#define LLSIM_REGS_ALIGN	16
+static char *regs_old = NULL, *regs_new = NULL;
+static int regs_used = 0;
+
+/*
+ * logging, see llsim_log(). The ring is written by reserving bytes with an
+ * atomic add on log_head, so units can log without a lock. log_head counts
+ * every byte ever logged, the ring holding the last LLSIM_LOG_RING of them.
+ */
+#define LLSIM_LOG_RING		(4 << 20)
+#define LLSIM_LOG_LINE		512
+#define LLSIM_LOG_UNITS		16
+static const char *log_level_names[] = {"off", "error", "info", "debug", "trace"};
+static int log_level = LLSIM_LOG_TRACE;
+static int log_nunits = 0;
+static char *log_unit_names[LLSIM_LOG_UNITS];
+static int log_unit_levels[LLSIM_LOG_UNITS];
+static int log_clocks = 0;		// -r, 0 logs to stdout
+static char *log_ring = NULL;
+static unsigned long long log_head = 0, log_flushed = 0;
+static unsigned long long *log_clock_start;	// log_head as each clock began, by clock % log_clocks
+static volatile sig_atomic_t log_flush_requested = 0;
+
+/*
+ * -j: the units of a clock are handed out to a pool of threads, the main
+ * one included, through an atomic counter, and the memories are committed
+ * once all of them have run
+ */
+static __thread llsim_unit_t *current_unit = NULL;	// the unit running on this thread
+static int pool_next;
+static int pool_arrived;
+static unsigned int pool_generation;
+
+#define LLSIM_POOL_SPIN		2000
+
 void *llsim_malloc(int len)
 {
 	void *p;
@@ -25,13 +73,19 @@ void *llsim_malloc(int len)
 llsim_unit_t *llsim_register_unit(char *name, void (*run) (struct llsim_unit_s *unit))
 {
 	llsim_unit_t *unit;
+	int i;
 
+	llsim_assert(llsim->schedule == NULL, "ERROR: unit %s registered after the design was frozen", name);
 	unit = (llsim_unit_t *) llsim_malloc(sizeof(llsim_unit_t));
 	unit->name = llsim_malloc(strlen(name)+1);
 	strcpy(unit->name, name);
 	unit->run = run;
 	unit->next = llsim->units;
 	unit->regs = NULL;
+	unit->log_level = log_level;
+	for (i = 0; i < log_nunits; i++)
+		if (strcmp(name, log_unit_names[i]) == 0)
+			unit->log_level = log_unit_levels[i];
 	llsim->units = unit;
 	return unit;
 }
@@ -53,18 +107,58 @@ llsim_unit_registers_t *llsim_allocate_registers(llsim_unit_t *unit, char *name,
 {
 	llsim_unit_registers_t *ur;
 
+	llsim_assert(llsim->schedule == NULL, "ERROR: registers %s allocated after the design was frozen", name);
+	if (regs_old == NULL) {
+		// reserved, pages only get backed as blocks use them
+		regs_old = mmap(NULL, LLSIM_REGS_SPACE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		regs_new = mmap(NULL, LLSIM_REGS_SPACE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		llsim_assert(regs_old != MAP_FAILED && regs_new != MAP_FAILED, "out of memory");
+	}
+	llsim_assert(regs_used + size <= LLSIM_REGS_SPACE, "ERROR: no space left for registers %s", name);
+	ur = (llsim_unit_registers_t *) llsim_malloc(sizeof(llsim_unit_registers_t));
+	ur->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(ur->name, name);
+	ur->size = size;
+	ur->old = regs_old + regs_used;
+	ur->new = regs_new + regs_used;
+	regs_used += (size + LLSIM_REGS_ALIGN - 1) & ~(LLSIM_REGS_ALIGN - 1);
+	ur->next = unit->regs;
+	unit->regs = ur;
+	return ur;
+}
+
+llsim_unit_registers_t *llsim_allocate_tracked_registers(llsim_unit_t *unit, char *name, int size)
+{
+	llsim_unit_registers_t *ur;
+	int words = (size + 3) / 4;
+
+	llsim_assert(llsim->schedule == NULL, "ERROR: registers %s allocated after the design was frozen", name);
 	ur = (llsim_unit_registers_t *) llsim_malloc(sizeof(llsim_unit_registers_t));
 	ur->name = (char *) llsim_malloc(strlen(name)+1);
 	strcpy(ur->name, name);
 	ur->size = size;
-	ur->old = (void *) llsim_malloc(size);
-	ur->new = (void *) llsim_malloc(size);
+	ur->old = llsim_malloc(words * 4);
+	ur->new = llsim_malloc(words * 4);
+	ur->tracked = 1;
+	ur->all_dirty = 1;
+	ur->dirty = (int *) llsim_malloc(words * sizeof(int));
+	ur->marked = (unsigned int *) llsim_malloc((words + 31) / 32 * sizeof(int));
 	ur->next = unit->regs;
 	unit->regs = ur;
 	return ur;
 }
 
-void llsim_register_register(char *unit_name, char *reg_name, int bits, int reset_value, void *oldp, void *newp)
+// Offset in ur of a field in either old or new
+static int llsim_field_offset(llsim_unit_registers_t *ur, void *field)
+{
+	if ((char *) field >= (char *) ur->new && (char *) field < (char *) ur->new + ur->size)
+		return (char *) field - (char *) ur->new;
+	llsim_assert((char *) field >= (char *) ur->old && (char *) field < (char *) ur->old + ur->size,
+		     "ERROR: field outside of registers %s", ur->name);
+	return (char *) field - (char *) ur->old;
+}
+
+llsim_register_t *llsim_register_register(char *unit_name, char *reg_name, int bits, int reset_value, void *oldp, void *newp)
 {
 	llsim_unit_t *unit;
 	llsim_register_t *reg, *p;
@@ -81,6 +175,7 @@ void llsim_register_register(char *unit_name, char *reg_name, int bits, int rese
 	reg->reset_value = reset_value;
 	reg->oldp = oldp;
 	reg->newp = newp;
+	reg->size = sizeof(int);
 	reg->next = NULL;
 	if (!unit->registers) {
 		unit->registers = reg;
@@ -90,6 +185,25 @@ void llsim_register_register(char *unit_name, char *reg_name, int bits, int rese
 			p = p->next;
 		p->next = reg;
 	}
+	return reg;
+}
+
+// field points into either old or new of ur
+llsim_register_t *llsim_register_field(llsim_unit_t *unit, llsim_unit_registers_t *ur, char *stage, char *reg_name, int bits,
+				       int reset_value, void *field, int size)
+{
+	llsim_register_t *reg;
+
+	llsim_assert(size == 1 || size == 2 || size == 4, "ERROR: register %s of %d bytes not supported", reg_name, size);
+	reg = llsim_register_register(unit->name, reg_name, bits, reset_value, NULL, NULL);
+	if (stage) {
+		reg->stage = (char *) llsim_malloc(strlen(stage)+1);
+		strcpy(reg->stage, stage);
+	}
+	reg->regs = ur;
+	reg->offset = llsim_field_offset(ur, field);
+	reg->size = size;
+	return reg;
 }
 
 void llsim_register_wire(char *unit_name, char *wire_name, int bits, void *wirep)
@@ -151,6 +265,44 @@ void llsim_register_input(char *unit_name, char *input_name, int bits, void *old
 	}
 }
 
+void llsim_unit_wake_on_register(llsim_unit_t *unit, llsim_unit_registers_t *ur, void *field, int size)
+{
+	llsim_wake_t *wake;
+
+	llsim_assert(unit->nwake < LLSIM_WAKE_MAX, "ERROR: too many wake conditions for unit %s", unit->name);
+	wake = &unit->wake[unit->nwake++];
+	wake->regs = ur;
+	wake->offset = llsim_field_offset(ur, field);
+	wake->size = size;
+}
+
+void llsim_unit_wake_on_memory(llsim_unit_t *unit, llsim_memory_t *mem)
+{
+	llsim_assert(unit->nwake < LLSIM_WAKE_MAX, "ERROR: too many wake conditions for unit %s", unit->name);
+	unit->wake[unit->nwake++].mem = mem;
+}
+
+void llsim_unit_sleep(llsim_unit_t *unit)
+{
+	llsim_wake_t *wake;
+
+	if (!llsim->gating || unit->nwake == 0)
+		return;
+	for (wake = unit->wake; wake < unit->wake + unit->nwake; wake++)
+		if (wake->regs)
+			wake->value = llsim_load((char *) wake->regs->old + wake->offset, wake->size);
+	unit->asleep = 1;
+}
+
+static void llsim_report_gating(void)
+{
+	llsim_unit_t *unit;
+
+	for (unit = llsim->units; unit; unit = unit->next)
+		printf("llsim: unit %s gated %lld of %d clocks (%.1f%%)\n", unit->name, unit->gated, llsim->clock,
+		       llsim->clock ? 100.0 * unit->gated / llsim->clock : 0.0);
+}
+
 int generic_extract_bits(char *p, int msb, int lsb)
 {
 	int byte_pos;
@@ -181,6 +333,7 @@ llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits,
 	llsim_memory_t *mem;
 
 	llsim_assert(bits <= 32, "ERROR: bits %d not supported", bits);
+	llsim_assert(llsim->schedule == NULL, "ERROR: memory %s allocated after the design was frozen", name);
 	mem = (llsim_memory_t *) llsim_malloc(sizeof(llsim_memory_t));
 	mem->entry_size = (bits + 31) / 32;
 	mem->name = (char *) llsim_malloc(strlen(name)+1);
@@ -188,9 +341,12 @@ llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits,
 	mem->bits = bits;
 	mem->height = height;
 	mem->dp = dp;
-	mem->data = (int *) llsim_malloc(height * mem->entry_size * sizeof(int));
-	mem->datain = (int *) llsim_malloc(mem->entry_size);
-	mem->dataout = (int *) llsim_malloc(mem->entry_size);
+	// page aligned and zeroed, so program images can be mapped straight in
+	mem->data = mmap(NULL, height * mem->entry_size * sizeof(int), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	llsim_assert(mem->data != MAP_FAILED, "out of memory");
+	mem->datain = (int *) llsim_malloc(mem->entry_size * sizeof(int));
+	mem->dataout = (int *) llsim_malloc(mem->entry_size * sizeof(int));
 	mem->next = unit->mems;
 	unit->mems = mem;
 	return mem;
@@ -212,8 +368,21 @@ int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb)
 	return generic_extract_bits((char *) p,msb,lsb);
 }
 
+// Claims a port of a memory for the running unit, returns the unit that had it
+static llsim_unit_t *llsim_mem_claim(llsim_unit_t **port)
+{
+	llsim_unit_t *unit = NULL;
+
+	__atomic_compare_exchange_n(port, &unit, current_unit, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return unit;
+}
+
 void llsim_mem_write(llsim_memory_t *memory, int addr)
 {
+	llsim_unit_t *other = llsim_mem_claim(&memory->writer);
+
+	llsim_assert(other == NULL || other == current_unit, "ERROR: conflicting writes to memory %s from units %s and %s\n",
+		     memory->name, other->name, current_unit->name);
 	llsim_assert(!memory->write, "ERROR: multiple memory writes to memory %s", memory->name);
 	memory->write = 1;
 	memory->write_addr = addr;
@@ -221,6 +390,10 @@ void llsim_mem_write(llsim_memory_t *memory, int addr)
 
 void llsim_mem_read(llsim_memory_t *memory, int addr)
 {
+	llsim_unit_t *other = llsim_mem_claim(&memory->reader);
+
+	llsim_assert(other == NULL || other == current_unit, "ERROR: conflicting reads of memory %s from units %s and %s\n",
+		     memory->name, other->name, current_unit->name);
 	llsim_assert(!memory->read, "ERROR: multiple memory reads to memory %s", memory->name);
 	memory->read = 1;
 	memory->read_addr = addr;
@@ -244,57 +417,375 @@ int llsim_mem_extract_dataout(llsim_memory_t *memory, int msb, int lsb)
 	return sbs(*p,msb,lsb);
 }
 
-void llsim_run_clock(void)
+void llsim_freeze(void)
 {
+	llsim_schedule_t *schedule;
 	llsim_unit_t *unit;
 	llsim_unit_registers_t *ur;
 	llsim_memory_t *mem;
+	int i;
+
+	schedule = (llsim_schedule_t *) llsim_malloc(sizeof(llsim_schedule_t));
+	for (unit = llsim->units; unit; unit = unit->next) {
+		schedule->nsteps++;
+		for (mem = unit->mems; mem; mem = mem->next)
+			schedule->nmems++;
+		for (ur = unit->regs; ur; ur = ur->next)
+			schedule->ntracked += ur->tracked;
+	}
+	schedule->steps = (llsim_step_t *) llsim_malloc(schedule->nsteps * sizeof(llsim_step_t) + 1);
+	schedule->mems = (llsim_memory_t **) llsim_malloc(schedule->nmems * sizeof(llsim_memory_t *) + 1);
+	schedule->tracked = (llsim_unit_registers_t **) llsim_malloc(schedule->ntracked * sizeof(llsim_unit_registers_t *) + 1);
+	schedule->nmems = 0;
+	schedule->ntracked = 0;
+	for (unit = llsim->units, i = 0; unit; unit = unit->next, i++) {
+		schedule->steps[i].run = unit->run;
+		schedule->steps[i].unit = unit;
+		for (mem = unit->mems; mem; mem = mem->next)
+			schedule->mems[schedule->nmems++] = mem;
+		schedule->steps[i].mems_end = schedule->nmems;
+		for (ur = unit->regs; ur; ur = ur->next)
+			if (ur->tracked)
+				schedule->tracked[schedule->ntracked++] = ur;
+	}
+	schedule->regs_old = regs_old;
+	schedule->regs_new = regs_new;
+	schedule->regs_size = regs_used;
+	llsim->schedule = schedule;
+}
+
+/*
+ * old and new hold the same words before the clock, so after swapping them
+ * the new one only misses the words written, in either
+ */
+static void llsim_commit_tracked(llsim_unit_registers_t *ur)
+{
+	void *p;
+	int i, w;
+
+	if (ur->all_dirty) {
+		memcpy(ur->old, ur->new, ur->size);
+		ur->all_dirty = 0;
+		for (i = 0; i < ur->ndirty; i++)
+			ur->marked[ur->dirty[i] >> 5] = 0;
+	} else {
+		p = ur->old;
+		ur->old = ur->new;
+		ur->new = p;
+		for (i = 0; i < ur->ndirty; i++) {
+			w = ur->dirty[i];
+			((int *) ur->new)[w] = ((int *) ur->old)[w];
+			ur->marked[w >> 5] = 0;
+		}
+	}
+	ur->ndirty = 0;
+}
+
+static void llsim_commit_memory(llsim_unit_t *unit, llsim_memory_t *mem)
+{
 	int read_done, write_done;
+
+	read_done = mem->read;
+	write_done = mem->write;
+	if (mem->read) {
+		llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
+		*mem->dataout = mem->data[mem->read_addr];
+		llsim_unit_log(unit, LLSIM_LOG_TRACE, "llsim: clock %d: READ MEM %s addr %d --> %08x\n",
+			       llsim->clock, mem->name, mem->read_addr, *mem->dataout);
+		mem->read = 0;
+	}
+	if (mem->write) {
+		llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
+		mem->data[mem->write_addr] = *mem->datain;
+		if (mem->dirty)
+			mem->dirty[mem->write_addr >> LLSIM_PAGE_SHIFT] = 1;
+		llsim_unit_log(unit, LLSIM_LOG_TRACE, "llsim: clock %d: WRITE %08x --> MEM %s addr %d\n",
+			       llsim->clock, *mem->datain, mem->name, mem->write_addr);
+		mem->write = 0;
+	}
+	llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
+	if (!read_done && !write_done)
+		*mem->dataout = 0xBAADBAAD;
+	mem->accessed = read_done || write_done;
+	mem->reader = NULL;
+	mem->writer = NULL;
+}
+
+// Whether a sleeping unit is to run this clock
+static int llsim_unit_woken(llsim_unit_t *unit)
+{
+	llsim_wake_t *wake;
+
+	for (wake = unit->wake; wake < unit->wake + unit->nwake; wake++) {
+		if (wake->regs && llsim_load((char *) wake->regs->old + wake->offset, wake->size) != wake->value)
+			break;
+		if (wake->mem && wake->mem->accessed)
+			break;
+	}
+	if (wake == unit->wake + unit->nwake) {
+		unit->gated++;
+		return 0;
+	}
+	unit->asleep = 0;
+	return 1;
+}
+
+static void llsim_run_step(llsim_step_t *step)
+{
+	if (step->unit->asleep && !llsim_unit_woken(step->unit))
+		return;
+	current_unit = step->unit;
+	step->run(step->unit);
+	current_unit = NULL;
+}
+
+// Runs units until none is left for the clock
+static void llsim_run_steps(llsim_schedule_t *schedule)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool_next, 1, __ATOMIC_RELAXED)) < schedule->nsteps)
+		llsim_run_step(&schedule->steps[i]);
+}
+
+/*
+ * Waits for all the threads. Clocks are short, so it spins for a while
+ * before giving the cpu away.
+ */
+static void llsim_pool_barrier(void)
+{
+	unsigned int generation = __atomic_load_n(&pool_generation, __ATOMIC_ACQUIRE);
+	int spin;
+
+	if (__atomic_add_fetch(&pool_arrived, 1, __ATOMIC_ACQ_REL) == llsim->threads) {
+		pool_arrived = 0;
+		__atomic_store_n(&pool_generation, generation + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	for (spin = 0; __atomic_load_n(&pool_generation, __ATOMIC_ACQUIRE) == generation; spin++)
+		if (spin >= LLSIM_POOL_SPIN)
+			sched_yield();
+}
+
+static void *llsim_worker(void *arg)
+{
+	for (;;) {
+		llsim_pool_barrier();
+		llsim_run_steps(llsim->schedule);
+		llsim_pool_barrier();
+	}
+	return NULL;
+}
+
+// Lowers -j to threads, saying why
+void llsim_limit_threads(int threads, char *why)
+{
+	if (llsim->threads <= threads)
+		return;
+	printf("llsim: -j %d lowered to %d, %s\n", llsim->threads, threads, why);
+	llsim->threads = threads;
+}
+
+/*
+ * Starts the -j pool. Units then only see the memories as they were before
+ * the clock, which is what the two phase model gives them anyway, and
+ * must not write each other's registers.
+ */
+static void llsim_start_pool(void)
+{
+	pthread_t thread;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	// more threads than units would have nothing to run, more than cpus only run slower
+	llsim_limit_threads(llsim->schedule->nsteps, "one thread per unit");
+	if (llsim->threads > cpus)
+		printf("llsim: -j %d on %ld cpus, the threads will wait on each other\n", llsim->threads, cpus);
+	if (llsim->threads <= 1)
+		return;
+	for (i = 1; i < llsim->threads; i++)
+		llsim_assert(pthread_create(&thread, NULL, llsim_worker, NULL) == 0, "ERROR: couldn't start threads");
+}
+
+static void llsim_log_units(llsim_schedule_t *schedule);
+
+void llsim_run_clock(void)
+{
+	llsim_schedule_t *schedule = llsim->schedule;
+	llsim_step_t *step, *end = schedule->steps + schedule->nsteps;
+	llsim_memory_t **memp = schedule->mems;
+	int i;
 	
 	/*
-	 * run units
+	 * run units, on the pool with -j, then the memories
 	 */
-	unit = llsim->units;
-	while (unit) {
-		unit->run(unit);
-
-		// memories
-		mem = unit->mems;
-		while (mem) {
-			read_done = mem->read;
-			write_done = mem->write;
-			if (mem->read) {
-				llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
-				*mem->dataout = mem->data[mem->read_addr];
-				llsim_printf("llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->read_addr, *mem->dataout);
-				mem->read = 0;
-			}
-			if (mem->write) {
-				llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
-				mem->data[mem->write_addr] = *mem->datain;
-				llsim_printf("llsim: clock %d: WRITE %08x --> MEM %s addr %d\n", llsim->clock, *mem->datain, mem->name, mem->write_addr);
-				mem->write = 0;
-			}
-			llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
-			if (!read_done && !write_done)
-				*mem->dataout = 0xBAADBAAD;
-			mem = mem->next;
-		}
-		unit = unit->next;
+	if (llsim->threads > 1) {
+		pool_next = 0;
+		llsim_pool_barrier();
+		llsim_run_steps(schedule);
+		llsim_pool_barrier();
+		llsim_log_units(schedule);
+	} else {
+		for (step = schedule->steps; step < end; step++)
+			llsim_run_step(step);
 	}
+	for (step = schedule->steps; step < end; step++)
+		for (; memp < schedule->mems + step->mems_end; memp++)
+			llsim_commit_memory(step->unit, *memp);
 
 	/*
-	 * copy registers
+	 * copy registers, the untracked blocks at once
 	 */
-	unit = llsim->units;
-	while (unit) {
-		ur = unit->regs;
-		while (ur) {
-			memcpy(ur->old, ur->new, ur->size);
-			ur = ur->next;
-		}
-		unit = unit->next;
+	memcpy(schedule->regs_old, schedule->regs_new, schedule->regs_size);
+	for (i = 0; i < schedule->ntracked; i++)
+		llsim_commit_tracked(schedule->tracked[i]);
+}
+
+static void llsim_log_ring(const char *line, int n)
+{
+	unsigned long long at;
+	int pos, first;
+
+	at = __atomic_fetch_add(&log_head, n, __ATOMIC_RELAXED);
+	pos = at % LLSIM_LOG_RING;
+	first = n < LLSIM_LOG_RING - pos ? n : LLSIM_LOG_RING - pos;
+	memcpy(log_ring + pos, line, first);
+	memcpy(log_ring, line + first, n - first);
+}
+
+void llsim_log_printf(const char *fmt, ...)
+{
+	char line[LLSIM_LOG_LINE];
+	llsim_unit_t *unit = llsim->threads > 1 ? current_unit : NULL;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	if (log_ring == NULL && unit == NULL) {
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n >= (int) sizeof(line))
+		n = sizeof(line) - 1;
+	if (unit == NULL) {
+		llsim_log_ring(line, n);
+		return;
 	}
+	if (unit->log_len + n > unit->log_size) {
+		unit->log_size = 2 * (unit->log_len + n);
+		unit->log = realloc(unit->log, unit->log_size);
+		llsim_assert(unit->log != NULL, "out of memory");
+	}
+	memcpy(unit->log + unit->log_len, line, n);
+	unit->log_len += n;
+}
+
+// -j: what the units logged this clock, in the order one thread would have logged it
+static void llsim_log_units(llsim_schedule_t *schedule)
+{
+	llsim_unit_t *unit;
+	int i, n;
+
+	for (i = 0; i < schedule->nsteps; i++) {
+		unit = schedule->steps[i].unit;
+		if (unit->log_len == 0)
+			continue;
+		if (log_ring == NULL)
+			fwrite(unit->log, 1, unit->log_len, stdout);
+		else
+			for (n = 0; n < unit->log_len; n += LLSIM_LOG_LINE)
+				llsim_log_ring(unit->log + n, unit->log_len - n < LLSIM_LOG_LINE ? unit->log_len - n : LLSIM_LOG_LINE);
+		unit->log_len = 0;
+	}
+}
+
+// The ring from the first of the last log_clocks clocks, or what was logged since the previous flush
+void llsim_log_flush(void)
+{
+	unsigned long long start, end = log_head;
+	int pos, first, oldest;
+
+	if (log_ring == NULL || llsim == NULL)
+		return;
+	oldest = llsim->clock - log_clocks + 1;
+	start = log_clock_start[(llsim->clock + 1) % log_clocks];
+	if (oldest < 0) {
+		oldest = 0;
+		start = 0;
+	}
+	if (start < log_flushed)
+		start = log_flushed;
+	if (end - start > LLSIM_LOG_RING) {
+		start = end - LLSIM_LOG_RING;
+		printf("llsim: log of clocks %d to %d, older lines lost\n", oldest, llsim->clock);
+	} else {
+		printf("llsim: log of clocks %d to %d\n", oldest, llsim->clock);
+	}
+	fflush(stdout);
+	pos = start % LLSIM_LOG_RING;
+	first = end - start < LLSIM_LOG_RING - pos ? end - start : LLSIM_LOG_RING - pos;
+	fwrite(log_ring + pos, 1, first, stdout);
+	fwrite(log_ring, 1, end - start - first, stdout);
+	printf("llsim: end of log\n");
+	fflush(stdout);
+	log_flushed = end;
+}
+
+static void llsim_log_clock(void)
+{
+	if (log_ring)
+		log_clock_start[llsim->clock % log_clocks] = log_head;
+}
+
+// after the clock, so that it is in the log
+static void llsim_log_poll(void)
+{
+	if (log_flush_requested) {
+		log_flush_requested = 0;
+		llsim_log_flush();
+	}
+}
+
+static void llsim_log_request_flush(int sig)
+{
+	log_flush_requested = 1;
+}
+
+// -l [unit=]level, the level by name or number
+static int llsim_log_option(char *spec)
+{
+	char *level = strchr(spec, '=');
+	int i, n;
+
+	level = level ? level + 1 : spec;
+	for (n = 0; n <= LLSIM_LOG_TRACE && strcmp(level, log_level_names[n]) != 0; n++)
+		;
+	if (n > LLSIM_LOG_TRACE && (sscanf(level, "%d", &n) != 1 || n < 0 || n > LLSIM_LOG_TRACE))
+		return -1;
+	if (level == spec) {
+		log_level = n;
+		return 0;
+	}
+	if (log_nunits == LLSIM_LOG_UNITS)
+		return -1;
+	i = log_nunits++;
+	log_unit_names[i] = spec;
+	log_unit_names[i][level - 1 - spec] = '\0';
+	log_unit_levels[i] = n;
+	return 0;
+}
+
+static void llsim_log_init(void)
+{
+	llsim->log_level = log_level;
+	if (log_clocks == 0)
+		return;
+	log_ring = llsim_malloc(LLSIM_LOG_RING);
+	log_clock_start = llsim_malloc(log_clocks * sizeof(unsigned long long));
+	signal(SIGUSR1, llsim_log_request_flush);
 }
 
 static void llsim_init_units(char *program_name)
@@ -302,11 +793,24 @@ static void llsim_init_units(char *program_name)
 	llsim->units = NULL;
 	llsim->clock = 0;
 	sp_init(program_name);
+	llsim_freeze();
+	llsim_start_pool();
 }
 
-static void llsim_init(char *program_name)
+static void llsim_init(char *program_name, int threads, int gating, char *resume, int travel[2], char *wave, char *ctrace)
 {
 	llsim = llsim_malloc(sizeof(llsim_t));
+	llsim->resume = resume;
+	llsim->threads = threads;
+	llsim->gating = gating;
+	llsim->travel = travel[0];
+	llsim->travel_window = travel[1];
+	llsim->wave = wave;
+	llsim->ctrace = ctrace;
+	// a failure jumps back out of its unit, which has to run on this thread
+	if (llsim->travel)
+		llsim_limit_threads(1, "time travel runs the units on one thread");
+	llsim_log_init();
 	llsim_init_units(program_name);
 }
 
@@ -322,7 +826,7 @@ static void llsim_init_reset_values(void)
 	while (unit) {
 		reg = unit->registers;
 		while (reg) {
-			* (int *) reg->newp = reg->reset_value;
+			llsim_register_set(reg, reg->reset_value);
 			reg = reg->next;
 		}
 		unit = unit->next;
@@ -334,32 +838,164 @@ void llsim_stop(void)
 	stop_sim = 1;
 }
 
-int main(int argc, char **argv)
+static void llsim_clock(void)
 {
-	int i;
+	if (llsim->clock == travel_next) {
+		llsim_snapshot();
+		travel_next = llsim->clock + llsim->travel;
+	}
+	if (llsim->wave)
+		llsim_wave_clock();
+	if (llsim->ctrace)
+		llsim_ctrace_clock();
+	llsim_log_clock();
+	llsim_log(LLSIM_LOG_DEBUG, ">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
+	llsim_run_clock();
+	llsim_log_poll();
+	llsim->clock++;
+}
 
-	llsim_init(argv[1]);
+// Between clocks, returns -1 if clock is before the first snapshot
+int llsim_travel(int clock)
+{
+	int at;
+
+	if (clock < llsim->clock) {
+		at = llsim_snapshot_restore(clock);
+		if (at < 0)
+			return -1;
+		travel_next = at + llsim->travel;
+		stop_sim = 0;
+		if (llsim->wave)
+			llsim_wave_restart();
+	}
+	while (llsim->clock < clock && !stop_sim)
+		llsim_clock();
+	return 0;
+}
 
-	llsim_printf("llsim: starting simulation\n");
-	llsim->reset = 1;
+void llsim_travel_failed(void)
+{
+	if (llsim == NULL || !llsim->travel || llsim->replaying || !travel_armed)
+		return;
+	travel_failed = llsim->clock;
+	longjmp(travel_jmp, 1);
+}
 
-	// init registers
-	llsim_init_reset_values();
+// Back from a failure, quietly to the window before it
+static void llsim_travel_back(void)
+{
+	llsim_unit_t *unit;
+	int from = travel_failed - llsim->travel_window;
+
+	current_unit = NULL;
+	if (from < travel_first)
+		from = travel_first;
+	printf("llsim: clock %d: going back to clock %d, running on from there at trace level\n", travel_failed, from);
+	llsim->log_level = LLSIM_LOG_OFF;
+	for (unit = llsim->units; unit; unit = unit->next)
+		unit->log_level = LLSIM_LOG_OFF;
+	llsim_travel(from);
+	llsim->log_level = LLSIM_LOG_TRACE;
+	for (unit = llsim->units; unit; unit = unit->next)
+		unit->log_level = LLSIM_LOG_TRACE;
+	llsim->replaying = 1;
+}
 
-	for (i = 0; i < 5; i++) {
-		llsim_run_clock();
-		llsim->clock++;
+int main(int argc, char **argv)
+{
+	char *checkpoint = NULL, *resume = NULL, *wave = NULL, *ctrace = NULL;
+	int threads = 1, gating = 0, checkpoint_clock = -1;
+	int travel[2] = {0, 100};
+	int i, n;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-C") == 0 && i + 1 < argc - 1 && sscanf(argv[i + 1], "%d,%n", &checkpoint_clock, &n) == 1 &&
+			 n > 0 && argv[i + 1][n] != '\0' && checkpoint_clock >= 5)
+			checkpoint = argv[++i] + n;
+		else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc - 1)
+			resume = argv[++i];
+		else if (strcmp(argv[i], "-g") == 0)
+			gating = 1;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - 1 && sscanf(argv[i + 1], "%d", &threads) == 1 && threads > 0)
+			i++;
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc - 1 && llsim_log_option(argv[i + 1]) == 0)
+			i++;
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc - 1 && sscanf(argv[i + 1], "%d", &log_clocks) == 1 &&
+			 log_clocks > 0)
+			i++;
+		else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc - 1 &&
+			 sscanf(argv[i + 1], "%d,%d", &travel[0], &travel[1]) >= 1 && travel[0] > 0 && travel[1] >= 0)
+			i++;
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc - 1)
+			wave = argv[++i];
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc - 1)
+			ctrace = argv[++i];
+		else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc - 1 && llsim_wave_filter(argv[i + 1]) == 0)
+			i++;
+		else if ((n = sp_option(argv[i], i + 1 < argc - 1 ? argv[i + 1] : NULL)) > 0)
+			i += n - 1;
+		else
+			break;
+	}
+	if (argc < 2 || i != argc - 1) {
+		printf("usage: llsim [-g] [-j threads] [-l [unit=]level]... [-r clocks]\n");
+		printf("             [-C clock,checkpoint_file] [-R checkpoint_file] [-T interval[,window]]\n");
+		printf("             [-w wave_file[.gz]] [-t cycle_trace_file] [-W [-]pattern]... [design options] program_name\n");
+		printf("  levels: off, error, info, debug, trace\n");
+		printf("  -C saves the run as the clock begins, from the end of reset (clock 5) on, -R goes on from there\n");
+		printf("  -T snapshots every interval clocks, and an assertion failure runs its last window clocks (100) again traced\n");
+		printf("  -W picks the registers -w and -t dump by unit.stage.name, - leaving them out, the last match decides\n");
+		sp_usage();
+		return 1;
+	}
+	llsim_init(argv[argc - 1], threads, gating, resume, travel, wave, ctrace);
+	if (wave && llsim_wave_open(wave) != 0)
+		return 1;
+	if (ctrace && llsim_ctrace_open(ctrace) != 0)
+		return 1;
+
+	llsim_log(LLSIM_LOG_INFO, "llsim: starting simulation\n");
+	if (resume) {
+		if (llsim_restore(resume) != 0)
+			return 1;
+	} else {
+		llsim->reset = 1;
+
+		// init registers
+		llsim_init_reset_values();
+
+		for (i = 0; i < 5; i++) {
+			if (llsim->wave)
+				llsim_wave_clock();
+			if (llsim->ctrace)
+				llsim_ctrace_clock();
+			llsim_log_clock();
+			llsim_run_clock();
+			llsim_log_poll();
+			llsim->clock++;
+		}
+		llsim->reset = 0;
+	}
+	if (llsim->travel) {
+		travel_first = llsim->clock;
+		travel_next = llsim->clock;
+		if (setjmp(travel_jmp) != 0)
+			llsim_travel_back();
+		travel_armed = 1;
 	}
-	llsim->reset = 0;
 	while (!stop_sim) {
-		printf(">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
-		llsim_run_clock();
-		llsim->clock++;
+		if (llsim->clock == checkpoint_clock && llsim_checkpoint(checkpoint) != 0)
+			return 1;
+		llsim_clock();
 		/*
 		if ((llsim->clock % 1000000) == 0)
 			printf("clock %d\n", llsim->clock);
 		*/
 	}
+	if (llsim->gating)
+		llsim_report_gating();
+	llsim_wave_close();
 	return 0;
 }
 
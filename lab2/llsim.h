@@ -2,7 +2,16 @@
 #define _LLSIM_H_
 typedef long long i64;
 
+/*
+ * the design. sp_init() registers its units. The options llsim doesn't
+ * take itself go to sp_option(), with the argument after them or NULL
+ * when only the program name follows, which returns how many of the two
+ * it took, 0 if the option isn't the design's. sp_usage() adds its lines
+ * to llsim's usage.
+ */
 void sp_init(char *program_name);
+int sp_option(char *option, char *arg);
+void sp_usage(void);
 
 /*
  * support functions
@@ -10,17 +19,50 @@ void sp_init(char *program_name);
 #define llsim_assert(cond, args...)					\
 	do {								\
 		if (!(cond)) {						\
+			llsim_log_flush();				\
 			printf("llsim: clock %d: assertion failed at file %s line %d: ", llsim->clock, __FILE__, __LINE__); \
 			printf(args);					\
+			llsim_travel_failed();				\
 			exit (1);					\
 		}							\
 	} while (0);							\
 
 #define llsim_printf	printf
 
+/*
+ * logging. Messages have a level and are kept when it is at most the level
+ * of their unit, or of llsim for the ones of the simulator itself, which
+ * -l [unit=]level sets (trace by default, everything). The arguments are
+ * only evaluated for messages kept. With -r clocks they go to a ring in
+ * memory holding the last clocks rather than to stdout, written out by
+ * llsim_log_flush() on assertion failures, cosim mismatches and SIGUSR1.
+ * Under -j each unit's lines are held until the clock's units have run,
+ * then written in schedule order, as one thread would have.
+ */
+#define LLSIM_LOG_OFF	0
+#define LLSIM_LOG_ERROR	1
+#define LLSIM_LOG_INFO	2	// once per run
+#define LLSIM_LOG_DEBUG	3	// once per clock
+#define LLSIM_LOG_TRACE	4	// every memory access
+
+#define llsim_log(level, args...)					\
+	do {								\
+		if ((level) <= llsim->log_level)			\
+			llsim_log_printf(args);				\
+	} while (0)
+
+#define llsim_unit_log(unit, level, args...)				\
+	do {								\
+		if ((level) <= (unit)->log_level)			\
+			llsim_log_printf(args);				\
+	} while (0)
+
+void llsim_log_printf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void llsim_log_flush(void);
+
 #define llsim_error(args...) llsim_assert(0, args)
 
-static inline int bitmask0(bits)
+static inline int bitmask0(int bits)
 {
 	if (bits == 32)
 		return -1;
@@ -107,14 +149,54 @@ static inline int cb(int val, int pos)
 
 /*
  * simulated unit registers
+ *
+ * Blocks from llsim_allocate_tracked_registers() are written through
+ * llsim_set() or followed by llsim_mark(), and the clock commits them by
+ * swapping old and new and copying back only the words written, so they
+ * cost what changed rather than their size. old and new trade places every
+ * clock, units keep the block rather than the pointers.
  */
 typedef struct llsim_unit_registers_s {
 	char *name;
 	int size;
 	void *old,*new;
+	int tracked;
+	int all_dirty;		// commit every word, set until the first clock
+	int ndirty;
+	int *dirty;		// words written this clock, by index
+	unsigned int *marked;	// bitmap of the words in dirty
 	struct llsim_unit_registers_s *next;
 } llsim_unit_registers_t;
 
+// p points into either old or new
+static inline void llsim_mark(llsim_unit_registers_t *ur, void *p, int size)
+{
+	char *base = ur->new;
+	int w, end;
+
+	if (ur->all_dirty)
+		return;
+	if (size >= ur->size) {
+		ur->all_dirty = 1;
+		return;
+	}
+	if ((char *) p < base || (char *) p >= base + ur->size)
+		base = ur->old;
+	end = ((char *) p - base + size + 3) >> 2;
+	for (w = ((char *) p - base) >> 2; w < end; w++) {
+		if (!(ur->marked[w >> 5] & (1u << (w & 31)))) {
+			ur->marked[w >> 5] |= 1u << (w & 31);
+			ur->dirty[ur->ndirty++] = w;
+		}
+	}
+}
+
+#define llsim_set(ur, lhs, value)				\
+	do {							\
+		(lhs) = (value);				\
+		llsim_mark((ur), &(lhs), sizeof(lhs));		\
+	} while (0)
+
 /*
  * memory
  */
@@ -132,10 +214,18 @@ typedef struct llsim_memory_s {
 	int write_addr;
 	int *datain;
 	int *dataout;
+	struct llsim_unit_s *reader, *writer;	// this clock, to catch units conflicting under -j
+	int accessed;		// had a request last clock, for the units sleeping on it
+	unsigned char *dirty;	// -T: pages written since the last snapshot
 
 	struct llsim_memory_s *next;
 } llsim_memory_t;
 
+/*
+ * the register registry. llsim_register_field() describes a field of a
+ * register block by its offset, which holds across the swaps of tracked
+ * blocks, where llsim_register_register() takes plain int pointers.
+ */
 typedef struct llsim_register_s {
 	char *unit_name;
 	char *reg_name;
@@ -143,9 +233,54 @@ typedef struct llsim_register_s {
 	int reset_value;
 	void *oldp;
 	void *newp;
+	char *stage;			// llsim_register_field(), NULL if not given
+	llsim_unit_registers_t *regs;
+	int offset;
+	int size;			// bytes, 1, 2 or 4
 	struct llsim_register_s *next;
 } llsim_register_t;
 
+static inline void *llsim_register_old(llsim_register_t *reg)
+{
+	return reg->regs ? (char *) reg->regs->old + reg->offset : reg->oldp;
+}
+
+static inline void *llsim_register_new(llsim_register_t *reg)
+{
+	return reg->regs ? (char *) reg->regs->new + reg->offset : reg->newp;
+}
+
+// A field of 1, 2 or 4 bytes
+static inline int llsim_load(void *p, int size)
+{
+	if (size == 1)
+		return *(unsigned char *) p;
+	if (size == 2)
+		return *(unsigned short *) p;
+	return *(int *) p;
+}
+
+// The value in old
+static inline int llsim_register_value(llsim_register_t *reg)
+{
+	return llsim_load(llsim_register_old(reg), reg->size);
+}
+
+// Sets the value in new
+static inline void llsim_register_set(llsim_register_t *reg, int value)
+{
+	void *p = llsim_register_new(reg);
+
+	if (reg->size == 1)
+		*(unsigned char *) p = value;
+	else if (reg->size == 2)
+		*(unsigned short *) p = value;
+	else
+		*(int *) p = value;
+	if (reg->regs && reg->regs->tracked)
+		llsim_mark(reg->regs, p, reg->size);
+}
+
 typedef struct llsim_output_s {
 	char *unit_name;
 	char *output_name;
@@ -164,6 +299,36 @@ typedef struct llsim_input_s {
 	struct llsim_input_s *next;
 } llsim_input_t;
 
+/*
+ * clock gating. A unit that has nothing to do calls llsim_unit_sleep() and
+ * is skipped from the next clock on, until one of its wake conditions
+ * holds when its turn comes: a watched register field differs from what the
+ * unit saw in old as it fell asleep, or a watched memory had a request the
+ * clock before. Both are state from before the clock, which the other units
+ * can't change under it, so a unit wakes on the same clock whatever the
+ * schedule and -j. Sleeping only takes effect with -g.
+ */
+#define LLSIM_WAKE_MAX	8
+
+typedef struct llsim_wake_s {
+	llsim_unit_registers_t *regs;	// a register field, or
+	int offset;
+	int size;
+	int value;
+	llsim_memory_t *mem;		// a memory
+} llsim_wake_t;
+
+/*
+ * state a unit keeps outside of its registers and memories, which
+ * checkpoints save and restore as it is
+ */
+typedef struct llsim_private_s {
+	char *name;
+	void *p;
+	int size;
+	struct llsim_private_s *next;
+} llsim_private_t;
+
 /*
  * simulated unit
  */
@@ -176,31 +341,135 @@ typedef struct llsim_unit_s {
 	llsim_register_t *registers;
 	llsim_output_t *outputs;
 	llsim_input_t *inputs;
+	int log_level;
+	char *log;		// -j: the lines it logged this clock, written in schedule order
+	int log_len, log_size;
+	int asleep;
+	int nwake;
+	llsim_wake_t wake[LLSIM_WAKE_MAX];
+	i64 gated;		// clocks skipped asleep
+	llsim_private_t *privates;
 	struct llsim_unit_s *next;
 } llsim_unit_t;
 
+/*
+ * the design frozen by llsim_freeze() once the units are registered: what
+ * llsim_run_clock() does every clock, laid out in arrays so it walks no
+ * lists. Untracked register blocks are allocated back to back, old ones in
+ * one area and new ones in another, so their old <- new copy is a single
+ * memcpy.
+ */
+typedef struct llsim_step_s {
+	void (*run) (struct llsim_unit_s *unit);
+	llsim_unit_t *unit;
+	int mems_end;		// the unit's memories end before schedule->mems[mems_end]
+} llsim_step_t;
+
+typedef struct llsim_schedule_s {
+	int nsteps;
+	llsim_step_t *steps;	// in the order the units list ran them
+	int nmems;
+	llsim_memory_t **mems;
+	char *regs_old;		// untracked blocks
+	char *regs_new;
+	int regs_size;
+	int ntracked;
+	llsim_unit_registers_t **tracked;
+} llsim_schedule_t;
+
 /*
  * chip simulator main structure
  */
 typedef struct llsim_s {
 	llsim_unit_t *units;
+	llsim_schedule_t *schedule;	// NULL until llsim_freeze()
 	int clock;
 	int reset;
+	int log_level;		// -l level, of the simulator's own messages
+	int threads;		// -j: units run on this many threads, see llsim_run_clock()
+	int gating;		// -g: units may sleep
+	char *resume;		// -R: the run goes on from this checkpoint rather than from reset
+	int travel;		// -T interval,window: clocks between snapshots, 0 when off
+	int travel_window;	// clocks traced before a failure
+	int replaying;		// running up to a failure again, see llsim_travel_failed()
+	char *wave;		// -w: the registers' value changes to this file, see wave.c
+	char *ctrace;		// -t: the registers at every clock to this binary cycle trace
 } llsim_t;
 
-llsim_t *llsim;
+extern llsim_t *llsim;
 
 void *llsim_malloc(int len);
 llsim_unit_t *llsim_register_unit(char *name, void (*run) (struct llsim_unit_s *unit));
 llsim_unit_t *llsim_find_unit(char *name);
 llsim_unit_registers_t *llsim_allocate_registers(llsim_unit_t *unit, char *name, int size);
+llsim_unit_registers_t *llsim_allocate_tracked_registers(llsim_unit_t *unit, char *name, int size);
 int generic_extract_bits(char *p, int msb, int lsb);
 void generic_inject_bits(char *p, int data, int msb, int lsb);
-void llsim_register_register(char *unit_name, char *reg_name, int bits, int reset_value, void *oldp, void *newp);
+llsim_register_t *llsim_register_register(char *unit_name, char *reg_name, int bits, int reset_value, void *oldp, void *newp);
+llsim_register_t *llsim_register_field(llsim_unit_t *unit, llsim_unit_registers_t *ur, char *stage, char *reg_name, int bits,
+				       int reset_value, void *field, int size);
 void llsim_register_wire(char *unit_name, char *wire_name, int bits, void *wirep);
 void llsim_register_output(char *unit_name, char *output_name, int bits, void *oldp, void *newp);
 void llsim_register_input(char *unit_name, char *input_name, int bits, void *oldp, void *newp);
 void llsim_stop(void);
+void llsim_freeze(void);
+void llsim_unit_wake_on_register(llsim_unit_t *unit, llsim_unit_registers_t *ur, void *field, int size);
+void llsim_unit_wake_on_memory(llsim_unit_t *unit, llsim_memory_t *mem);
+void llsim_unit_sleep(llsim_unit_t *unit);
+void llsim_limit_threads(int threads, char *why);
+
+/*
+ * checkpoints, see checkpoint.c. Both return 0 or -1, after saying why.
+ */
+void llsim_checkpoint_private(llsim_unit_t *unit, char *name, void *p, int size);
+int llsim_checkpoint(char *filename);
+int llsim_restore(char *filename);
+
+/*
+ * time travel. With -T, llsim takes a snapshot in memory every interval
+ * clocks, each holding only the memory pages written since the one
+ * before, and llsim_travel() goes back to any clock since the first by
+ * restoring the snapshot at or before it and running on from there. The
+ * snapshots a failure's window may need are kept, and a few older ones,
+ * further apart the older they are. When
+ * an assertion fails, llsim_travel_failed() goes back the window and runs
+ * up to it again with every log level at trace and llsim->replaying set.
+ * Files given to llsim_travel_file() are cut back along with the design.
+ */
+#define LLSIM_PAGE_SHIFT	10	// memory pages of 1K entries
+
+void llsim_travel_file(FILE *fp);
+void llsim_snapshot(void);
+int llsim_snapshot_restore(int clock);
+int llsim_travel(int clock);
+void llsim_travel_failed(void);
+
+// Whether units write their per clock traces, with -T only when replaying
+static inline int llsim_tracing(void)
+{
+	return !llsim->travel || llsim->replaying;
+}
+
+/*
+ * waveforms, see wave.c. With -w file, llsim dumps the registers of the
+ * registry as they change, as a VCD. -W [-]pattern, any number of times,
+ * picks them by unit.stage.name (unit.name without a stage) as fnmatch(3)
+ * patterns, "-" leaving them out, so that -W 'sp.exec*' or -W '-*.dma.*'.
+ */
+int llsim_wave_filter(char *pattern);
+int llsim_wave_open(char *filename);
+void llsim_wave_clock(void);
+void llsim_wave_restart(void);
+void llsim_wave_close(void);
+
+/*
+ * the binary cycle trace of -t file, see lab1/ctrace.h, which holds the
+ * registers -W picks at every clock, by column, for scripts to read a
+ * signal over a range of clocks through the ctrace reader
+ */
+int llsim_ctrace_open(char *filename);
+void llsim_ctrace_clock(void);
+void llsim_ctrace_close(void);
 
 /*
  * memories
@@ -7,11 +7,15 @@
 #include <netinet/in.h>
 
 #include "llsim.h"
+#include "image.h"
+#include "spasm.h"
 
-#define sp_printf(a...)        					\
+#define sp_printf(a...)						\
 	do {							\
-		llsim_printf("sp: clock %d: ", llsim->clock);	\
-		llsim_printf(a);				\
+		if (LLSIM_LOG_DEBUG <= sp->unit->log_level) {	\
+			llsim_log_printf("sp: clock %d: ", llsim->clock); \
+			llsim_log_printf(a);			\
+		}						\
 	} while (0)
 
 int nr_simulated_instructions = 0;
@@ -109,9 +113,10 @@ typedef struct sp_s {
 #define SP_SRAM_HEIGHT	64 * 1024
 	llsim_memory_t *sram;
 
-	unsigned int memory_image[SP_SRAM_HEIGHT];
 	int memory_image_size;
+	int entry; // pc of the first instruction
 
+	llsim_unit_t *unit;
 	sp_registers_t *spro, *sprn;
 	
 	int start;
@@ -187,27 +192,30 @@ static void sp_ctl(sp_t *sp)
 
   // sp_ctl
 
-  fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
-  for (i = 2; i <= 7; i++)
-    fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
-  fprintf(cycle_trace_fp, "pc %08x\n", spro->pc);
-  fprintf(cycle_trace_fp, "inst %08x\n", spro->inst);
-  fprintf(cycle_trace_fp, "opcode %08x\n", spro->opcode);
-  fprintf(cycle_trace_fp, "dst %08x\n", spro->dst);
-  fprintf(cycle_trace_fp, "src0 %08x\n", spro->src0);
-  fprintf(cycle_trace_fp, "src1 %08x\n", spro->src1);
-  fprintf(cycle_trace_fp, "immediate %08x\n", spro->immediate);
-  fprintf(cycle_trace_fp, "alu0 %08x\n", spro->alu0);
-  fprintf(cycle_trace_fp, "alu1 %08x\n", spro->alu1);
-  fprintf(cycle_trace_fp, "aluout %08x\n", spro->aluout);
-  fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
-  fprintf(cycle_trace_fp, "ctl_state %08x\n\n", spro->ctl_state);
+  // with llsim -T, only the clocks run again before a failure
+  if (llsim_tracing()) {
+    fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
+    for (i = 2; i <= 7; i++)
+      fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
+    fprintf(cycle_trace_fp, "pc %08x\n", spro->pc);
+    fprintf(cycle_trace_fp, "inst %08x\n", spro->inst);
+    fprintf(cycle_trace_fp, "opcode %08x\n", spro->opcode);
+    fprintf(cycle_trace_fp, "dst %08x\n", spro->dst);
+    fprintf(cycle_trace_fp, "src0 %08x\n", spro->src0);
+    fprintf(cycle_trace_fp, "src1 %08x\n", spro->src1);
+    fprintf(cycle_trace_fp, "immediate %08x\n", spro->immediate);
+    fprintf(cycle_trace_fp, "alu0 %08x\n", spro->alu0);
+    fprintf(cycle_trace_fp, "alu1 %08x\n", spro->alu1);
+    fprintf(cycle_trace_fp, "aluout %08x\n", spro->aluout);
+    fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
+    fprintf(cycle_trace_fp, "ctl_state %08x\n\n", spro->ctl_state);
+  }
 
   sprn->cycle_counter = spro->cycle_counter + 1;
 
   switch (spro->ctl_state) {
   case CTL_STATE_IDLE:
-    sprn->pc = 0;
+    sprn->pc = sp->entry;
     if (sp->start)
       sprn->ctl_state = CTL_STATE_FETCH0;
     break;
@@ -562,7 +570,35 @@ static void sp_run(llsim_unit_t *unit)
 static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
 {
         FILE *fp;
-        int addr, i;
+        int addr;
+	spasm_result_t result;
+
+	// sources are assembled straight into the sram
+	if (spasm_is_source(program_name)) {
+		if (spasm_assemble_file(program_name, (unsigned int *) sp->sram->data, SP_SRAM_HEIGHT, 0, &result) != 0) {
+			printf("%s\n", result.error);
+			exit(1);
+		}
+		sp->memory_image_size = result.size;
+		sp->entry = result.entry;
+		fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, sp->memory_image_size);
+		return;
+	}
+
+	// binary images are mapped into the sram, no per word parsing
+	switch (image_load(program_name, (unsigned int *) sp->sram->data, SP_SRAM_HEIGHT, &sp->memory_image_size, &sp->entry)) {
+	case 0:
+		fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, sp->memory_image_size);
+		return;
+	case IMAGE_NOT_IMAGE:
+		break;
+	case -1:
+		printf("couldn't open file %s\n", program_name);
+		exit(1);
+	default:
+		printf("couldn't load file %s\n", program_name);
+		exit(1);
+	}
 
         fp = fopen(program_name, "r");
         if (fp == NULL) {
@@ -571,17 +607,15 @@ static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
         }
         addr = 0;
         while (addr < SP_SRAM_HEIGHT) {
-                fscanf(fp, "%08x\n", &sp->memory_image[addr]);
+                fscanf(fp, "%08x\n", (unsigned int *) &sp->sram->data[addr]);
                 addr++;
                 if (feof(fp))
                         break;
         }
+	fclose(fp);
 	sp->memory_image_size = addr;
 
         fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, addr);
-
-	for (i = 0; i < sp->memory_image_size; i++)
-		llsim_mem_inject(sp->sram, i, sp->memory_image[i], 31, 0);
 }
 
 static void sp_register_all_registers(sp_t *sp)
@@ -612,13 +646,23 @@ static void sp_register_all_registers(sp_t *sp)
 	llsim_register_register("sp", "ctl_state", 3, 0, &spro->ctl_state, &sprn->ctl_state);
 }
 
+// no options of its own
+int sp_option(char *option, char *arg)
+{
+	return 0;
+}
+
+void sp_usage(void)
+{
+}
+
 void sp_init(char *program_name)
 {
 	llsim_unit_t *llsim_sp_unit;
 	llsim_unit_registers_t *llsim_ur;
 	sp_t *sp;
 
-	llsim_printf("initializing sp unit\n");
+	llsim_log(LLSIM_LOG_INFO, "initializing sp unit\n");
 
 	inst_trace_fp = fopen("inst_trace.txt", "w");
 	if (inst_trace_fp == NULL) {
@@ -642,6 +686,7 @@ void sp_init(char *program_name)
 	llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
 	sp = llsim_malloc(sizeof(sp_t));
 	llsim_sp_unit->private = sp;
+	sp->unit = llsim_sp_unit;
 	sp->spro = llsim_ur->old;
 	sp->sprn = llsim_ur->new;
 
@@ -650,5 +695,13 @@ void sp_init(char *program_name)
 
 	sp->start = 1;
 
+	// state outside the registers and sram, for llsim -C and -R
+	llsim_checkpoint_private(llsim_sp_unit, "nr_simulated_instructions", &nr_simulated_instructions, sizeof(int));
+	llsim_checkpoint_private(llsim_sp_unit, "start", &sp->start, sizeof(int));
+	// and the traces, cut back with the design by llsim -T
+	llsim_travel_file(inst_trace_fp);
+	llsim_travel_file(cycle_trace_fp);
+	llsim_travel_file(dma_trace_fp);
+
 	sp_register_all_registers(sp);
 }
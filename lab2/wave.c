@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+#include "llsim.h"
+#include "ctrace.h"
+
+/*
+ * llsim waveforms: the registers of the registry as a value change dump
+ * (VCD, IEEE 1364), which GTKWave and the like open. A scope per unit, in
+ * it one per stage, and a value only when it changed, stamped with the
+ * clock it holds during. Names ending in .gz go through gzip, GTKWave reads
+ * those as they are. The same registers also go to the binary cycle trace
+ * of -t, see ctrace.h.
+ */
+#define WAVE_FILTERS	32
+#define WAVE_NAME	128
+
+typedef struct {
+	llsim_register_t *reg;
+	unsigned int mask;
+	unsigned int value;	// as last written
+	char id[8];
+} wave_signal_t;
+
+static char *filters[WAVE_FILTERS];
+static int nfilters;
+
+static FILE *wave_fp;
+static int wave_pipe;
+static wave_signal_t *signals;
+static int nsignals;
+static int wave_valid;		// values as last written, else all are written
+
+static ctrace_writer_t *ctrace;
+static unsigned int *ctrace_values;
+
+// -W [-]pattern
+int llsim_wave_filter(char *pattern)
+{
+	if (nfilters == WAVE_FILTERS || pattern[0] == '\0' || strcmp(pattern, "-") == 0)
+		return -1;
+	filters[nfilters++] = pattern;
+	return 0;
+}
+
+/*
+ * Filters go in order and the last one to match a name decides, a
+ * register none matches is in unless the first filter picks some in.
+ */
+static int wave_selected(char *name)
+{
+	int i, selected = nfilters == 0 || filters[0][0] == '-';
+
+	for (i = 0; i < nfilters; i++) {
+		if (filters[i][0] == '-' && fnmatch(filters[i] + 1, name, 0) == 0)
+			selected = 0;
+		else if (filters[i][0] != '-' && fnmatch(filters[i], name, 0) == 0)
+			selected = 1;
+	}
+	return selected;
+}
+
+static void wave_name(llsim_register_t *reg, char *name)
+{
+	if (reg->stage)
+		snprintf(name, WAVE_NAME, "%s.%s.%s", reg->unit_name, reg->stage, reg->reg_name);
+	else
+		snprintf(name, WAVE_NAME, "%s.%s", reg->unit_name, reg->reg_name);
+}
+
+// The short code a signal goes by, in the printable characters
+static void wave_id(int n, char *id)
+{
+	do {
+		*id++ = '!' + n % 94;
+		n /= 94;
+	} while (n);
+	*id = '\0';
+}
+
+static void wave_value(wave_signal_t *signal)
+{
+	char bits[33], *p = bits + 32;
+	unsigned int value = signal->value;
+
+	if (signal->reg->bits == 1) {
+		fprintf(wave_fp, "%u%s\n", value, signal->id);
+		return;
+	}
+	*p = '\0';
+	do {
+		*--p = '0' + (value & 1);
+		value >>= 1;
+	} while (value);
+	fprintf(wave_fp, "b%s %s\n", p, signal->id);
+}
+
+static int wave_same_stage(llsim_register_t *a, llsim_register_t *b)
+{
+	if (a->stage == NULL || b->stage == NULL)
+		return a->stage == b->stage;
+	return strcmp(a->stage, b->stage) == 0;
+}
+
+static void wave_header(void)
+{
+	llsim_unit_t *unit;
+	time_t now = time(NULL);
+	int first, i, j;
+
+	fprintf(wave_fp, "$date %.24s $end\n", ctime(&now));
+	fprintf(wave_fp, "$version llsim $end\n");
+	fprintf(wave_fp, "$timescale 1ns $end\n");
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (first = 0; first < nsignals && strcmp(signals[first].reg->unit_name, unit->name) != 0; first++)
+			;
+		if (first == nsignals)
+			continue;
+		fprintf(wave_fp, "$scope module %s $end\n", unit->name);
+		// a scope per stage, in the order they first come
+		for (i = first; i < nsignals; i++) {
+			if (strcmp(signals[i].reg->unit_name, unit->name) != 0)
+				continue;
+			for (j = first; j < i; j++)
+				if (strcmp(signals[j].reg->unit_name, unit->name) == 0 && wave_same_stage(signals[j].reg, signals[i].reg))
+					break;
+			if (j < i)
+				continue;
+			if (signals[i].reg->stage)
+				fprintf(wave_fp, "$scope module %s $end\n", signals[i].reg->stage);
+			for (j = i; j < nsignals; j++)
+				if (strcmp(signals[j].reg->unit_name, unit->name) == 0 && wave_same_stage(signals[j].reg, signals[i].reg))
+					fprintf(wave_fp, "$var reg %d %s %s $end\n", signals[j].reg->bits, signals[j].id,
+						signals[j].reg->reg_name);
+			if (signals[i].reg->stage)
+				fprintf(wave_fp, "$upscope $end\n");
+		}
+		fprintf(wave_fp, "$upscope $end\n");
+	}
+	fprintf(wave_fp, "$enddefinitions $end\n");
+}
+
+// The registers the filters pick, once the design is frozen
+static void wave_select(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	char name[WAVE_NAME];
+	int n;
+
+	if (signals)
+		return;
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next) {
+			wave_name(reg, name);
+			nsignals += wave_selected(name);
+		}
+	signals = (wave_signal_t *) llsim_malloc(nsignals * sizeof(wave_signal_t) + 1);
+	n = 0;
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next) {
+			wave_name(reg, name);
+			if (!wave_selected(name))
+				continue;
+			signals[n].reg = reg;
+			signals[n].mask = bitmask0(reg->bits);
+			wave_id(n, signals[n].id);
+			n++;
+		}
+}
+
+int llsim_wave_open(char *filename)
+{
+	char command[WAVE_NAME + 32];
+	int len = strlen(filename);
+
+	wave_select();
+	wave_pipe = len > 3 && strcmp(filename + len - 3, ".gz") == 0;
+	// with -T the file goes back with the design, and then has all the values again
+	if (wave_pipe && llsim->travel) {
+		printf("llsim: time travel writes waves to plain files, not %s\n", filename);
+		return -1;
+	}
+	if (wave_pipe) {
+		snprintf(command, sizeof(command), "gzip -c > '%s'", filename);
+		wave_fp = strchr(filename, '\'') || len >= WAVE_NAME ? NULL : popen(command, "w");
+	} else {
+		wave_fp = fopen(filename, "w");
+	}
+	if (wave_fp == NULL) {
+		printf("llsim: couldn't open file %s\n", filename);
+		return -1;
+	}
+	wave_header();
+	if (llsim->travel)
+		llsim_travel_file(wave_fp);
+	wave_valid = 0;
+	return 0;
+}
+
+// As the clock begins, its values being in old
+void llsim_wave_clock(void)
+{
+	wave_signal_t *signal;
+	unsigned int value;
+	int stamped = 0;
+
+	for (signal = signals; signal < signals + nsignals; signal++) {
+		value = llsim_register_value(signal->reg) & signal->mask;
+		if (wave_valid && value == signal->value)
+			continue;
+		if (!stamped) {
+			fprintf(wave_fp, "#%d\n", llsim->clock);
+			stamped = 1;
+		}
+		signal->value = value;
+		wave_value(signal);
+	}
+	wave_valid = 1;
+}
+
+// The values written no longer hold, after going back in time
+void llsim_wave_restart(void)
+{
+	wave_valid = 0;
+}
+
+void llsim_wave_close(void)
+{
+	if (wave_fp == NULL)
+		return;
+	fprintf(wave_fp, "#%d\n", llsim->clock);
+	if (wave_pipe)
+		pclose(wave_fp);
+	else
+		fclose(wave_fp);
+	wave_fp = NULL;
+}
+
+int llsim_ctrace_open(char *filename)
+{
+	char **names;
+	int *bits, i;
+
+	if (llsim->travel) {
+		printf("llsim: time travel writes no binary cycle trace\n");
+		return -1;
+	}
+	wave_select();
+	names = (char **) llsim_malloc(nsignals * sizeof(char *) + 1);
+	bits = (int *) llsim_malloc(nsignals * sizeof(int) + 1);
+	for (i = 0; i < nsignals; i++) {
+		names[i] = (char *) llsim_malloc(WAVE_NAME);
+		wave_name(signals[i].reg, names[i]);
+		bits[i] = signals[i].reg->bits;
+	}
+	ctrace = ctrace_create(filename, nsignals, names, bits, llsim->clock);
+	for (i = 0; i < nsignals; i++)
+		free(names[i]);
+	free(names);
+	free(bits);
+	if (ctrace == NULL) {
+		printf("llsim: couldn't open file %s\n", filename);
+		return -1;
+	}
+	ctrace_values = (unsigned int *) llsim_malloc(nsignals * sizeof(unsigned int) + 1);
+	// the index goes last, so that a run ending on an assertion has it too
+	atexit(llsim_ctrace_close);
+	return 0;
+}
+
+// As the clock begins, like llsim_wave_clock()
+void llsim_ctrace_clock(void)
+{
+	int i;
+
+	for (i = 0; i < nsignals; i++)
+		ctrace_values[i] = llsim_register_value(signals[i].reg) & signals[i].mask;
+	ctrace_write(ctrace, ctrace_values);
+}
+
+void llsim_ctrace_close(void)
+{
+	if (ctrace == NULL)
+		return;
+	if (ctrace_close(ctrace) != 0)
+		printf("llsim: couldn't write the binary cycle trace\n");
+	ctrace = NULL;
+}
@@ -0,0 +1,29 @@
+# sums src[0..N), copies it to dst and counts odd words
+	N = 200
+	add r2, r0, src			# pointer
+	add r3, r0, 0			# sum
+	add r4, r0, dst
+	add r6, r0, src + N		# end
+loop:	ld r5, r2			# load-use with the add below
+	add r3, r3, r5
+	st r5, r4				# ST then LD
+	ld r5, r2
+	and r5, r5, 1
+	add r2, r2, 1
+	add r4, r4, 1
+	jeq r5, r0, even
+	jmp odd
+even:	jlt r2, r6, loop
+	jmp done
+odd:	ld r5, odds
+	add r5, r5, 1
+	st r5, odds
+	jlt r2, r6, loop
+done:	st r3, result
+	hlt
+	.org 1000				# data past the code, however it is scheduled
+result:	.word 0
+odds:	.word 0
+src:	.word 3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9, 3, 2, 3, 8, 4
+	.space N - 20, 7
+dst:	.space N
@@ -1,21 +1,35 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "llsim.h"
-
-#define sp_printf(a...)					\
-  do {							\
-    llsim_printf("sp: clock %d: ", llsim->clock);	\
-    llsim_printf(a);					\
+#include "btrace.h"
+#include "image.h"
+#include "spasm.h"
+#include "iss.h"
+
+#define sp_printf(a...)						\
+  do {								\
+    if (LLSIM_LOG_DEBUG <= sp->unit->log_level) {		\
+      llsim_log_printf("sp: clock %d: ", llsim->clock);	\
+      llsim_log_printf(a);					\
+    }								\
   } while (0)
 
 int nr_simulated_instructions = 0;
 FILE *inst_trace_fp = NULL, *cycle_trace_fp = NULL, *dma_trace_fp = NULL;
+btrace_t *inst_btrace = NULL; // replaces inst_trace_fp with llsim -b
+char *binary_trace = NULL; // llsim -b: the instruction trace in binary to this file
+int cosim_enabled = 0; // llsim -c: check every retired instruction against the iss
+iss_t *cosim = NULL; // llsim -c: the iss, stepped as exec1 retires
+int sample_period = 0, sample_warmup = 0, sample_measure = 0; // llsim -s period,warmup,measure, 0 when off
+iss_t *sample_iss = NULL; // llsim -s: the iss, fast-forwarding between windows
+FILE *iss_null_fp = NULL; // the iss trace, not kept
 
 #define BTB_SIZE 64
 
@@ -24,88 +38,123 @@ int btb_target [BTB_SIZE] = {0};   // 16 bits array
 
 int is_pipe_stalled = 0; //1 bit
 
+/*
+ * The sp registers, besides r[], by stage: name, bits, reset value and
+ * whether cycle_trace.txt shows them. The lists lay out sp_registers_t a
+ * stage after the other, each with its 32 bit fields in ints, then its 16
+ * bit pcs and btb targets in shorts, which wrap as the iss pc does, then
+ * the narrower ones packed in bytes, and give the llsim registry, the reset
+ * and the cycle trace.
+ */
+#define SP_CTL(X)					\
+  X(ctl,   cycle_counter,	32, 0, 0)
+
+#define SP_FETCH0(X)					\
+  X(fetch0, fetch0_active,	1,  0, 1)		\
+  X(fetch0, fetch0_pc,		16, 0, 1)
+
+#define SP_FETCH1(X)					\
+  X(fetch1, fetch1_active,	1,  0, 1)		\
+  X(fetch1, fetch1_pc,		16, 0, 1)		\
+  X(fetch1, fetch1_btb_is_taken, 1, 0, 1)		\
+  X(fetch1, fetch1_btb_target,	16, 0, 1)		\
+  X(fetch1, fetch1_saved_inst,	32, 0, 0)		\
+  X(fetch1, fetch1_use_saved,	1,  0, 0)
+
+#define SP_DEC0(X)					\
+  X(dec0,  dec0_active,		1,  0, 1)		\
+  X(dec0,  dec0_pc,		16, 0, 1)		\
+  X(dec0,  dec0_inst,		32, 0, 1)		\
+  X(dec0,  dec0_btb_is_taken,	1,  0, 1)		\
+  X(dec0,  dec0_btb_target,	16, 0, 1)
+
+#define SP_DEC1(X)					\
+  X(dec1,  dec1_active,		1,  0, 1)		\
+  X(dec1,  dec1_pc,		16, 0, 1)		\
+  X(dec1,  dec1_inst,		32, 0, 1)		\
+  X(dec1,  dec1_opcode,		5,  0, 1)		\
+  X(dec1,  dec1_src0,		3,  0, 1)		\
+  X(dec1,  dec1_src1,		3,  0, 1)		\
+  X(dec1,  dec1_dst,		3,  0, 1)		\
+  X(dec1,  dec1_immediate,	32, 0, 1)		\
+  X(dec1,  dec1_btb_is_taken,	1,  0, 1)		\
+  X(dec1,  dec1_btb_target,	16, 0, 1)
+
+#define SP_EXEC0(X)					\
+  X(exec0, exec0_active,	1,  0, 1)		\
+  X(exec0, exec0_pc,		16, 0, 1)		\
+  X(exec0, exec0_inst,		32, 0, 1)		\
+  X(exec0, exec0_opcode,	5,  0, 1)		\
+  X(exec0, exec0_src0,		3,  0, 1)		\
+  X(exec0, exec0_src1,		3,  0, 1)		\
+  X(exec0, exec0_dst,		3,  0, 1)		\
+  X(exec0, exec0_immediate,	32, 0, 1)		\
+  X(exec0, exec0_alu0,		32, 0, 1)		\
+  X(exec0, exec0_alu1,		32, 0, 1)		\
+  X(exec0, exec0_btb_is_taken,	1,  0, 1)		\
+  X(exec0, exec0_btb_target,	16, 0, 1)
+
+#define SP_EXEC1(X)					\
+  X(exec1, exec1_active,	1,  0, 1)		\
+  X(exec1, exec1_pc,		16, 0, 1)		\
+  X(exec1, exec1_inst,		32, 0, 1)		\
+  X(exec1, exec1_opcode,	5,  0, 1)		\
+  X(exec1, exec1_src0,		3,  0, 1)		\
+  X(exec1, exec1_src1,		3,  0, 1)		\
+  X(exec1, exec1_dst,		3,  0, 1)		\
+  X(exec1, exec1_immediate,	32, 0, 1)		\
+  X(exec1, exec1_alu0,		32, 0, 1)		\
+  X(exec1, exec1_alu1,		32, 0, 1)		\
+  X(exec1, exec1_aluout,	32, 0, 1)		\
+  X(exec1, exec1_btb_is_taken,	1,  0, 1)		\
+  X(exec1, exec1_btb_target,	16, 0, 1)
+
+#define SP_MEM(X)					\
+  X(mem,   mem_stall,		1,  0, 0)		\
+  X(mem,   mem_SRAM_DO,		32, 0, 0)		\
+  X(mem,   mem_dst,		3,  0, 0)
+
+#define SP_DMA(X)					\
+  X(dma,   dma_busy,		1,  0, 0) /* copy requested or running */	\
+  X(dma,   dma_src,		32, 0, 0) /* next word to read */	\
+  X(dma,   dma_dst,		32, 0, 0) /* next word to write */	\
+  X(dma,   dma_len,		32, 0, 0) /* words left */	\
+  X(dma,   dma_reg,		32, 0, 0) /* word read, to write */	\
+  X(dma,   dma_reg2,		32, 0, 0) /* second word, when a write stalls */	\
+  X(dma,   dma_do_dirty,	1,  0, 0) /* SRAM_DO holds a word to take */	\
+  X(dma,   dma_state,		3,  0, 0)
+
+#define SP_STAGES(S, X) \
+  S(SP_CTL, X) S(SP_FETCH0, X) S(SP_FETCH1, X) S(SP_DEC0, X) S(SP_DEC1, X) \
+  S(SP_EXEC0, X) S(SP_EXEC1, X) S(SP_MEM, X) S(SP_DMA, X)
+#define SP_STAGE_REGISTERS(stage, X) stage(X)
+#define SP_REGISTERS(X) SP_STAGES(SP_STAGE_REGISTERS, X)
+
+#define SP_INT_32(name) int name;
+#define SP_INT_16(name)
+#define SP_INT_5(name)
+#define SP_INT_3(name)
+#define SP_INT_1(name)
+#define SP_SHORT_32(name)
+#define SP_SHORT_16(name) unsigned short name;
+#define SP_SHORT_5(name)
+#define SP_SHORT_3(name)
+#define SP_SHORT_1(name)
+#define SP_BYTE_32(name)
+#define SP_BYTE_16(name)
+#define SP_BYTE_5(name) unsigned char name;
+#define SP_BYTE_3(name) unsigned char name;
+#define SP_BYTE_1(name) unsigned char name;
+#define SP_REGISTER_INT(stage, name, bits, reset, trace) SP_INT_##bits(name)
+#define SP_REGISTER_SHORT(stage, name, bits, reset, trace) SP_SHORT_##bits(name)
+#define SP_REGISTER_BYTE(stage, name, bits, reset, trace) SP_BYTE_##bits(name)
+#define SP_STAGE_FIELDS(stage, X) stage(SP_REGISTER_INT) stage(SP_REGISTER_SHORT) stage(SP_REGISTER_BYTE)
+
 typedef struct sp_registers_s {
   // 6 32 bit registers (r[0], r[1] don't exist)
   int r[8];
 
-  // 32 bit cycle counter
-  int cycle_counter;
-
-  // fetch0
-  int fetch0_active; // 1 bit
-  int fetch0_pc; // 16 bits
-
-  // fetch1
-  int fetch1_active; // 1 bit
-  int fetch1_pc; // 16 bits
-  int fetch1_saved_inst; // 32 bits
-  int fetch1_use_saved; // 1 bit
-  int fetch1_btb_target; //16 bits
-  int fetch1_btb_is_taken; //1 bit
-  
-  // dec0
-  int dec0_active; // 1 bit
-  int dec0_pc; // 16 bits
-  int dec0_inst; // 32 bits
-  int dec0_btb_target; //16 bits
-  int dec0_btb_is_taken; //1 bit
-
-  // dec1
-  int dec1_active; // 1 bit
-  int dec1_pc; // 16 bits
-  int dec1_inst; // 32 bits
-  int dec1_opcode; // 5 bits
-  int dec1_src0; // 3 bits
-  int dec1_src1; // 3 bits
-  int dec1_dst; // 3 bits
-  int dec1_immediate; // 32 bits
-  int dec1_btb_target; //16 bits
-  int dec1_btb_is_taken; //1 bit
-
-  // exec0
-  int exec0_active; // 1 bit
-  int exec0_pc; // 16 bits
-  int exec0_inst; // 32 bits
-  int exec0_opcode; // 5 bits
-  int exec0_src0; // 3 bits
-  int exec0_src1; // 3 bits
-  int exec0_dst; // 3 bits
-  int exec0_immediate; // 32 bits
-  int exec0_alu0; // 32 bits
-  int exec0_alu1; // 32 bits
-  int exec0_btb_target; //16 bits
-  int exec0_btb_is_taken; //1 bit
-
-  // exec1
-  int exec1_active; // 1 bit
-  int exec1_pc; // 16 bits
-  int exec1_inst; // 32 bits
-  int exec1_opcode; // 5 bits
-  int exec1_src0; // 3 bits
-  int exec1_src1; // 3 bits
-  int exec1_dst; // 3 bits
-  int exec1_immediate; // 32 bits
-  int exec1_alu0; // 32 bits
-  int exec1_alu1; // 32 bits
-  int exec1_aluout; //32 bits
-  int exec1_btb_target; //16 bits
-  int exec1_btb_is_taken; //1 bit
-
-  // MEM stall
-  int mem_stall; // 1 bit
-  int mem_SRAM_DO; // 32 bits
-  int mem_dst; // 3 bits
-
-  //DMA
-  int dma_busy;     // Flag indicates whether DMA machine is busy
-  int dma_src;      // Source address for DMA
-  int dma_dst;      // Destination address for DMA
-  int dma_len;      // Remaining words to copy for DMA
-  int dma_reg;      // DMA register as temporary storage between reads and writes
-  int dma_reg2;     // DMA register for storing second value in case stall in DMA_STATE_DO_WRITE fucks up pipelining
-  int dma_do_dirty; // DMA bit indicating that SRAM_DO needs to be read
-  int dma_state;    // DMA state machine control
-
+  SP_STAGES(SP_STAGE_FIELDS, _)
 } sp_registers_t;
 
 /*
@@ -116,19 +165,29 @@ typedef struct sp_s {
 #define SP_SRAM_HEIGHT	64 * 1024
   llsim_memory_t *srami, *sramd;
 
-  unsigned int memory_image[SP_SRAM_HEIGHT];
   int memory_image_size;
+  int entry; // pc of the first instruction
 
   int start;
 
-  sp_registers_t *spro, *sprn;
+  llsim_unit_t *unit, *dma_unit;
+  llsim_unit_registers_t *regs;
+  sp_registers_t *spro, *sprn;	// regs->old and regs->new, for this clock
+  int ctl_ran;			// sp_ctl ran this clock, so does dma_ctl
 } sp_t;
 
+// sprn->field = value, marking it for the commit
+#define sp_set(field, value) llsim_set(sp->regs, sprn->field, value)
+
 static void sp_reset(sp_t *sp)
 {
   sp_registers_t *sprn = sp->sprn;
 
+#define SP_RESET_REGISTER(stage, name, bits, reset, trace) sprn->name = reset;
   memset(sprn, 0, sizeof(*sprn));
+  SP_REGISTERS(SP_RESET_REGISTER)
+  llsim_mark(sp->regs, sprn, sizeof(*sprn));
+  sp_set(fetch0_pc, sp->entry);
 }
 
 /*
@@ -193,7 +252,6 @@ static void printInstruction(sp_registers_t *sp) {
   
   fprintf(inst_trace_fp, "r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n", sp->exec1_immediate, sp->r[2], sp->r[3]);
   fprintf(inst_trace_fp, "r[4] = %08x r[5] = %08x r[6] = %08x r[7] = %08x \n\n", sp->r[4], sp->r[5], sp->r[6], sp->r[7]);
-  nr_simulated_instructions += 1;
 }
 
 static void printExecution(sp_registers_t *sp) {
@@ -253,6 +311,219 @@ static int is_jump_opcode(int opcode) {
   return 0;
 }
 
+/*
+ * Co-simulation with llsim -c: every instruction exec1 retires is run on
+ * the iss as well, and the architectural state of both is compared right
+ * away. The first difference stops the simulation with a report.
+ *
+ * DMA runs on the pipeline's timing, which the iss has no model of: the
+ * words it writes are mirrored into the iss memory as they land, and DMA
+ * and DMP retire on the iss the way they did in the pipeline.
+ */
+static int cosim_last_pc = -1, cosim_last_inst;
+
+static void cosim_mismatch(sp_registers_t *spro, sp_registers_t *sprn, char *what, int pipeline, int iss)
+{
+  int i;
+
+  llsim_log_flush();
+  printf("cosim: mismatch at instruction %d, clock %d: %s\n", nr_simulated_instructions - 1, llsim->clock, what);
+  printf("cosim: pipeline %08x, iss %08x\n", pipeline, iss);
+  printf("cosim: pc %04x, inst %08x, opcode = %d (%s), dst = %d, src0 = %d, src1 = %d, immediate = %08x\n",
+	 spro->exec1_pc, spro->exec1_inst, spro->exec1_opcode, opcode_name[spro->exec1_opcode],
+	 spro->exec1_dst, spro->exec1_src0, spro->exec1_src1, spro->exec1_immediate);
+  if (cosim_last_pc >= 0)
+    printf("cosim: previous pc %04x, inst %08x\n", cosim_last_pc, cosim_last_inst);
+  for (i = 2; i <= 7; i++)
+    printf("cosim: r[%d] pipeline %08x iss %08x%s\n", i, sprn->r[i], cosim->regs[i],
+	   sprn->r[i] != cosim->regs[i] ? " <--" : "");
+  exit(1);
+}
+
+static void cosim_step(sp_registers_t *spro, sp_registers_t *sprn)
+{
+  unsigned int inst;
+  int opcode = spro->exec1_opcode;
+  int src1, addr = 0, status, i;
+  char what[16];
+
+  if (cosim->pc != (spro->exec1_pc & 0xffff))
+    cosim_mismatch(spro, sprn, "pc", spro->exec1_pc, cosim->pc);
+  inst = cosim->mem[cosim->pc];
+  if (inst != spro->exec1_inst)
+    cosim_mismatch(spro, sprn, "instruction", spro->exec1_inst, inst);
+
+  if (opcode == DMA || opcode == DMP) {
+    if (opcode == DMP && spro->exec1_aluout) {
+      cosim->regs[7] = spro->exec1_pc;
+      cosim->pc = spro->exec1_immediate;
+    } else {
+      cosim->pc++;
+    }
+    cosim->instCount++;
+  } else {
+    // the address the iss is about to store to
+    if (opcode == ST) {
+      src1 = (inst >> 16) & 0x7;
+      addr = (src1 == 1 ? (short) inst : cosim->regs[src1]) & 0xffff;
+    }
+    cosim->stopAt = cosim->instCount + 1;
+    status = iss_run(cosim, TRACE_NONE, iss_null_fp, NULL, 0);
+    if (status == ISS_ILLEGAL)
+      cosim_mismatch(spro, sprn, "illegal opcode on the iss", opcode, cosim->illegalOpcode);
+    if ((status == ISS_HALTED) != (opcode == HLT))
+      cosim_mismatch(spro, sprn, "halt", opcode == HLT, status == ISS_HALTED);
+  }
+
+  for (i = 2; i <= 7; i++) {
+    if (sprn->r[i] != cosim->regs[i]) {
+      sprintf(what, "r[%d]", i);
+      cosim_mismatch(spro, sprn, what, sprn->r[i], cosim->regs[i]);
+    }
+  }
+  if (opcode == ST) {
+    if (addr != (spro->exec1_alu1 & 0xffff))
+      cosim_mismatch(spro, sprn, "store address", spro->exec1_alu1 & 0xffff, addr);
+    if (cosim->mem[addr] != spro->exec1_alu0)
+      cosim_mismatch(spro, sprn, "store data", spro->exec1_alu0, cosim->mem[addr]);
+  }
+
+  cosim_last_pc = spro->exec1_pc;
+  cosim_last_inst = spro->exec1_inst;
+  if (opcode == HLT)
+    printf("cosim: %lld instructions matched the iss\n", cosim->instCount);
+}
+
+/*
+ * Sampled simulation with llsim -s period,warmup,measure. The iss runs the
+ * program functionally and every period instructions hands its registers,
+ * pc and memory over to an empty pipeline. The pipeline runs warmup
+ * instructions to fill up and retrain the BTB, which keeps what earlier
+ * windows taught it, then measure instructions whose cycles are counted.
+ * The iss goes on from the hand-over point itself, so whatever the
+ * pipeline got wrong never reaches the next window. The CPI of the windows
+ * is extrapolated to the whole run with a 95% confidence interval.
+ */
+static long long sample_at;	// iss instruction count of the next hand-over
+static int sample_retired;	// instructions retired in the current window
+static int sample_clock;	// clock the measured part of the window began
+static int sample_pending;	// hand over on the next clock
+static int sample_n;		// measured windows, with the running mean and
+static double sample_mean, sample_m2;	// sum of squared deviations of their CPI
+
+// two sided 95% quantiles of Student's t, by degrees of freedom
+static const double t95[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+			     2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+			     2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+static void sample_report(void)
+{
+  double half = 0;
+  long long n = sample_iss->instCount;
+
+  printf("sample: %d windows of %d instructions, warm-up %d, period %d\n",
+	 sample_n, sample_measure, sample_warmup, sample_period);
+  if (sample_n == 0) {
+    printf("sample: no window was measured, the program ran %lld instructions\n", n);
+    return;
+  }
+  if (sample_n > 1)
+    half = (sample_n <= 30 ? t95[sample_n - 1] : 1.96) * sqrt(sample_m2 / (sample_n - 1) / sample_n);
+  printf("sample: CPI %.4f +- %.4f (95%% confidence)\n", sample_mean, half);
+  printf("sample: %lld instructions, %.0f +- %.0f cycles estimated\n", n, sample_mean * n, half * n);
+}
+
+static void sample_finish(void)
+{
+  // the iss runs the rest of the program for the instruction count
+  sample_iss->stopAt = 0;
+  if (iss_run(sample_iss, TRACE_NONE, iss_null_fp, NULL, 0) == ISS_ILLEGAL) {
+    printf("sample: illegal opcode %d at pc %d on the iss\n", sample_iss->illegalOpcode, sample_iss->pc);
+    exit(1);
+  }
+  sample_report();
+}
+
+static void sample_add(int measured)
+{
+  double cpi, delta;
+
+  cpi = (double) (llsim->clock - sample_clock) / measured;
+  sample_n++;
+  delta = cpi - sample_mean;
+  sample_mean += delta / sample_n;
+  sample_m2 += delta * (cpi - sample_mean);
+}
+
+static void sample_retire(sp_registers_t *spro)
+{
+  sample_retired++;
+  if (spro->exec1_opcode == HLT) {
+    // a program shorter than a period still gets the window it halted in
+    if (sample_n == 0 && sample_retired > sample_warmup)
+      sample_add(sample_retired - sample_warmup);
+    sample_finish();
+    return;
+  }
+  if (sample_retired == sample_warmup)
+    sample_clock = llsim->clock;
+  if (sample_retired == sample_warmup + sample_measure) {
+    sample_add(sample_measure);
+    sample_pending = 1;
+  }
+}
+
+// Only pages that differ are written, the rest stay shared with the program
+static void sample_copy(llsim_memory_t *sram)
+{
+  int page;
+
+  for (page = 0; page < SP_SRAM_HEIGHT; page += PAGE_WORDS)
+    if (memcmp(sram->data + page, sample_iss->mem + page, PAGE_WORDS * sizeof(int)) != 0)
+      memcpy(sram->data + page, sample_iss->mem + page, PAGE_WORDS * sizeof(int));
+}
+
+// Runs the iss to the next hand-over and restarts the pipeline there
+static void sample_next(sp_t *sp)
+{
+  sp_registers_t *spro = sp->spro;
+  sp_registers_t *sprn = sp->sprn;
+  int status = ISS_STOPPED, i;
+
+  if (sample_at > sample_iss->instCount) {
+    sample_iss->stopAt = sample_at;
+    status = iss_run(sample_iss, TRACE_NONE, iss_null_fp, NULL, 0);
+  }
+  if (status == ISS_ILLEGAL) {
+    printf("sample: illegal opcode %d at pc %d on the iss\n", sample_iss->illegalOpcode, sample_iss->pc);
+    exit(1);
+  }
+  if (status == ISS_HALTED) {
+    sample_report();
+    sample_copy(sp->srami);
+    sample_copy(sp->sramd);
+    dump_sram(sp, "srami_out.txt", sp->srami);
+    dump_sram(sp, "sramd_out.txt", sp->sramd);
+    llsim_stop();
+    return;
+  }
+
+  sample_copy(sp->srami);
+  sample_copy(sp->sramd);
+  memset(sprn, 0, sizeof(*sprn));
+  llsim_mark(sp->regs, sprn, sizeof(*sprn));
+  sp_set(cycle_counter, spro->cycle_counter + 1);
+  for (i = 2; i <= 7; i++)
+    sp_set(r[i], sample_iss->regs[i]);
+  sp_set(fetch0_pc, sample_iss->pc);
+  is_pipe_stalled = 0;
+
+  sample_at += sample_period;
+  sample_retired = 0;
+  sample_clock = llsim->clock;
+  sample_pending = 0;
+}
+
 static void sp_ctl(sp_t *sp)
 {
   sp_registers_t *spro = sp->spro;
@@ -281,65 +552,23 @@ static void sp_ctl(sp_t *sp)
   int exec0_alu0_final = 0;
   int exec0_alu1_final = 0;
   int exec0_alu1_cmp = 0;
+  int tracing;
   
   
-  fprintf(cycle_trace_fp, "nr_simulated_instructions %d\n", nr_simulated_instructions);
-  fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
-  fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
-  for (i = 2; i <= 7; i++)
-    fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
-
-  fprintf(cycle_trace_fp, "fetch0_active %d\n", spro->fetch0_active);
-  fprintf(cycle_trace_fp, "fetch0_pc %08x\n", spro->fetch0_pc);
-
-  fprintf(cycle_trace_fp, "fetch1_active %d\n", spro->fetch1_active);
-  fprintf(cycle_trace_fp, "fetch1_pc %08x\n", spro->fetch1_pc);
-  fprintf(cycle_trace_fp, "fetch1_btb_is_taken %d\n", spro->fetch1_btb_is_taken);
-  fprintf(cycle_trace_fp, "fetch1_btb_target %08x\n", spro->fetch1_btb_target);
-
-  fprintf(cycle_trace_fp, "dec0_active %d\n", spro->dec0_active);
-  fprintf(cycle_trace_fp, "dec0_pc %08x\n", spro->dec0_pc);
-  fprintf(cycle_trace_fp, "dec0_inst %08x\n", spro->dec0_inst); // 32 bits
-  fprintf(cycle_trace_fp, "dec0_btb_is_taken %d\n", spro->dec0_btb_is_taken);
-  fprintf(cycle_trace_fp, "dec0_btb_target %08x\n", spro->dec0_btb_target);
-
-  fprintf(cycle_trace_fp, "dec1_active %d\n", spro->dec1_active);
-  fprintf(cycle_trace_fp, "dec1_pc %08x\n", spro->dec1_pc); // 16 bits
-  fprintf(cycle_trace_fp, "dec1_inst %08x\n", spro->dec1_inst); // 32 bits
-  fprintf(cycle_trace_fp, "dec1_opcode %08x\n", spro->dec1_opcode); // 5 bits
-  fprintf(cycle_trace_fp, "dec1_src0 %08x\n", spro->dec1_src0); // 3 bits
-  fprintf(cycle_trace_fp, "dec1_src1 %08x\n", spro->dec1_src1); // 3 bits
-  fprintf(cycle_trace_fp, "dec1_dst %08x\n", spro->dec1_dst); // 3 bits
-  fprintf(cycle_trace_fp, "dec1_immediate %08x\n", spro->dec1_immediate); // 32 bits
-  fprintf(cycle_trace_fp, "dec1_btb_is_taken %d\n", spro->dec1_btb_is_taken);
-  fprintf(cycle_trace_fp, "dec1_btb_target %08x\n", spro->dec1_btb_target);
-
-  fprintf(cycle_trace_fp, "exec0_active %d\n", spro->exec0_active);
-  fprintf(cycle_trace_fp, "exec0_pc %08x\n", spro->exec0_pc); // 16 bits
-  fprintf(cycle_trace_fp, "exec0_inst %08x\n", spro->exec0_inst); // 32 bits
-  fprintf(cycle_trace_fp, "exec0_opcode %08x\n", spro->exec0_opcode); // 5 bits
-  fprintf(cycle_trace_fp, "exec0_src0 %08x\n", spro->exec0_src0); // 3 bits
-  fprintf(cycle_trace_fp, "exec0_src1 %08x\n", spro->exec0_src1); // 3 bits
-  fprintf(cycle_trace_fp, "exec0_dst %08x\n", spro->exec0_dst); // 3 bits
-  fprintf(cycle_trace_fp, "exec0_immediate %08x\n", spro->exec0_immediate); // 32 bits
-  fprintf(cycle_trace_fp, "exec0_alu0 %08x\n", spro->exec0_alu0); // 32 bits
-  fprintf(cycle_trace_fp, "exec0_alu1 %08x\n", spro->exec0_alu1); // 32 bits
-  fprintf(cycle_trace_fp, "exec0_btb_is_taken %d\n", spro->exec0_btb_is_taken);
-  fprintf(cycle_trace_fp, "exec0_btb_target %08x\n", spro->exec0_btb_target);
-
-  fprintf(cycle_trace_fp, "exec1_active %d\n", spro->exec1_active);
-  fprintf(cycle_trace_fp, "exec1_pc %08x\n", spro->exec1_pc); // 16 bits
-  fprintf(cycle_trace_fp, "exec1_inst %08x\n", spro->exec1_inst); // 32 bits
-  fprintf(cycle_trace_fp, "exec1_opcode %08x\n", spro->exec1_opcode); // 5 bits
-  fprintf(cycle_trace_fp, "exec1_src0 %08x\n", spro->exec1_src0); // 3 bits
-  fprintf(cycle_trace_fp, "exec1_src1 %08x\n", spro->exec1_src1); // 3 bits
-  fprintf(cycle_trace_fp, "exec1_dst %08x\n", spro->exec1_dst); // 3 bits
-  fprintf(cycle_trace_fp, "exec1_immediate %08x\n", spro->exec1_immediate); // 32 bits
-  fprintf(cycle_trace_fp, "exec1_alu0 %08x\n", spro->exec1_alu0); // 32 bits
-  fprintf(cycle_trace_fp, "exec1_alu1 %08x\n", spro->exec1_alu1); // 32 bits
-  fprintf(cycle_trace_fp, "exec1_aluout %08x\n", spro->exec1_aluout);
-  fprintf(cycle_trace_fp, "exec1_btb_is_taken %d\n", spro->exec1_btb_is_taken);
-  fprintf(cycle_trace_fp, "exec1_btb_target %08x\n", spro->exec1_btb_target);
+  // with llsim -T, only the clocks run again before a failure
+  tracing = llsim_tracing();
+  if (tracing) {
+    fprintf(cycle_trace_fp, "nr_simulated_instructions %d\n", nr_simulated_instructions);
+    fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
+    fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
+    for (i = 2; i <= 7; i++)
+      fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
+
+#define SP_TRACE_REGISTER(stage, name, bits, reset, trace)			\
+    if (trace)									\
+      fprintf(cycle_trace_fp, bits == 1 ? #name " %d\n" : #name " %08x\n", spro->name);
+    SP_REGISTERS(SP_TRACE_REGISTER)
+  }
   
   sp_printf("cycle_counter %08x\n", spro->cycle_counter);
   sp_printf("r2 %08x, r3 %08x\n", spro->r[2], spro->r[3]);
@@ -349,10 +578,10 @@ static void sp_ctl(sp_t *sp)
   sp_printf("fetch0_pc %d, fetch1_pc %d, dec0_pc %d, dec1_pc %d, exec0_pc %d, exec1_pc %d\n",
 	    spro->fetch0_pc, spro->fetch1_pc, spro->dec0_pc, spro->dec1_pc, spro->exec0_pc, spro->exec1_pc);
 
-  sprn->cycle_counter = spro->cycle_counter + 1;
+  sp_set(cycle_counter, spro->cycle_counter + 1);
 
   if (sp->start)
-    sprn->fetch0_active = 1;
+    sp_set(fetch0_active, 1);
 
   // Establish bypass signals
   dec1_r0_bypass_en = (spro->dec1_src0 > 1) && (spro->dec1_src0 == spro->exec1_dst) && (spro->exec1_active);
@@ -375,14 +604,16 @@ static void sp_ctl(sp_t *sp)
 		   ((spro->exec0_opcode == LD && spro->exec1_opcode == ST) || //structural
 		    (spro->exec1_opcode == LD && ((spro->exec1_dst == spro->exec0_src0) || (spro->exec1_dst == exec0_alu1_cmp))))); //data Read after LD
 		    
-  fprintf(cycle_trace_fp, "is_pipe_stalled %d\n", is_pipe_stalled);
+  if (tracing) {
+    fprintf(cycle_trace_fp, "is_pipe_stalled %d\n", is_pipe_stalled);
 
-  fprintf(cycle_trace_fp, "exec0_exec1_to_alu0_bypass %d ",exec0_exec1_to_alu0_bypass); 
-  fprintf(cycle_trace_fp, "exec0_exec1_to_alu1_bypass %d ",exec0_exec1_to_alu1_bypass);
-  fprintf(cycle_trace_fp, "exec0_mem_to_alu0_bypass %d ",exec0_mem_to_alu0_bypass); 
-  fprintf(cycle_trace_fp, "exec0_mem_to_alu1_bypass %d\n",exec0_mem_to_alu1_bypass);
+    fprintf(cycle_trace_fp, "exec0_exec1_to_alu0_bypass %d ",exec0_exec1_to_alu0_bypass); 
+    fprintf(cycle_trace_fp, "exec0_exec1_to_alu1_bypass %d ",exec0_exec1_to_alu1_bypass);
+    fprintf(cycle_trace_fp, "exec0_mem_to_alu0_bypass %d ",exec0_mem_to_alu0_bypass); 
+    fprintf(cycle_trace_fp, "exec0_mem_to_alu1_bypass %d\n",exec0_mem_to_alu1_bypass);
 
-  fprintf(cycle_trace_fp, "\n");
+    fprintf(cycle_trace_fp, "\n");
+  }
 
   //  Patch for debuggin when encounter infinite loop. Uncomment out when needed.
   //if (spro->cycle_counter > 1000) {
@@ -394,133 +625,134 @@ static void sp_ctl(sp_t *sp)
     int btb_addr = spro->fetch0_pc % BTB_SIZE;
     llsim_mem_read(sp->srami, spro->fetch0_pc);
     if (btb_is_taken[btb_addr]) {
-      sprn->fetch0_pc = btb_target[btb_addr];
+      sp_set(fetch0_pc, btb_target[btb_addr]);
     } else {
-      sprn->fetch0_pc = spro->fetch0_pc + 1;
+      sp_set(fetch0_pc, spro->fetch0_pc + 1);
     }
     
-    sprn->fetch1_active = 1;
-    sprn->fetch1_pc = spro->fetch0_pc;
-    sprn->fetch1_btb_is_taken = btb_is_taken[btb_addr];
-    sprn->fetch1_btb_target = btb_target[btb_addr];
+    sp_set(fetch1_active, 1);
+    sp_set(fetch1_pc, spro->fetch0_pc);
+    sp_set(fetch1_btb_is_taken, btb_is_taken[btb_addr]);
+    sp_set(fetch1_btb_target, btb_target[btb_addr]);
   }
 	
   // fetch1
   if (spro->fetch1_active) {
     inst = llsim_mem_extract_dataout(sp->srami, 31, 0);
     if (is_pipe_stalled) {
-      sprn->fetch1_saved_inst = inst;
-      sprn->fetch1_use_saved = 1;
+      sp_set(fetch1_saved_inst, inst);
+      sp_set(fetch1_use_saved, 1);
     } else {
-      sprn->fetch1_use_saved = 0;
-      sprn->dec0_active = 1;
-      sprn->dec0_inst = spro->fetch1_use_saved ? spro->fetch1_saved_inst : inst;
-      sprn->dec0_pc = spro->fetch1_pc;
-      sprn->dec0_btb_is_taken = spro->fetch1_btb_is_taken;
-      sprn->dec0_btb_target = spro->fetch1_btb_target;
+      sp_set(fetch1_use_saved, 0);
+      sp_set(dec0_active, 1);
+      sp_set(dec0_inst, spro->fetch1_use_saved ? spro->fetch1_saved_inst : inst);
+      sp_set(dec0_pc, spro->fetch1_pc);
+      sp_set(dec0_btb_is_taken, spro->fetch1_btb_is_taken);
+      sp_set(dec0_btb_target, spro->fetch1_btb_target);
     }
   } else {
-    sprn->dec0_active = 0;
+    sp_set(dec0_active, 0);
   }
 	
   // dec0
   if (spro->dec0_active && !is_pipe_stalled) {
     int opcode = (spro->dec0_inst >> 25) & 0x1F;
-    sprn->dec1_active = 1;
-    sprn->dec1_pc = spro->dec0_pc;
-    sprn->dec1_inst = spro->dec0_inst;
-    sprn->dec1_opcode = opcode;
-    sprn->dec1_src0 = (spro->dec0_inst >> 19) & 0x7;
-    sprn->dec1_src1 = (spro->dec0_inst >> 16) & 0x7;
-    sprn->dec1_dst = (spro->dec0_inst >> 22) & 0x7;
+    sp_set(dec1_active, 1);
+    sp_set(dec1_pc, spro->dec0_pc);
+    sp_set(dec1_inst, spro->dec0_inst);
+    sp_set(dec1_opcode, opcode);
+    sp_set(dec1_src0, (spro->dec0_inst >> 19) & 0x7);
+    sp_set(dec1_src1, (spro->dec0_inst >> 16) & 0x7);
+    sp_set(dec1_dst, (spro->dec0_inst >> 22) & 0x7);
     immediate = (spro->dec0_inst) & 0xffff;
     // Sign-extend immediate
     if (immediate & 0x8000) {
-      sprn->dec1_immediate = immediate | 0xffff0000;
+      sp_set(dec1_immediate, immediate | 0xffff0000);
     } else {
-      sprn->dec1_immediate = immediate;
+      sp_set(dec1_immediate, immediate);
     }
     
     //if predicted jump taken, but opcode is not jump, flush pipe
     if (!is_jump_opcode(opcode) && spro->dec0_btb_is_taken) {
-      sprn->fetch1_active = sprn->dec0_active = 0;
-      sprn->fetch0_pc = spro->dec0_pc + 1;
+      sp_set(fetch1_active, 0);
+      sp_set(dec0_active, 0);
+      sp_set(fetch0_pc, spro->dec0_pc + 1);
     }
 
-    sprn->dec1_btb_is_taken = spro->dec0_btb_is_taken;
-    sprn->dec1_btb_target = spro->dec0_btb_target;
+    sp_set(dec1_btb_is_taken, spro->dec0_btb_is_taken);
+    sp_set(dec1_btb_target, spro->dec0_btb_target);
   }
   if (!(spro->dec0_active)) {
-    sprn->dec1_active = 0;
+    sp_set(dec1_active, 0);
   }
 
   // dec1
   if (spro->dec1_active && !is_pipe_stalled) {
-    sprn->exec0_active = 1;
-    sprn->exec0_pc = spro->dec1_pc;
-    sprn->exec0_inst = spro->dec1_inst;
-    sprn->exec0_opcode = spro->dec1_opcode;
-    sprn->exec0_src0 = spro->dec1_src0;
-    sprn->exec0_src1 = spro->dec1_src1;
-    sprn->exec0_dst = spro->dec1_dst;
-    sprn->exec0_immediate = spro->dec1_immediate;
+    sp_set(exec0_active, 1);
+    sp_set(exec0_pc, spro->dec1_pc);
+    sp_set(exec0_inst, spro->dec1_inst);
+    sp_set(exec0_opcode, spro->dec1_opcode);
+    sp_set(exec0_src0, spro->dec1_src0);
+    sp_set(exec0_src1, spro->dec1_src1);
+    sp_set(exec0_dst, spro->dec1_dst);
+    sp_set(exec0_immediate, spro->dec1_immediate);
     dec1_r0_final = dec1_r0_bypass_en ? dec1_r0_bypass : spro->r[spro->dec1_src0];
-    sprn->exec0_alu0 = (spro->dec1_src0 == 1 || spro->dec1_opcode == LHI) ? spro->dec1_immediate : dec1_r0_final;
+    sp_set(exec0_alu0, (spro->dec1_src0 == 1 || spro->dec1_opcode == LHI) ? spro->dec1_immediate : dec1_r0_final);
     if (spro->dec1_opcode == LHI) {
       dec1_r1_final = dec1_r1_bypass_en ? dec1_r1_bypass : spro->r[spro->dec1_dst];
-      sprn->exec0_alu1 = dec1_r1_final;
+      sp_set(exec0_alu1, dec1_r1_final);
     } else {
       dec1_r1_final = dec1_r1_bypass_en ? dec1_r1_bypass : spro->r[spro->dec1_src1];
-      sprn->exec0_alu1 = (spro->dec1_src1 == 1) ? spro->dec1_immediate : dec1_r1_final;
+      sp_set(exec0_alu1, (spro->dec1_src1 == 1) ? spro->dec1_immediate : dec1_r1_final);
     }
-    sprn->exec0_btb_is_taken = spro->dec1_btb_is_taken;
-    sprn->exec0_btb_target = spro->dec1_btb_target;
+    sp_set(exec0_btb_is_taken, spro->dec1_btb_is_taken);
+    sp_set(exec0_btb_target, spro->dec1_btb_target);
   }
   if (!(spro->dec1_active)) {
-    sprn->exec0_active = 0;
+    sp_set(exec0_active, 0);
   }
 
   // exec0
   if (spro->exec0_active && !is_pipe_stalled) {
-    sprn->exec1_active = 1;
-    sprn->exec1_pc = spro->exec0_pc;
-    sprn->exec1_inst = spro->exec0_inst;
-    sprn->exec1_opcode = spro->exec0_opcode;
-    sprn->exec1_src0 = spro->exec0_src0;
-    sprn->exec1_src1 = spro->exec0_src1;
-    sprn->exec1_dst = spro->exec0_dst;
-    sprn->exec1_immediate = spro->exec0_immediate;
+    sp_set(exec1_active, 1);
+    sp_set(exec1_pc, spro->exec0_pc);
+    sp_set(exec1_inst, spro->exec0_inst);
+    sp_set(exec1_opcode, spro->exec0_opcode);
+    sp_set(exec1_src0, spro->exec0_src0);
+    sp_set(exec1_src1, spro->exec0_src1);
+    sp_set(exec1_dst, spro->exec0_dst);
+    sp_set(exec1_immediate, spro->exec0_immediate);
 
     // Establish MUX outputs for bypasses
     exec0_alu0_final = exec0_alu0_bypass_en ? exec0_alu0_bypass : spro->exec0_alu0;
     exec0_alu1_final = exec0_alu1_bypass_en ? exec0_alu1_bypass : spro->exec0_alu1;
-    sprn->exec1_alu0 = exec0_alu0_final;
-    sprn->exec1_alu1 = exec0_alu1_final;    
+    sp_set(exec1_alu0, exec0_alu0_final);
+    sp_set(exec1_alu1, exec0_alu1_final);    
     
     switch(spro->exec0_opcode) {
     case ADD:
-      sprn->exec1_aluout = exec0_alu0_final + exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final + exec0_alu1_final);
       break;
     case SUB:
-      sprn->exec1_aluout = exec0_alu0_final - exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final - exec0_alu1_final);
       break;
     case LSF:
-      sprn->exec1_aluout = exec0_alu0_final << exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final << exec0_alu1_final);
       break;
     case RSF:
-      sprn->exec1_aluout = exec0_alu0_final >> exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final >> exec0_alu1_final);
       break;
     case AND:
-      sprn->exec1_aluout = exec0_alu0_final & exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final & exec0_alu1_final);
       break;
     case OR:
-      sprn->exec1_aluout = exec0_alu0_final | exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final | exec0_alu1_final);
       break;
     case XOR:
-      sprn->exec1_aluout = exec0_alu0_final ^ exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final ^ exec0_alu1_final);
       break;
     case LHI:
-      sprn->exec1_aluout = (exec0_alu1_final << 16) | (exec0_alu0_final & 0xffff);
+      sp_set(exec1_aluout, (exec0_alu1_final << 16) | (exec0_alu0_final & 0xffff));
       break;
     case LD:
       llsim_mem_read(sp->sramd, exec0_alu1_final & 0xffff);
@@ -528,44 +760,49 @@ static void sp_ctl(sp_t *sp)
     case ST:
       break;
     case DMA:
-      sprn->exec1_aluout = spro->exec0_alu0;
+      sp_set(exec1_aluout, spro->exec0_alu0);
       break;
     case DMP:
-      sprn->exec1_aluout = !(spro->exec0_alu0);
+      sp_set(exec1_aluout, !(spro->exec0_alu0));
       break;
     case JLT:
-      sprn->exec1_aluout = exec0_alu0_final < exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final < exec0_alu1_final);
       break;
     case JLE:
-      sprn->exec1_aluout = exec0_alu0_final <= exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final <= exec0_alu1_final);
       break;
     case JEQ:
-      sprn->exec1_aluout = exec0_alu0_final == exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final == exec0_alu1_final);
       break;
     case JNE:
-      sprn->exec1_aluout = exec0_alu0_final != exec0_alu1_final;
+      sp_set(exec1_aluout, exec0_alu0_final != exec0_alu1_final);
       break;
     case JIN:
-      sprn->exec1_aluout = 1;
+      sp_set(exec1_aluout, 1);
       break;
     }
-    sprn->exec1_btb_is_taken = spro->exec0_btb_is_taken;
-    sprn->exec1_btb_target = spro->exec0_btb_target;
+    sp_set(exec1_btb_is_taken, spro->exec0_btb_is_taken);
+    sp_set(exec1_btb_target, spro->exec0_btb_target);
 
   }
   if (is_pipe_stalled) {
-    sprn->exec1_active = 0;
+    sp_set(exec1_active, 0);
   }
   if (!(spro->exec0_active)) {
-    sprn->exec1_active = 0;
+    sp_set(exec1_active, 0);
   }
 	
   // exec1
   if (spro->exec1_active) {
-    printInstruction(spro);
-    printExecution(spro);
+    int trace_reg = 0, trace_flags = 0, trace_value = 0;
+
+    if (inst_trace_fp) {
+      printInstruction(spro);
+      printExecution(spro);
+    }
+    nr_simulated_instructions += 1;
 
-    sprn->mem_stall = 0;
+    sp_set(mem_stall, 0);
     int btb_addr = spro->exec1_pc % BTB_SIZE;
     btb_is_taken[btb_addr] = 0;
 
@@ -579,24 +816,31 @@ static void sp_ctl(sp_t *sp)
     case XOR:
     case LHI:
       if (spro->exec1_dst > 1) {
-	sprn->r[spro->exec1_dst] = spro->exec1_aluout;
+	sp_set(r[spro->exec1_dst], spro->exec1_aluout);
+	trace_reg = spro->exec1_dst;
       }
+      trace_value = spro->exec1_aluout;
       break;
 
     case LD:
       if (spro->exec1_dst > 1) {
-        sprn->mem_SRAM_DO = llsim_mem_extract_dataout(sp->sramd, 31, 0);
-	sprn->r[spro->exec1_dst] = sprn->mem_SRAM_DO;
-        sprn->mem_stall = 1;
-        sprn->mem_dst = spro->exec1_dst;
-	fprintf(inst_trace_fp, ">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n", spro->exec1_dst, spro->exec1_alu1, sprn->r[spro->exec1_dst]);
+        sp_set(mem_SRAM_DO, llsim_mem_extract_dataout(sp->sramd, 31, 0));
+	sp_set(r[spro->exec1_dst], sprn->mem_SRAM_DO);
+        sp_set(mem_stall, 1);
+        sp_set(mem_dst, spro->exec1_dst);
+	trace_reg = spro->exec1_dst;
+	trace_value = sprn->mem_SRAM_DO;
+	if (inst_trace_fp)
+	  fprintf(inst_trace_fp, ">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n", spro->exec1_dst, spro->exec1_alu1, sprn->r[spro->exec1_dst]);
       }
       break;
 	    
     case ST:
       llsim_mem_set_datain(sp->sramd, spro->exec1_alu0, 31, 0);
       llsim_mem_write(sp->sramd, spro->exec1_alu1);
-      fprintf(inst_trace_fp, ">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n", spro->exec1_alu1, spro->exec1_src0, spro->exec1_alu0);
+      trace_value = spro->exec1_alu0;
+      if (inst_trace_fp)
+	fprintf(inst_trace_fp, ">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n", spro->exec1_alu1, spro->exec1_src0, spro->exec1_alu0);
       break;
     
     case DMA:
@@ -604,10 +848,10 @@ static void sp_ctl(sp_t *sp)
         // Suppress operation if DMA machine is already busy
         break;
       }
-      sprn->dma_busy = 1;
-      sprn->dma_src = spro->exec1_alu0;
-      sprn->dma_dst = spro->exec1_aluout;
-      sprn->dma_len = spro->exec1_alu1;
+      sp_set(dma_busy, 1);
+      sp_set(dma_src, spro->exec1_alu0);
+      sp_set(dma_dst, spro->exec1_aluout);
+      sp_set(dma_len, spro->exec1_alu1);
       break;
 
     case DMP:
@@ -619,7 +863,10 @@ static void sp_ctl(sp_t *sp)
 
       // Execute branch
       if (spro->exec1_aluout) {
-	sprn->r[7] = spro->exec1_pc;
+	sp_set(r[7], spro->exec1_pc);
+	trace_reg = 7;
+	trace_flags = BTRACE_TAKEN;
+	trace_value = spro->exec1_pc;
       }
 
       //update btb
@@ -627,26 +874,40 @@ static void sp_ctl(sp_t *sp)
       btb_target[btb_addr] = spro->exec1_immediate;
       
       is_flush_needed = ((spro->exec1_aluout != spro->exec1_btb_is_taken) || 
-			     (spro->exec1_aluout && (spro->exec1_btb_target != spro->exec1_immediate)));
+			     (spro->exec1_aluout && (spro->exec1_btb_target != (spro->exec1_immediate & 0xffff))));
       
       if (is_flush_needed) {
-	sprn->fetch1_active = sprn->dec0_active = sprn->dec1_active = 
-	  sprn->exec0_active = sprn->exec1_active = 0;
-	sprn->fetch0_pc = (spro->exec1_aluout) ? spro->exec1_immediate : spro->exec1_pc + 1;
+	sp_set(fetch1_active, 0);
+	sp_set(dec0_active, 0);
+	sp_set(dec1_active, 0);
+	sp_set(exec0_active, 0);
+	sp_set(exec1_active, 0);
+	sp_set(fetch0_pc, (spro->exec1_aluout) ? spro->exec1_immediate : spro->exec1_pc + 1);
       }
       
       break;
 
     case HLT:
-      fprintf(inst_trace_fp, ">>>> EXEC: HALT at PC %04x<<<<\n", spro->exec1_pc);
-      fprintf(inst_trace_fp, "sim finished at pc %d, %d instructions\n", spro->exec1_pc, nr_simulated_instructions);
+      if (inst_trace_fp) {
+	fprintf(inst_trace_fp, ">>>> EXEC: HALT at PC %04x<<<<\n", spro->exec1_pc);
+	fprintf(inst_trace_fp, "sim finished at pc %d, %d instructions\n", spro->exec1_pc, nr_simulated_instructions);
+      }
       llsim_stop();
       dump_sram(sp, "srami_out.txt", sp->srami);
       dump_sram(sp, "sramd_out.txt", sp->sramd);
       break;
     }
+
+    if (cosim)
+      cosim_step(spro, sprn);
+    if (sample_iss)
+      sample_retire(spro);
     
-    
+    if (inst_btrace) {
+      btrace_write(inst_btrace, spro->exec1_pc, spro->exec1_inst, trace_reg, trace_flags, trace_value);
+      if (spro->exec1_opcode == HLT)
+	btrace_close(inst_btrace);
+    }
   }
 }
 
@@ -655,6 +916,14 @@ static int is_dma_hazard(sp_registers_t *sp) {
 	  (sp->exec1_active && sp->exec1_opcode == ST));
 }
 
+static void dma_write(sp_t *sp, int data, int addr)
+{
+  llsim_mem_set_datain(sp->sramd, data, 31, 0);
+  llsim_mem_write(sp->sramd, addr);
+  if (cosim)
+    iss_write(cosim, addr, data);
+}
+
 static void dma_ctl(sp_t *sp)
 {
   sp_registers_t *spro = sp->spro;
@@ -669,7 +938,7 @@ static void dma_ctl(sp_t *sp)
   fprintf(dma_trace_fp, "dma_do_dirty %08x\n", spro->dma_do_dirty);
   fprintf(dma_trace_fp, "dma_state %08x\n", spro->dma_state);
   
-  sprn->cycle_counter = spro->cycle_counter + 1;
+  sp_set(cycle_counter, spro->cycle_counter + 1);
   
   switch (spro->dma_state) {
     
@@ -677,9 +946,13 @@ static void dma_ctl(sp_t *sp)
     // Idle state for DMA machine
     if (spro->dma_busy && (spro->dma_len > 0)) {
       // DMA operation requested, start copy
-      sprn->dma_state = DMA_STATE_READ_FIRST;
+      sp_set(dma_state, DMA_STATE_READ_FIRST);
     } else {
-      spro->dma_busy = 0;
+      // a copy of no words is done at once, and sp_ctl only starts one when not busy
+      if (spro->dma_busy)
+        sp_set(dma_busy, 0);
+      // nothing to do until sp_ctl starts a copy
+      llsim_unit_sleep(sp->dma_unit);
     }
     break;
   
@@ -687,20 +960,20 @@ static void dma_ctl(sp_t *sp)
     // Check for hazards
     if (is_dma_hazard(spro)) {
       // Stall
-      sprn->dma_state = spro->dma_state;
+      sp_set(dma_state, spro->dma_state);
       fprintf(dma_trace_fp, "Stalled in DMA_STATE_READ_FIRST\n");
       break;
     }
     // Read from memory
     llsim_mem_read(sp->sramd, spro->dma_src & 0xffff);
-    sprn->dma_src = spro->dma_src + 1;
-    sprn->dma_do_dirty = 1;
+    sp_set(dma_src, spro->dma_src + 1);
+    sp_set(dma_do_dirty, 1);
 
     //edge case: copy single word
     if(spro->dma_len == 1) {
-      sprn->dma_state = DMA_STATE_DO;
+      sp_set(dma_state, DMA_STATE_DO);
     } else {
-      sprn->dma_state = DMA_STATE_DO_READ;
+      sp_set(dma_state, DMA_STATE_DO_READ);
     }
     break;
   
@@ -708,22 +981,22 @@ static void dma_ctl(sp_t *sp)
     
     //copy data from memory bus to register
     if (spro->dma_do_dirty) {
-      sprn->dma_reg = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+      sp_set(dma_reg, llsim_mem_extract_dataout(sp->sramd, 31, 0));
     }
-    sprn->dma_do_dirty = 0;
+    sp_set(dma_do_dirty, 0);
     
     // Check for hazards
     if (is_dma_hazard(spro)) {
       // Stall
-      sprn->dma_state = spro->dma_state;
+      sp_set(dma_state, spro->dma_state);
       fprintf(dma_trace_fp, "Stalled in DMA_STATE_DO_READ\n");
       break;
     }
         
     llsim_mem_read(sp->sramd, spro->dma_src & 0xffff);
-    sprn->dma_src = spro->dma_src + 1;
-    sprn->dma_do_dirty = 1;
-    sprn->dma_state = DMA_STATE_DO_WRITE;
+    sp_set(dma_src, spro->dma_src + 1);
+    sp_set(dma_do_dirty, 1);
+    sp_set(dma_state, DMA_STATE_DO_WRITE);
     break;
   
   case DMA_STATE_DO_WRITE:
@@ -731,30 +1004,29 @@ static void dma_ctl(sp_t *sp)
     // Check for hazards
     if (is_dma_hazard(spro)) {
       // Stall
-      sprn->dma_state = DMA_STATE_WRITE_STALLED;
-      sprn->dma_reg2 = llsim_mem_extract_dataout(sp->sramd, 31, 0);
-      sprn->dma_do_dirty = 0;
+      sp_set(dma_state, DMA_STATE_WRITE_STALLED);
+      sp_set(dma_reg2, llsim_mem_extract_dataout(sp->sramd, 31, 0));
+      sp_set(dma_do_dirty, 0);
       fprintf(dma_trace_fp, "Stalled in DMA_STATE_DO_WRITE\n");
       break;
     }
 
     //copy data from memory bus to register
     if (spro->dma_do_dirty) {
-      sprn->dma_reg = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+      sp_set(dma_reg, llsim_mem_extract_dataout(sp->sramd, 31, 0));
     }
-    sprn->dma_do_dirty = 0;
+    sp_set(dma_do_dirty, 0);
     
     // Write to memory
-    llsim_mem_set_datain(sp->sramd, spro->dma_reg, 31, 0);
-    llsim_mem_write(sp->sramd, spro->dma_dst & 0xffff);
+    dma_write(sp, spro->dma_reg, spro->dma_dst & 0xffff);
     
-    sprn->dma_dst = spro->dma_dst + 1;
-    sprn->dma_len = spro->dma_len - 1;
+    sp_set(dma_dst, spro->dma_dst + 1);
+    sp_set(dma_len, spro->dma_len - 1);
     if (spro->dma_len == 2) {
-      sprn->dma_state = DMA_STATE_WRITE_LAST;
+      sp_set(dma_state, DMA_STATE_WRITE_LAST);
     } else {
       //Next iteration
-      sprn->dma_state = DMA_STATE_DO_READ;
+      sp_set(dma_state, DMA_STATE_DO_READ);
     }
     break;
 
@@ -762,23 +1034,22 @@ static void dma_ctl(sp_t *sp)
     // Check for hazards
     if (is_dma_hazard(spro)) {
       // Stall
-      sprn->dma_state = spro->dma_state;
+      sp_set(dma_state, spro->dma_state);
       fprintf(dma_trace_fp, "Stalled in DMA_STATE_WRITE_LAST\n");
       break;
     }
     // Write to memory
-    llsim_mem_set_datain(sp->sramd, spro->dma_reg, 31, 0);
-    llsim_mem_write(sp->sramd, spro->dma_dst & 0xffff);
+    dma_write(sp, spro->dma_reg, spro->dma_dst & 0xffff);
     
-    sprn->dma_dst = spro->dma_dst + 1;
-    sprn->dma_len = spro->dma_len - 1;
+    sp_set(dma_dst, spro->dma_dst + 1);
+    sp_set(dma_len, spro->dma_len - 1);
 
-    sprn->dma_reg = spro->dma_reg2;
+    sp_set(dma_reg, spro->dma_reg2);
     if (spro->dma_len == 2) {
-      sprn->dma_state = DMA_STATE_WRITE_LAST;
+      sp_set(dma_state, DMA_STATE_WRITE_LAST);
     } else {
       //Next iteration
-      sprn->dma_state = DMA_STATE_DO_READ;
+      sp_set(dma_state, DMA_STATE_DO_READ);
     }
     break;
 
@@ -786,22 +1057,21 @@ static void dma_ctl(sp_t *sp)
     // Check for hazards
     if (is_dma_hazard(spro)) {
       // Stall
-      sprn->dma_state = spro->dma_state;
+      sp_set(dma_state, spro->dma_state);
       fprintf(dma_trace_fp, "Stalled in DMA_STATE_WRITE_LAST\n");
       break;
     }
 
     //Write last word
-    llsim_mem_set_datain(sp->sramd, spro->dma_reg, 31, 0);
-    llsim_mem_write(sp->sramd, spro->dma_dst & 0xffff);
+    dma_write(sp, spro->dma_reg, spro->dma_dst & 0xffff);
     
-    sprn->dma_busy = 0;
-    sprn->dma_state = DMA_STATE_IDLE;
+    sp_set(dma_busy, 0);
+    sp_set(dma_state, DMA_STATE_IDLE);
     break;
   
   case DMA_STATE_DO:
-    sprn->dma_reg = llsim_mem_extract_dataout(sp->sramd, 31, 0);
-    sprn->dma_state = DMA_STATE_WRITE_LAST;
+    sp_set(dma_reg, llsim_mem_extract_dataout(sp->sramd, 31, 0));
+    sp_set(dma_state, DMA_STATE_WRITE_LAST);
     break;
   }
 
@@ -816,6 +1086,10 @@ static void sp_run(llsim_unit_t *unit)
 
   //	llsim_printf("-------------------------\n");
 
+  sp->spro = sp->regs->old;
+  sp->sprn = sp->regs->new;
+  sp->ctl_ran = 0;
+
   if (llsim->reset) {
     sp_reset(sp);
     return;
@@ -826,77 +1100,229 @@ static void sp_run(llsim_unit_t *unit)
   sp->sramd->read = 0;
   sp->sramd->write = 0;
 
+  if (sample_pending) {
+    sample_next(sp);
+    return;
+  }
+
   sp_ctl(sp);
-  dma_ctl(sp);
+  sp->ctl_ran = 1;
+}
+
+// The dma unit, run after sp on the sp registers
+static void dma_run(llsim_unit_t *unit)
+{
+  sp_t *sp = (sp_t *) unit->private;
+
+  if (sp->ctl_ran)
+    dma_ctl(sp);
+}
+
+// The program in sramd, one copy of the words that both srams map copy on write
+static void sp_share_program(sp_t *sp, char *program_name)
+{
+  image_shared_t *shared;
+
+  if (inst_trace_fp)
+    fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, sp->memory_image_size);
+
+  shared = image_share((unsigned int *) sp->sramd->data, SP_SRAM_HEIGHT);
+  if (shared == NULL || image_map(shared, (unsigned int *) sp->srami->data, 0, SP_SRAM_HEIGHT) != 0)
+    memcpy(sp->srami->data, sp->sramd->data, SP_SRAM_HEIGHT * sizeof(int));
+  image_unshare(shared);
 }
 
 static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
 {
   FILE *fp;
-  int addr, i;
+  unsigned int *data;
+  spasm_result_t result;
+  int addr, size, entry;
+
+  // sources are assembled straight into sramd, then shared like hex text
+  if (spasm_is_source(program_name)) {
+    if (spasm_assemble_file(program_name, (unsigned int *) sp->sramd->data, SP_SRAM_HEIGHT, 0, &result) != 0) {
+      printf("%s\n", result.error);
+      exit(1);
+    }
+    sp->memory_image_size = result.size;
+    sp->entry = result.entry;
+    sp_share_program(sp, program_name);
+    return;
+  }
+
+  // binary images are mapped into both srams, no per word parsing
+  switch (image_load(program_name, (unsigned int *) sp->srami->data, SP_SRAM_HEIGHT, &sp->memory_image_size, &sp->entry)) {
+  case 0:
+    if (image_load(program_name, (unsigned int *) sp->sramd->data, SP_SRAM_HEIGHT, &size, &entry) != 0) {
+      printf("couldn't load file %s\n", program_name);
+      exit(1);
+    }
+    if (inst_trace_fp)
+      fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, sp->memory_image_size);
+    return;
+  case IMAGE_NOT_IMAGE:
+    break;
+  case -1:
+    printf("couldn't open file %s\n", program_name);
+    exit(1);
+  default:
+    printf("couldn't load file %s\n", program_name);
+    exit(1);
+  }
 
   fp = fopen(program_name, "r");
   if (fp == NULL) {
     printf("couldn't open file %s\n", program_name);
     exit(1);
   }
+  data = (unsigned int *) sp->sramd->data;
   addr = 0;
   while (addr < SP_SRAM_HEIGHT) {
-    fscanf(fp, "%08x\n", &sp->memory_image[addr]);
-    //              printf("addr %x: %08x\n", addr, sp->memory_image[addr]);
+    fscanf(fp, "%08x\n", &data[addr]);
     addr++;
     if (feof(fp))
       break;
   }
+  fclose(fp);
   sp->memory_image_size = addr;
+  sp_share_program(sp, program_name);
+}
 
-  fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, addr);
-
-  for (i = 0; i < sp->memory_image_size; i++) {
-    llsim_mem_inject(sp->srami, i, sp->memory_image[i], 31, 0);
-    llsim_mem_inject(sp->sramd, i, sp->memory_image[i], 31, 0);
+// llsim hands over the options it doesn't take itself
+int sp_option(char *option, char *arg)
+{
+  if (strcmp(option, "-b") == 0 && arg) {
+    binary_trace = arg;
+    return 2;
   }
+  if (strcmp(option, "-c") == 0) {
+    cosim_enabled = 1;
+    return 1;
+  }
+  if (strcmp(option, "-s") == 0 && arg &&
+      sscanf(arg, "%d,%d,%d", &sample_period, &sample_warmup, &sample_measure) == 3 &&
+      sample_measure > 0 && sample_warmup >= 0 && sample_period >= sample_warmup + sample_measure)
+    return 2;
+  return 0;
+}
+
+void sp_usage(void)
+{
+  printf("  design options: [-b trace_file] [-c] [-s period,warmup,measure]\n");
+  printf("  -b writes the instruction trace in binary (see lab1/btrace.h), -c checks every retired instruction against the iss\n");
+  printf("  -s runs the iss, and the pipeline for warmup then measure instructions of every period, for an estimate of the CPI\n");
 }
 
 void sp_init(char *program_name)
 {
-  llsim_unit_t *llsim_sp_unit;
+  llsim_unit_t *llsim_sp_unit, *llsim_dma_unit;
   llsim_unit_registers_t *llsim_ur;
   sp_t *sp;
+  char name[8];
+  int i;
 
-  llsim_printf("initializing sp unit\n");
+  llsim_log(LLSIM_LOG_INFO, "initializing sp unit\n");
 
-  inst_trace_fp = fopen("inst_trace.txt", "w");
-  if (inst_trace_fp == NULL) {
-    printf("couldn't open file inst_trace.txt\n");
+  if (sample_period && (cosim_enabled || binary_trace)) {
+    printf("sampling runs without -b and -c\n");
     exit(1);
   }
 
-  cycle_trace_fp = fopen("cycle_trace.txt", "w");
+  // the iss and the binary trace don't go back with the design
+  if ((llsim->resume || llsim->travel) && (cosim_enabled || binary_trace || sample_period)) {
+    printf("resuming and time travel run without -b, -c and -s\n");
+    exit(1);
+  }
+
+  // a sampled run only traces its windows, which are of no use alone
+  if (!binary_trace && !sample_period) {
+    inst_trace_fp = fopen("inst_trace.txt", "w");
+    if (inst_trace_fp == NULL) {
+      printf("couldn't open file inst_trace.txt\n");
+      exit(1);
+    }
+  }
+
+  cycle_trace_fp = fopen(sample_period ? "/dev/null" : "cycle_trace.txt", "w");
   if (cycle_trace_fp == NULL) {
     printf("couldn't open file cycle_trace.txt\n");
     exit(1);
   }
 
-  dma_trace_fp = fopen("dma_trace.txt", "w");
+  dma_trace_fp = fopen(sample_period ? "/dev/null" : "dma_trace.txt", "w");
   if (dma_trace_fp == NULL) {
     printf("couldn't open file dma_trace.txt\n");
     exit(1);
   }
 
 
+  // units run in the reverse order of their registration, dma after sp
+  llsim_dma_unit = llsim_register_unit("dma", dma_run);
   llsim_sp_unit = llsim_register_unit("sp", sp_run);
-  llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
+  llsim_ur = llsim_allocate_tracked_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
   sp = llsim_malloc(sizeof(sp_t));
   llsim_sp_unit->private = sp;
+  sp->unit = llsim_sp_unit;
+  sp->regs = llsim_ur;
+  llsim_dma_unit->private = sp;
+  sp->dma_unit = llsim_dma_unit;
   sp->spro = llsim_ur->old;
   sp->sprn = llsim_ur->new;
+#define SP_REGISTER_FIELD(stage, name, bits, reset, trace)		\
+  llsim_register_field(llsim_sp_unit, llsim_ur, #stage, #name, bits, reset, &sp->sprn->name, sizeof(sp->sprn->name));
+  for (i = 2; i <= 7; i++) {
+    sprintf(name, "r%d", i);
+    llsim_register_field(llsim_sp_unit, llsim_ur, "regs", name, 32, 0, &sp->sprn->r[i], sizeof(int));
+  }
+  SP_REGISTERS(SP_REGISTER_FIELD)
+  llsim_unit_wake_on_register(llsim_dma_unit, llsim_ur, &sp->sprn->dma_busy, sizeof(sp->sprn->dma_busy));
+  llsim_unit_wake_on_register(llsim_dma_unit, llsim_ur, &sp->sprn->dma_len, sizeof(sp->sprn->dma_len));
+  // both write the sp registers, and dma_ctl goes by ctl_ran and is_pipe_stalled as sp_ctl sets them
+  llsim_limit_threads(1, "sp and dma share their registers");
 
   sp->srami = llsim_allocate_memory(llsim_sp_unit, "srami", 32, SP_SRAM_HEIGHT, 0);
   sp->sramd = llsim_allocate_memory(llsim_sp_unit, "sramd", 32, SP_SRAM_HEIGHT, 0);
   sp_generate_sram_memory_image(sp, program_name);
 
+  if (binary_trace) {
+    inst_btrace = btrace_open(binary_trace, BTRACE_FLAVOR_SP, program_name, sp->memory_image_size);
+    if (inst_btrace == NULL) {
+      printf("couldn't open file %s\n", binary_trace);
+      exit(1);
+    }
+  }
+
+  if (cosim_enabled || sample_period) {
+    iss_null_fp = fopen("/dev/null", "w");
+    if (cosim_enabled)
+      cosim = iss_create();
+    else
+      sample_iss = iss_create();
+    if (iss_null_fp == NULL || (cosim == NULL && sample_iss == NULL) ||
+	iss_load(cosim ? cosim : sample_iss, program_name) != 0) {
+      printf("couldn't load file %s into the iss\n", program_name);
+      exit(1);
+    }
+    // the first window ends where the first period does
+    sample_at = sample_period - sample_warmup - sample_measure;
+    sample_pending = sample_period != 0;
+  }
+
   sp->start = 1;
+
+  // state outside the registers and srams, for llsim -C and -R
+  llsim_checkpoint_private(llsim_sp_unit, "nr_simulated_instructions", &nr_simulated_instructions, sizeof(int));
+  llsim_checkpoint_private(llsim_sp_unit, "btb_is_taken", btb_is_taken, sizeof(btb_is_taken));
+  llsim_checkpoint_private(llsim_sp_unit, "btb_target", btb_target, sizeof(btb_target));
+  llsim_checkpoint_private(llsim_sp_unit, "is_pipe_stalled", &is_pipe_stalled, sizeof(int));
+  llsim_checkpoint_private(llsim_sp_unit, "start", &sp->start, sizeof(int));
+  llsim_checkpoint_private(llsim_sp_unit, "ctl_ran", &sp->ctl_ran, sizeof(int));
+  // and the traces, cut back with the design by llsim -T
+  if (inst_trace_fp)
+    llsim_travel_file(inst_trace_fp);
+  llsim_travel_file(cycle_trace_fp);
+  llsim_travel_file(dma_trace_fp);
 	
   // c2v_translate_end
 } 